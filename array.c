@@ -0,0 +1,492 @@
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bulk operations over unboxed integer arrays. The kernels are plain
+ * loops over restrict-qualified pointers so that the compiler can
+ * vectorize them; on x86-64 an AVX2 clone is selected at load time
+ * when the CPU supports it.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KERNEL static __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL static
+#endif
+
+KERNEL long kernel_sum(const long *restrict a, long n)
+{
+	long i, sum = 0;
+	for (i = 0; i < n; ++i)
+		sum += a[i];
+	return sum;
+}
+
+KERNEL long kernel_dot(const long *restrict a, const long *restrict b, long n)
+{
+	long i, sum = 0;
+	for (i = 0; i < n; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+KERNEL long kernel_min(const long *restrict a, long n)
+{
+	long i, min = a[0];
+	for (i = 1; i < n; ++i)
+		min = a[i] < min ? a[i] : min;
+	return min;
+}
+
+KERNEL long kernel_max(const long *restrict a, long n)
+{
+	long i, max = a[0];
+	for (i = 1; i < n; ++i)
+		max = a[i] > max ? a[i] : max;
+	return max;
+}
+
+KERNEL void kernel_add(long *restrict r, const long *restrict a,
+	const long *restrict b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i)
+		r[i] = a[i] + b[i];
+}
+
+KERNEL void kernel_sub(long *restrict r, const long *restrict a,
+	const long *restrict b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i)
+		r[i] = a[i] - b[i];
+}
+
+KERNEL void kernel_mul(long *restrict r, const long *restrict a,
+	const long *restrict b, long n)
+{
+	long i;
+	for (i = 0; i < n; ++i)
+		r[i] = a[i] * b[i];
+}
+
+KERNEL void kernel_scale(long *restrict r, const long *restrict a, long k,
+	long n)
+{
+	long i;
+	for (i = 0; i < n; ++i)
+		r[i] = a[i] * k;
+}
+
+static void kernel_prefix_sum(long *restrict r, const long *restrict a, long n)
+{
+	long i, sum = 0;
+	for (i = 0; i < n; ++i) {
+		sum += a[i];
+		r[i] = sum;
+	}
+}
+
+enum Compare {
+	Compare_Less,
+	Compare_LessEq,
+	Compare_Eq,
+	Compare_GreaterEq,
+	Compare_Greater
+};
+
+/* Branch-free compaction: always store, advance only on a match */
+KERNEL long kernel_filter(long *restrict r, const long *restrict a,
+	enum Compare cmp, long k, long n)
+{
+	long i, j = 0;
+
+	switch (cmp) {
+	case Compare_Less:
+		for (i = 0; i < n; ++i) {
+			r[j] = a[i];
+			j += a[i] < k;
+		}
+		break;
+	case Compare_LessEq:
+		for (i = 0; i < n; ++i) {
+			r[j] = a[i];
+			j += a[i] <= k;
+		}
+		break;
+	case Compare_Eq:
+		for (i = 0; i < n; ++i) {
+			r[j] = a[i];
+			j += a[i] == k;
+		}
+		break;
+	case Compare_GreaterEq:
+		for (i = 0; i < n; ++i) {
+			r[j] = a[i];
+			j += a[i] >= k;
+		}
+		break;
+	case Compare_Greater:
+		for (i = 0; i < n; ++i) {
+			r[j] = a[i];
+			j += a[i] > k;
+		}
+		break;
+	}
+
+	return j;
+}
+
+static int get_array(Atom atom, struct Array **result)
+{
+	if (atom.type != AtomType_Array)
+		return Error_Type;
+	*result = atom.value.array;
+	return Error_OK;
+}
+
+int builtin_arrayp(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = (car(args).type == AtomType_Array) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+int builtin_make_array(Interp *ctx, Atom args, Atom *result)
+{
+	Atom k, fill = make_int(0);
+	long i;
+
+	if (nilp(args))
+		return Error_Args;
+
+	k = car(args);
+	if (!nilp(cdr(args))) {
+		if (!nilp(cdr(cdr(args))))
+			return Error_Args;
+		fill = car(cdr(args));
+	}
+
+	if (k.type != AtomType_Integer || fill.type != AtomType_Integer)
+		return Error_Type;
+	if (k.value.integer < 0)
+		return Error_Range;
+
+	*result = make_array(ctx, k.value.integer);
+	for (i = 0; i < k.value.integer; ++i)
+		result->value.array->items[i] = fill.value.integer;
+
+	return Error_OK;
+}
+
+int builtin_array_length(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	*result = make_int(a->length);
+
+	return Error_OK;
+}
+
+int builtin_array_ref(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Atom k;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	k = car(cdr(args));
+	if (k.type != AtomType_Integer)
+		return Error_Type;
+	if (k.value.integer < 0 || k.value.integer >= a->length)
+		return Error_Range;
+
+	*result = make_int(a->items[k.value.integer]);
+
+	return Error_OK;
+}
+
+int builtin_array_set(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Atom k, x;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	k = car(cdr(args));
+	x = car(cdr(cdr(args)));
+	if (k.type != AtomType_Integer || x.type != AtomType_Integer)
+		return Error_Type;
+	if (k.value.integer < 0 || k.value.integer >= a->length)
+		return Error_Range;
+
+	/* No write barrier: arrays hold no references */
+	a->items[k.value.integer] = x.value.integer;
+
+	*result = nil;
+
+	return Error_OK;
+}
+
+int builtin_list_to_array(Interp *ctx, Atom args, Atom *result)
+{
+	Atom p;
+	long i, n = 0;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	for (p = car(args); !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair || car(p).type != AtomType_Integer)
+			return Error_Type;
+		++n;
+	}
+
+	*result = make_array(ctx, n);
+	p = car(args);
+	for (i = 0; i < n; ++i) {
+		result->value.array->items[i] = car(p).value.integer;
+		p = cdr(p);
+	}
+
+	return Error_OK;
+}
+
+int builtin_array_to_list(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Atom p;
+	long i;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	*result = make_list(ctx, a->length, nil);
+	for (i = 0, p = *result; !nilp(p); ++i, p = cdr(p))
+		car(p) = make_int(a->items[i]);
+
+	return Error_OK;
+}
+
+int builtin_array_sum(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	*result = make_int(kernel_sum(a->items, a->length));
+
+	return Error_OK;
+}
+
+int builtin_array_dot(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a, *b;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (!err)
+		err = get_array(car(cdr(args)), &b);
+	if (err)
+		return err;
+	if (a->length != b->length)
+		return Error_Range;
+
+	*result = make_int(kernel_dot(a->items, b->items, a->length));
+
+	return Error_OK;
+}
+
+static int array_extremum(Interp *ctx, Atom args, Atom *result, int max)
+{
+	struct Array *a;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+	if (a->length == 0)
+		return Error_Range;
+
+	*result = make_int(max ? kernel_max(a->items, a->length)
+		: kernel_min(a->items, a->length));
+
+	return Error_OK;
+}
+
+int builtin_array_min(Interp *ctx, Atom args, Atom *result)
+{
+	return array_extremum(ctx, args, result, 0);
+}
+
+int builtin_array_max(Interp *ctx, Atom args, Atom *result)
+{
+	return array_extremum(ctx, args, result, 1);
+}
+
+static int array_elementwise(Interp *ctx, Atom args, Atom *result,
+	void (*kernel)(long *restrict, const long *restrict,
+		const long *restrict, long))
+{
+	struct Array *a, *b;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (!err)
+		err = get_array(car(cdr(args)), &b);
+	if (err)
+		return err;
+	if (a->length != b->length)
+		return Error_Range;
+
+	*result = make_array(ctx, a->length);
+	(*kernel)(result->value.array->items, a->items, b->items, a->length);
+
+	return Error_OK;
+}
+
+int builtin_array_add(Interp *ctx, Atom args, Atom *result)
+{
+	return array_elementwise(ctx, args, result, kernel_add);
+}
+
+int builtin_array_subtract(Interp *ctx, Atom args, Atom *result)
+{
+	return array_elementwise(ctx, args, result, kernel_sub);
+}
+
+int builtin_array_multiply(Interp *ctx, Atom args, Atom *result)
+{
+	return array_elementwise(ctx, args, result, kernel_mul);
+}
+
+int builtin_array_scale(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Atom k;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	k = car(cdr(args));
+	if (k.type != AtomType_Integer)
+		return Error_Type;
+
+	*result = make_array(ctx, a->length);
+	kernel_scale(result->value.array->items, a->items, k.value.integer,
+		a->length);
+
+	return Error_OK;
+}
+
+int builtin_array_prefix_sum(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	*result = make_array(ctx, a->length);
+	kernel_prefix_sum(result->value.array->items, a->items, a->length);
+
+	return Error_OK;
+}
+
+int builtin_array_filter(Interp *ctx, Atom args, Atom *result)
+{
+	struct Array *a;
+	long *scratch;
+	Atom op, k;
+	enum Compare cmp;
+	long n;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+
+	err = get_array(car(args), &a);
+	if (err)
+		return err;
+
+	op = car(cdr(args));
+	k = car(cdr(cdr(args)));
+	if (op.type != AtomType_Symbol || k.type != AtomType_Integer)
+		return Error_Type;
+
+	if (strcmp(op.value.symbol, "<") == 0)
+		cmp = Compare_Less;
+	else if (strcmp(op.value.symbol, "<=") == 0)
+		cmp = Compare_LessEq;
+	else if (strcmp(op.value.symbol, "=") == 0)
+		cmp = Compare_Eq;
+	else if (strcmp(op.value.symbol, ">=") == 0)
+		cmp = Compare_GreaterEq;
+	else if (strcmp(op.value.symbol, ">") == 0)
+		cmp = Compare_Greater;
+	else
+		return Error_Args;
+
+	/* Filter into a scratch buffer, then copy the matches */
+	scratch = malloc(a->length * sizeof(long));
+	n = kernel_filter(scratch, a->items, cmp, k.value.integer, a->length);
+
+	*result = make_array(ctx, n);
+	memcpy(result->value.array->items, scratch, n * sizeof(long));
+	free(scratch);
+
+	return Error_OK;
+}
@@ -1,6 +1,7 @@
 #include "lisp.h"
+#include <stdlib.h>
 
-int builtin_car(Atom args, Atom *result)
+int builtin_car(Interp *ctx, Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
@@ -15,7 +16,7 @@ int builtin_car(Atom args, Atom *result)
 	return Error_OK;
 }
 
-int builtin_cdr(Atom args, Atom *result)
+int builtin_cdr(Interp *ctx, Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
@@ -30,93 +31,192 @@ int builtin_cdr(Atom args, Atom *result)
 	return Error_OK;
 }
 
-int builtin_cons(Atom args, Atom *result)
+int builtin_cons(Interp *ctx, Atom args, Atom *result)
 {
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
 
-	*result = cons(car(args), car(cdr(args)));
+	*result = cons(ctx, car(args), car(cdr(args)));
 
 	return Error_OK;
 }
 
-int builtin_eq(Atom args, Atom *result)
+int builtin_list(Interp *ctx, Atom args, Atom *result)
 {
-	Atom a, b;
-	int eq;
+	/* A copy, since APPLY may pass a list the caller still holds */
+	*result = copy_list(ctx, args);
+	return Error_OK;
+}
+
+int builtin_append(Interp *ctx, Atom args, Atom *result)
+{
+	Atom a, p;
+	long n = 0;
 
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	if (!listp(car(args)))
+		return Error_Type;
 
-	if (a.type == b.type) {
-		switch (a.type) {
-		case AtomType_Nil:
-			eq = 1;
-			break;
-		case AtomType_Pair:
-		case AtomType_Closure:
-		case AtomType_Macro:
-			eq = (a.value.pair == b.value.pair);
-			break;
-		case AtomType_Symbol:
-			eq = (a.value.symbol == b.value.symbol);
-			break;
-		case AtomType_Integer:
-			eq = (a.value.integer == b.value.integer);
-			break;
-		case AtomType_Builtin:
-			eq = (a.value.builtin == b.value.builtin);
-			break;
-		}
-	} else {
-		eq = 0;
-	}
+	for (a = car(args); !nilp(a); a = cdr(a))
+		++n;
+
+	*result = make_list(ctx, n, car(cdr(args)));
+	for (p = *result, a = car(args); !nilp(a); p = cdr(p), a = cdr(a))
+		car(p) = car(a);
+
+	return Error_OK;
+}
+
+int builtin_reverse(Interp *ctx, Atom args, Atom *result)
+{
+	Atom a, p, *items;
+	long i, n = 0;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (!listp(car(args)))
+		return Error_Type;
+
+	for (a = car(args); !nilp(a); a = cdr(a))
+		++n;
+
+	items = malloc(n * sizeof(Atom));
+	for (i = 0, a = car(args); i < n; ++i, a = cdr(a))
+		items[i] = car(a);
+
+	*result = make_list(ctx, n, nil);
+	for (p = *result; n > 0; p = cdr(p))
+		car(p) = items[--n];
+
+	free(items);
+	return Error_OK;
+}
+
+int builtin_eq(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	*result = atom_eq(car(args), car(cdr(args))) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+int builtin_equal(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
 
-	*result = eq ? make_sym("T") : nil;
+	*result = atom_equal(car(args), car(cdr(args))) ? ctx->sym_t : nil;
 	return Error_OK;
 }
 
-int builtin_pairp(Atom args, Atom *result)
+int builtin_pairp(Interp *ctx, Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
 
-	*result = (car(args).type == AtomType_Pair) ? make_sym("T") : nil;
+	*result = (car(args).type == AtomType_Pair) ? ctx->sym_t : nil;
 	return Error_OK;
 }
 
-int builtin_procp(Atom args, Atom *result)
+int builtin_procp(Interp *ctx, Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
 
 	*result = (car(args).type == AtomType_Builtin
-		|| car(args).type == AtomType_Closure) ? make_sym("T") : nil;
+		|| car(args).type == AtomType_Closure
+		|| car(args).type == AtomType_Continuation
+		|| car(args).type == AtomType_Compiled) ? ctx->sym_t : nil;
 	return Error_OK;
 }
 
-int builtin_add(Atom args, Atom *result)
+int builtin_add(Interp *ctx, Atom args, Atom *result)
 {
-	Atom a, b;
+	long sum = 0;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	for (; !nilp(args); args = cdr(args)) {
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		sum += car(args).value.integer;
+	}
+
+	*result = make_int(sum);
+
+	return Error_OK;
+}
+
+int builtin_subtract(Interp *ctx, Atom args, Atom *result)
+{
+	long x;
+
+	if (nilp(args))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	if (car(args).type != AtomType_Integer)
+		return Error_Type;
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	/* (- x) negates */
+	x = car(args).value.integer;
+	if (nilp(cdr(args)))
+		x = -x;
+
+	for (args = cdr(args); !nilp(args); args = cdr(args)) {
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		x -= car(args).value.integer;
+	}
+
+	*result = make_int(x);
+
+	return Error_OK;
+}
+
+int builtin_multiply(Interp *ctx, Atom args, Atom *result)
+{
+	long product = 1;
+
+	for (; !nilp(args); args = cdr(args)) {
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		product *= car(args).value.integer;
+	}
+
+	*result = make_int(product);
+
+	return Error_OK;
+}
+
+int builtin_divide(Interp *ctx, Atom args, Atom *result)
+{
+	long x;
+
+	if (nilp(args))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Integer)
 		return Error_Type;
 
-	*result = make_int(a.value.integer + b.value.integer);
+	/* (/ x) is the reciprocal */
+	x = car(args).value.integer;
+	if (nilp(cdr(args)))
+		x = 1 / x;
+
+	for (args = cdr(args); !nilp(args); args = cdr(args)) {
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		x /= car(args).value.integer;
+	}
+
+	*result = make_int(x);
 
 	return Error_OK;
 }
 
-int builtin_subtract(Atom args, Atom *result)
+int builtin_numeq(Interp *ctx, Atom args, Atom *result)
 {
 	Atom a, b;
 
@@ -129,12 +229,12 @@ int builtin_subtract(Atom args, Atom *result)
 	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
 		return Error_Type;
 
-	*result = make_int(a.value.integer - b.value.integer);
+	*result = (a.value.integer == b.value.integer) ? ctx->sym_t : nil;
 
 	return Error_OK;
 }
 
-int builtin_multiply(Atom args, Atom *result)
+int builtin_less(Interp *ctx, Atom args, Atom *result)
 {
 	Atom a, b;
 
@@ -147,62 +247,134 @@ int builtin_multiply(Atom args, Atom *result)
 	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
 		return Error_Type;
 
-	*result = make_int(a.value.integer * b.value.integer);
+	*result = (a.value.integer < b.value.integer) ? ctx->sym_t : nil;
 
 	return Error_OK;
 }
 
-int builtin_divide(Atom args, Atom *result)
+
+int builtin_vectorp(Interp *ctx, Atom args, Atom *result)
 {
-	Atom a, b;
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	*result = (car(args).type == AtomType_Vector) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+int builtin_make_vector(Interp *ctx, Atom args, Atom *result)
+{
+	Atom k, fill = nil;
+
+	if (nilp(args))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	k = car(args);
+	if (!nilp(cdr(args))) {
+		if (!nilp(cdr(cdr(args))))
+			return Error_Args;
+		fill = car(cdr(args));
+	}
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	if (k.type != AtomType_Integer)
 		return Error_Type;
+	if (k.value.integer < 0)
+		return Error_Range;
 
-	*result = make_int(a.value.integer / b.value.integer);
+	*result = make_vector(ctx, k.value.integer, fill);
 
 	return Error_OK;
 }
 
-int builtin_numeq(Atom args, Atom *result)
+int builtin_vector_length(Interp *ctx, Atom args, Atom *result)
 {
-	Atom a, b;
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Vector)
+		return Error_Type;
+
+	*result = make_int(car(args).value.vector->length);
+
+	return Error_OK;
+}
+
+int builtin_vector_ref(Interp *ctx, Atom args, Atom *result)
+{
+	Atom v, k;
 
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	v = car(args);
+	k = car(cdr(args));
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	if (v.type != AtomType_Vector || k.type != AtomType_Integer)
 		return Error_Type;
+	if (k.value.integer < 0 || k.value.integer >= v.value.vector->length)
+		return Error_Range;
 
-	*result = (a.value.integer == b.value.integer) ? make_sym("T") : nil;
+	*result = v.value.vector->items[k.value.integer];
 
 	return Error_OK;
 }
 
-int builtin_less(Atom args, Atom *result)
+int builtin_vector_set(Interp *ctx, Atom args, Atom *result)
 {
-	Atom a, b;
+	Atom v, k;
+	Atom *item;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	v = car(args);
+	k = car(cdr(args));
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	if (v.type != AtomType_Vector || k.type != AtomType_Integer)
 		return Error_Type;
+	if (k.value.integer < 0 || k.value.integer >= v.value.vector->length)
+		return Error_Range;
+	if (atom_constant(v))
+		return Error_Constant;
 
-	*result = (a.value.integer < b.value.integer) ? make_sym("T") : nil;
+	item = &v.value.vector->items[k.value.integer];
+	gc_barrier(ctx, *item);
+	*item = car(cdr(cdr(args)));
+
+	*result = nil;
 
 	return Error_OK;
 }
 
+int builtin_vector_to_list(Interp *ctx, Atom args, Atom *result)
+{
+	Atom v, p;
+	long i;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	v = car(args);
+	if (v.type != AtomType_Vector)
+		return Error_Type;
+
+	*result = make_list(ctx, v.value.vector->length, nil);
+	for (i = 0, p = *result; !nilp(p); ++i, p = cdr(p))
+		car(p) = v.value.vector->items[i];
+
+	return Error_OK;
+}
+
+int builtin_list_to_vector(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (!listp(car(args)))
+		return Error_Type;
+
+	*result = list_to_vector(ctx, car(args));
+
+	return Error_OK;
+}
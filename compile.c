@@ -0,0 +1,1169 @@
+#include "lisp.h"
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Ahead-of-time compiler. lisp -C out.c prog.lisp translates
+ * library.lisp and the given files to C, to be linked with every object
+ * except main.o (make prog.aot does both). Macros are expanded first by
+ * the compiling interpreter, so a macro body can only use library.lisp
+ * and the defmacros before it. Each lambda becomes a C function whose
+ * locals live in a rooted array v[]; variables that are both captured
+ * and assigned are boxed in a pair. Calls go through native_call, and
+ * calls in tail position return to it (see native.c).
+ */
+
+struct Names {
+	const char **names;
+	int count, size;
+};
+
+struct Var {
+	const char *name;
+	int slot, index, boxed;
+	struct Var *next;
+};
+
+/* C function being written */
+struct Func {
+	FILE *out;
+	char *text;
+	size_t len;
+	struct Var *scope;
+	int slots, max_slots, depth;
+};
+
+struct Compiler {
+	Interp *ctx;
+	FILE *funcs, *init;
+	char *funcs_text, *init_text;
+	size_t funcs_len, init_len;
+	struct Names syms, locals;
+	int functions, consts, failed;
+};
+
+static void names_push(struct Names *n, const char *name)
+{
+	if (n->count == n->size) {
+		n->size = n->size ? 2 * n->size : 16;
+		n->names = realloc(n->names, n->size * sizeof(char *));
+	}
+	n->names[n->count++] = name;
+}
+
+static int names_find(struct Names *n, const char *name)
+{
+	int i;
+
+	for (i = n->count - 1; i >= 0; --i)
+		if (n->names[i] == name)
+			return i;
+	return -1;
+}
+
+static int is(Atom a, const char *name)
+{
+	return a.type == AtomType_Symbol && strcmp(a.value.symbol, name) == 0;
+}
+
+static int list_length(Atom list)
+{
+	int n = 0;
+
+	for (; list.type == AtomType_Pair; list = cdr(list))
+		++n;
+	return n;
+}
+
+static void line(struct Func *f, const char *fmt, ...)
+{
+	va_list ap;
+	int i;
+
+	for (i = 0; i < f->depth + 1; ++i)
+		putc('\t', f->out);
+	va_start(ap, fmt);
+	vfprintf(f->out, fmt, ap);
+	va_end(ap);
+	putc('\n', f->out);
+}
+
+static void write_string(FILE *out, const char *s, long len)
+{
+	long i;
+
+	putc('"', out);
+	for (i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < ' ' || c > '~')
+			fprintf(out, "\\%03o", c);
+		else
+			putc(c, out);
+	}
+	putc('"', out);
+}
+
+/* EXPANSION */
+
+static int expand(struct Compiler *c, Atom x, Atom *result);
+
+static int expand_list(struct Compiler *c, Atom list, Atom *result)
+{
+	Atom first = nil;
+	struct Root root;
+	Error err;
+
+	if (list.type != AtomType_Pair) {
+		*result = list;
+		return Error_OK;
+	}
+
+	gc_protect(c->ctx, &root, &first, 1);
+	err = expand(c, car(list), &first);
+	if (!err)
+		err = expand_list(c, cdr(list), result);
+	if (!err)
+		*result = cons(c->ctx, first, *result);
+	c->ctx->roots = root.next;
+
+	return err;
+}
+
+static void bind_params(struct Compiler *c, Atom params)
+{
+	for (; params.type == AtomType_Pair; params = cdr(params))
+		if (car(params).type == AtomType_Symbol)
+			names_push(&c->locals, car(params).value.symbol);
+	if (params.type == AtomType_Symbol)
+		names_push(&c->locals, params.value.symbol);
+}
+
+/* Expand macros, and turn (define (f . params) ...) into a lambda */
+static int expand(struct Compiler *c, Atom x, Atom *result)
+{
+	Interp *ctx = c->ctx;
+	Atom op, a[2] = { nil, nil };
+	struct Root root;
+	Error err = Error_OK;
+	int n;
+
+	if (x.type != AtomType_Pair || !listp(x)) {
+		*result = x;
+		return Error_OK;
+	}
+
+	op = car(x);
+	if (op.type != AtomType_Symbol)
+		return expand_list(c, x, result);
+
+	gc_protect(ctx, &root, a, 2);
+
+	if (is(op, "QUOTE")) {
+		*result = x;
+	} else if (is(op, "LAMBDA") && !nilp(cdr(x))) {
+		n = c->locals.count;
+		bind_params(c, car(cdr(x)));
+		err = expand_list(c, cdr(cdr(x)), &a[0]);
+		c->locals.count = n;
+		if (!err)
+			*result = cons(ctx, op, cons(ctx, car(cdr(x)), a[0]));
+	} else if (is(op, "DEFINE") && !nilp(cdr(x))
+			&& car(cdr(x)).type == AtomType_Pair) {
+		Atom target = car(cdr(x));
+
+		a[0] = cons(ctx, ctx->sym_lambda,
+			cons(ctx, cdr(target), cdr(cdr(x))));
+		err = expand(c, a[0], &a[1]);
+		if (!err)
+			*result = cons(ctx, op, cons(ctx, car(target),
+				cons(ctx, a[1], nil)));
+	} else if (is(op, "DEFINE") || is(op, "SET!")) {
+		if (nilp(cdr(x))) {
+			*result = x;
+		} else {
+			err = expand_list(c, cdr(cdr(x)), &a[0]);
+			if (!err)
+				*result = cons(ctx, op, cons(ctx, car(cdr(x)), a[0]));
+		}
+	} else if (is(op, "DEFMACRO")) {
+		/* Later forms may use it at expansion time */
+		err = eval_expr(ctx, x, ctx->env, &a[0]);
+		if (!err)
+			*result = cons(ctx, ctx->sym_quote, cons(ctx, a[0], nil));
+	} else if (is(op, "IF") || is(op, "APPLY")
+			|| is(op, "CALL/CC") || is(op, "CALL/EC")) {
+		err = expand_list(c, cdr(x), &a[0]);
+		if (!err)
+			*result = cons(ctx, op, a[0]);
+	} else if (names_find(&c->locals, op.value.symbol) < 0
+			&& env_get(ctx->env, op, &a[0]) == Error_OK
+			&& a[0].type == AtomType_Macro) {
+		a[0].type = AtomType_Closure;
+		err = apply(ctx, a[0], cdr(x), &a[1]);
+		if (!err)
+			err = expand(c, a[1], result);
+	} else {
+		err = expand_list(c, x, result);
+	}
+
+	ctx->roots = root.next;
+
+	return err;
+}
+
+/* CONSTANTS */
+
+static int sym_index(struct Compiler *c, const char *name)
+{
+	int i = names_find(&c->syms, name);
+
+	if (i < 0) {
+		names_push(&c->syms, name);
+		i = c->syms.count - 1;
+	}
+	return i;
+}
+
+/* A C expression for a quoted value, built by init() if need be */
+static void constant(struct Compiler *c, Atom a, char *buf)
+{
+	char (*items)[64], tail[64];
+	int i, n, k;
+
+	switch (a.type) {
+	case AtomType_Nil:
+		strcpy(buf, "nil");
+		return;
+	case AtomType_Integer:
+		if (a.value.integer == LONG_MIN)
+			strcpy(buf, "make_int(LONG_MIN)");
+		else
+			sprintf(buf, "make_int(%ldL)", a.value.integer);
+		return;
+	case AtomType_Symbol:
+		sprintf(buf, "S[%d]", sym_index(c, a.value.symbol));
+		return;
+	case AtomType_String:
+		k = c->consts++;
+		fprintf(c->init, "\tK[%d] = make_string(ctx, ", k);
+		write_string(c->init, a.value.string->data, a.value.string->length);
+		fprintf(c->init, ", %ld);\n", a.value.string->length);
+		sprintf(buf, "K[%d]", k);
+		return;
+	case AtomType_Pair:
+		n = list_length(a);
+		items = malloc(n * sizeof(*items));
+		for (i = 0; i < n; ++i, a = cdr(a))
+			constant(c, car(a), items[i]);
+		constant(c, a, tail);
+		k = c->consts++;
+		fprintf(c->init, "\tK[%d] = %s;\n", k, tail);
+		while (n-- > 0)
+			fprintf(c->init, "\tK[%d] = cons(ctx, %s, K[%d]);\n", k, items[n], k);
+		free(items);
+		sprintf(buf, "K[%d]", k);
+		return;
+	case AtomType_Vector:
+		n = a.value.vector->length;
+		items = malloc(n * sizeof(*items));
+		for (i = 0; i < n; ++i)
+			constant(c, a.value.vector->items[i], items[i]);
+		k = c->consts++;
+		fprintf(c->init, "\tK[%d] = make_vector(ctx, %d, nil);\n", k, n);
+		for (i = 0; i < n; ++i)
+			fprintf(c->init, "\tK[%d].value.vector->items[%d] = %s;\n", k, i, items[i]);
+		free(items);
+		sprintf(buf, "K[%d]", k);
+		return;
+	default:
+		fprintf(stderr, "cannot compile a constant of this type\n");
+		c->failed = 1;
+		strcpy(buf, "nil");
+	}
+}
+
+/* The same, always in a K[] slot */
+static int constant_slot(struct Compiler *c, Atom a)
+{
+	char buf[64];
+	int k;
+
+	constant(c, a, buf);
+	if (sscanf(buf, "K[%d]", &k) == 1)
+		return k;
+
+	k = c->consts++;
+	fprintf(c->init, "\tK[%d] = %s;\n", k, buf);
+	return k;
+}
+
+/* ANALYSIS */
+
+static int binds(Atom params, const char *name)
+{
+	for (; params.type == AtomType_Pair; params = cdr(params))
+		if (car(params).value.symbol == name)
+			return 1;
+	return params.type == AtomType_Symbol && params.value.symbol == name;
+}
+
+/* ((lambda (params) body...) args...) is compiled like let */
+static int inline_lambda(Atom x)
+{
+	Atom fn = car(x), p;
+
+	if (fn.type != AtomType_Pair || !is(car(fn), "LAMBDA") || !listp(fn)
+			|| nilp(cdr(fn)) || nilp(cdr(cdr(fn))))
+		return 0;
+
+	for (p = car(cdr(fn)); p.type == AtomType_Pair; p = cdr(p))
+		if (car(p).type != AtomType_Symbol)
+			return 0;
+
+	return nilp(p) && list_length(car(cdr(fn))) == list_length(cdr(x));
+}
+
+/* Names defined directly in a body, excluding nested scopes */
+static void collect_defines(Atom x, struct Names *out)
+{
+	if (x.type != AtomType_Pair || !listp(x))
+		return;
+
+	if (is(car(x), "QUOTE") || is(car(x), "LAMBDA"))
+		return;
+
+	if (is(car(x), "DEFINE")) {
+		if (!nilp(cdr(x)) && car(cdr(x)).type == AtomType_Symbol) {
+			if (names_find(out, car(cdr(x)).value.symbol) < 0)
+				names_push(out, car(cdr(x)).value.symbol);
+			if (!nilp(cdr(cdr(x))))
+				collect_defines(car(cdr(cdr(x))), out);
+		}
+		return;
+	}
+
+	if (inline_lambda(x))
+		x = cdr(x);
+	for (; !nilp(x); x = cdr(x))
+		collect_defines(car(x), out);
+}
+
+static void collect_body_defines(Atom body, struct Names *out)
+{
+	for (; body.type == AtomType_Pair; body = cdr(body))
+		collect_defines(car(body), out);
+}
+
+static int assigned(Atom x, const char *name)
+{
+	if (x.type != AtomType_Pair || !listp(x) || is(car(x), "QUOTE"))
+		return 0;
+
+	if (is(car(x), "SET!") && !nilp(cdr(x))
+			&& car(cdr(x)).type == AtomType_Symbol
+			&& car(cdr(x)).value.symbol == name)
+		return 1;
+
+	for (; !nilp(x); x = cdr(x))
+		if (assigned(car(x), name))
+			return 1;
+	return 0;
+}
+
+static int defined_in(Atom body, const char *name)
+{
+	struct Names n = { NULL, 0, 0 };
+	int found;
+
+	collect_body_defines(body, &n);
+	found = names_find(&n, name) >= 0;
+	free(n.names);
+
+	return found;
+}
+
+/* Whether a lambda inside x refers to name */
+static int captured(Atom x, const char *name, int inside)
+{
+	Atom p;
+
+	if (x.type == AtomType_Symbol)
+		return inside && x.value.symbol == name;
+
+	if (x.type != AtomType_Pair || !listp(x) || is(car(x), "QUOTE"))
+		return 0;
+
+	if (is(car(x), "LAMBDA")) {
+		if (nilp(cdr(x)) || binds(car(cdr(x)), name)
+				|| defined_in(cdr(cdr(x)), name))
+			return 0;
+		for (p = cdr(cdr(x)); !nilp(p); p = cdr(p))
+			if (captured(car(p), name, 1))
+				return 1;
+		return 0;
+	}
+
+	if (inline_lambda(x)) {
+		for (p = cdr(x); !nilp(p); p = cdr(p))
+			if (captured(car(p), name, inside))
+				return 1;
+		if (binds(car(cdr(car(x))), name) || defined_in(cdr(cdr(car(x))), name))
+			return 0;
+		for (p = cdr(cdr(car(x))); !nilp(p); p = cdr(p))
+			if (captured(car(p), name, inside))
+				return 1;
+		return 0;
+	}
+
+	for (; !nilp(x); x = cdr(x))
+		if (captured(car(x), name, inside))
+			return 1;
+	return 0;
+}
+
+static int needs_box(Atom body, const char *name, int defined)
+{
+	Atom p;
+
+	for (p = body; p.type == AtomType_Pair; p = cdr(p))
+		if (captured(car(p), name, 0))
+			break;
+	if (nilp(p))
+		return 0;
+
+	if (defined)
+		return 1;
+	for (p = body; p.type == AtomType_Pair; p = cdr(p))
+		if (assigned(car(p), name))
+			return 1;
+	return 0;
+}
+
+static struct Var *lookup(struct Func *f, const char *name)
+{
+	struct Var *v;
+
+	for (v = f->scope; v; v = v->next)
+		if (v->name == name)
+			return v;
+	return NULL;
+}
+
+struct VarList {
+	struct Var **vars;
+	int count, size;
+};
+
+/* Variables of the enclosing function that x refers to */
+static void find_free(struct Func *f, Atom x, struct Names *bound,
+	struct VarList *out)
+{
+	struct Var *v;
+	Atom p;
+	int i, n;
+
+	if (x.type == AtomType_Symbol) {
+		if (names_find(bound, x.value.symbol) >= 0)
+			return;
+		v = lookup(f, x.value.symbol);
+		if (!v)
+			return;
+		for (i = 0; i < out->count; ++i)
+			if (out->vars[i] == v)
+				return;
+		if (out->count == out->size) {
+			out->size = out->size ? 2 * out->size : 8;
+			out->vars = realloc(out->vars, out->size * sizeof(struct Var *));
+		}
+		out->vars[out->count++] = v;
+		return;
+	}
+
+	if (x.type != AtomType_Pair || !listp(x) || is(car(x), "QUOTE"))
+		return;
+
+	if (is(car(x), "LAMBDA")) {
+		if (nilp(cdr(x)))
+			return;
+		n = bound->count;
+		for (p = car(cdr(x)); p.type == AtomType_Pair; p = cdr(p))
+			if (car(p).type == AtomType_Symbol)
+				names_push(bound, car(p).value.symbol);
+		if (p.type == AtomType_Symbol)
+			names_push(bound, p.value.symbol);
+		collect_body_defines(cdr(cdr(x)), bound);
+		for (p = cdr(cdr(x)); !nilp(p); p = cdr(p))
+			find_free(f, car(p), bound, out);
+		bound->count = n;
+		return;
+	}
+
+	for (; !nilp(x); x = cdr(x))
+		find_free(f, car(x), bound, out);
+}
+
+/* CODE GENERATION */
+
+static int alloc_slot(struct Func *f)
+{
+	int slot = f->slots++;
+
+	if (f->slots > f->max_slots)
+		f->max_slots = f->slots;
+	return slot;
+}
+
+static struct Var *push_var(struct Func *f, const char *name, int slot, int boxed)
+{
+	struct Var *v = malloc(sizeof(struct Var));
+
+	v->name = name;
+	v->slot = slot;
+	v->index = -1;
+	v->boxed = boxed;
+	v->next = f->scope;
+	f->scope = v;
+
+	return v;
+}
+
+static void pop_vars(struct Func *f, struct Var *until)
+{
+	while (f->scope != until) {
+		struct Var *v = f->scope;
+		f->scope = v->next;
+		free(v);
+	}
+}
+
+/* Where the variable's value, or its box, lives */
+static void var_location(struct Var *v, char *buf)
+{
+	if (v->slot >= 0)
+		sprintf(buf, "v[%d]", v->slot);
+	else
+		sprintf(buf, "SELF->vars[%d]", v->index);
+}
+
+static void fail(struct Func *f, const char *error)
+{
+	line(f, "err = %s;", error);
+	line(f, "goto out;");
+}
+
+static void finish(struct Func *f, int dest, int tail)
+{
+	if (tail) {
+		line(f, "*result = v[%d];", dest);
+		line(f, "goto out;");
+	}
+}
+
+static int gen(struct Compiler *c, struct Func *f, Atom x, int dest, int tail);
+static int gen_function(struct Compiler *c, int id, Atom params, Atom body,
+	struct VarList *captures, int toplevel);
+
+static int gen_body(struct Compiler *c, struct Func *f, Atom body, int dest, int tail)
+{
+	Error err = Error_OK;
+
+	if (nilp(body)) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	for (; !err && !nilp(body); body = cdr(body))
+		err = gen(c, f, car(body), dest, tail && nilp(cdr(body)));
+
+	return err;
+}
+
+/* Slots for the names defined in a body, unless already bound there */
+static void bind_defines(struct Func *f, Atom body, struct Var *outer)
+{
+	struct Names n = { NULL, 0, 0 };
+	struct Var *v;
+	int i;
+
+	collect_body_defines(body, &n);
+	for (i = 0; i < n.count; ++i) {
+		for (v = f->scope; v != outer; v = v->next)
+			if (v->name == n.names[i])
+				break;
+		if (v != outer)
+			continue;
+
+		v = push_var(f, n.names[i], alloc_slot(f), needs_box(body, n.names[i], 1));
+		line(f, "v[%d] = %s;", v->slot, v->boxed ? "cons(ctx, nil, nil)" : "nil");
+	}
+	free(n.names);
+}
+
+static void gen_ref(struct Compiler *c, struct Func *f, Atom sym, int dest)
+{
+	struct Var *v = lookup(f, sym.value.symbol);
+	char loc[64];
+	int i;
+
+	if (v) {
+		var_location(v, loc);
+		if (v->boxed)
+			line(f, "v[%d] = car(%s);", dest, loc);
+		else
+			line(f, "v[%d] = %s;", dest, loc);
+	} else {
+		i = sym_index(c, sym.value.symbol);
+		line(f, "GLOBAL(%d);", i);
+		line(f, "v[%d] = *G[%d];", dest, i);
+	}
+}
+
+static void gen_assign(struct Func *f, struct Var *v, int value)
+{
+	char loc[64];
+
+	var_location(v, loc);
+	if (v->boxed) {
+		line(f, "set_car(ctx, %s, v[%d]);", loc, value);
+	} else {
+		if (v->slot < 0)
+			line(f, "gc_barrier(ctx, %s);", loc);
+		line(f, "%s = v[%d];", loc, value);
+	}
+}
+
+static int gen_define(struct Compiler *c, struct Func *f, Atom args, int dest, int tail, int set)
+{
+	struct Var *v;
+	Atom sym;
+	Error err;
+	int i;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args)))) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	sym = car(args);
+	if (sym.type != AtomType_Symbol) {
+		fail(f, "Error_Type");
+		return Error_OK;
+	}
+
+	err = gen(c, f, car(cdr(args)), dest, 0);
+	if (err)
+		return err;
+
+	i = sym_index(c, sym.value.symbol);
+	v = lookup(f, sym.value.symbol);
+	if (v) {
+		gen_assign(f, v, dest);
+	} else if (set) {
+		line(f, "GLOBAL(%d);", i);
+		line(f, "gc_barrier(ctx, *G[%d]);", i);
+		line(f, "*G[%d] = v[%d];", i, dest);
+		line(f, "++ctx->env_version;");
+	} else {
+		line(f, "env_define(ctx, ctx->env, S[%d], v[%d]);", i, dest);
+	}
+
+	line(f, "v[%d] = S[%d];", dest, i);
+	finish(f, dest, tail);
+	return Error_OK;
+}
+
+static int gen_if(struct Compiler *c, struct Func *f, Atom args, int dest, int tail)
+{
+	Error err;
+
+	if (list_length(args) != 3) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	err = gen(c, f, car(args), dest, 0);
+	if (err)
+		return err;
+
+	line(f, "if (!nilp(v[%d])) {", dest);
+	++f->depth;
+	err = gen(c, f, car(cdr(args)), dest, tail);
+	--f->depth;
+	if (err)
+		return err;
+
+	line(f, "} else {");
+	++f->depth;
+	err = gen(c, f, car(cdr(cdr(args))), dest, tail);
+	--f->depth;
+	line(f, "}");
+
+	return err;
+}
+
+static int gen_lambda(struct Compiler *c, struct Func *f, Atom x, int dest, int tail)
+{
+	struct Names bound = { NULL, 0, 0 };
+	struct VarList captures = { NULL, 0, 0 };
+	Atom p;
+	char loc[64];
+	int id, i;
+	Error err;
+
+	if (nilp(cdr(x)) || nilp(cdr(cdr(x)))) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	for (p = car(cdr(x)); p.type == AtomType_Pair; p = cdr(p))
+		if (car(p).type != AtomType_Symbol)
+			break;
+	if (!nilp(p) && p.type != AtomType_Symbol) {
+		fail(f, "Error_Type");
+		return Error_OK;
+	}
+
+	find_free(f, x, &bound, &captures);
+	free(bound.names);
+
+	id = c->functions++;
+	err = gen_function(c, id, car(cdr(x)), cdr(cdr(x)), &captures, 0);
+	if (!err) {
+		line(f, "v[%d] = make_compiled(ctx, fn_%d, %d);", dest, id, captures.count);
+		for (i = 0; i < captures.count; ++i) {
+			var_location(captures.vars[i], loc);
+			line(f, "v[%d].value.compiled->vars[%d] = %s;", dest, i, loc);
+		}
+		finish(f, dest, tail);
+	}
+
+	free(captures.vars);
+	return err;
+}
+
+static int gen_let(struct Compiler *c, struct Func *f, Atom x, int dest, int tail)
+{
+	struct Var *outer = f->scope;
+	Atom params = car(cdr(car(x))), body = cdr(cdr(car(x))), p;
+	int slots = f->slots, base = f->slots, i;
+	Error err = Error_OK;
+
+	/* Arguments see the outer scope */
+	for (p = cdr(x); !err && !nilp(p); p = cdr(p))
+		err = gen(c, f, car(p), alloc_slot(f), 0);
+	if (err)
+		return err;
+
+	for (i = base, p = params; !nilp(p); ++i, p = cdr(p)) {
+		struct Var *v = push_var(f, car(p).value.symbol, i,
+			needs_box(body, car(p).value.symbol, 0));
+		if (v->boxed)
+			line(f, "v[%d] = cons(ctx, v[%d], nil);", i, i);
+	}
+
+	bind_defines(f, body, outer);
+	err = gen_body(c, f, body, dest, tail);
+
+	pop_vars(f, outer);
+	f->slots = slots;
+
+	return err;
+}
+
+static int gen_apply(struct Compiler *c, struct Func *f, Atom args, int dest, int tail)
+{
+	int base = f->slots;
+	Error err;
+
+	if (list_length(args) != 2) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	err = gen(c, f, car(args), alloc_slot(f), 0);
+	if (!err)
+		err = gen(c, f, car(cdr(args)), alloc_slot(f), 0);
+	if (err)
+		return err;
+
+	if (tail) {
+		line(f, "err = native_tail_apply(ctx, v[%d], v[%d]);", base, base + 1);
+		line(f, "goto out;");
+	} else {
+		line(f, "if ((err = native_apply(ctx, v[%d], v[%d], &v[%d])))",
+			base, base + 1, dest);
+		line(f, "\tgoto out;");
+	}
+
+	f->slots = base;
+	return Error_OK;
+}
+
+static int gen_call_cc(struct Compiler *c, struct Func *f, Atom args, int dest,
+	int tail, int escape)
+{
+	Error err;
+
+	if (list_length(args) != 1) {
+		fail(f, "Error_Args");
+		return Error_OK;
+	}
+
+	err = gen(c, f, car(args), dest, 0);
+	if (err)
+		return err;
+
+	line(f, "if ((err = native_call_cc(ctx, v[%d], %d, &v[%d])))", dest, escape, dest);
+	line(f, "\tgoto out;");
+	finish(f, dest, tail);
+
+	return Error_OK;
+}
+
+/* Builtins worth doing inline when the operands allow; $a and $b are
+ * the arguments and $t is T */
+static const struct {
+	const char *name, *builtin, *test, *value;
+	int argc;
+} inline_ops[] = {
+	{ "+", "builtin_add", "FIXNUMS($a, $b)", "make_int($a.value.integer + $b.value.integer)", 2 },
+	{ "-", "builtin_subtract", "FIXNUMS($a, $b)", "make_int($a.value.integer - $b.value.integer)", 2 },
+	{ "*", "builtin_multiply", "FIXNUMS($a, $b)", "make_int($a.value.integer * $b.value.integer)", 2 },
+	{ "=", "builtin_numeq", "FIXNUMS($a, $b)", "$a.value.integer == $b.value.integer ? $t : nil", 2 },
+	{ "<", "builtin_less", "FIXNUMS($a, $b)", "$a.value.integer < $b.value.integer ? $t : nil", 2 },
+	{ "EQ?", "builtin_eq", "1", "atom_eq($a, $b) ? $t : nil", 2 },
+	{ "CONS", "builtin_cons", "1", "cons(ctx, $a, $b)", 2 },
+	{ "CAR", "builtin_car", "$a.type == AtomType_Pair", "car($a)", 1 },
+	{ "CDR", "builtin_cdr", "$a.type == AtomType_Pair", "cdr($a)", 1 },
+	{ NULL }
+};
+
+static void expand_op(char *buf, const char *text, int a)
+{
+	for (; *text; ++text) {
+		if (*text != '$')
+			*buf++ = *text;
+		else if (*++text == 't')
+			buf += sprintf(buf, "S[0]");
+		else
+			buf += sprintf(buf, "v[%d]", *text == 'a' ? a : a + 1);
+	}
+	*buf = '\0';
+}
+
+static int gen_call(struct Compiler *c, struct Func *f, Atom x, int dest, int tail)
+{
+	int base = f->slots, argc = 0, i;
+	char test[256], value[256];
+	Atom p;
+	Error err;
+
+	err = gen(c, f, car(x), alloc_slot(f), 0);
+	for (p = cdr(x); !err && !nilp(p); p = cdr(p), ++argc)
+		err = gen(c, f, car(p), alloc_slot(f), 0);
+	if (err)
+		return err;
+
+	for (i = 0; inline_ops[i].name; ++i) {
+		if (is(car(x), inline_ops[i].name) && argc == inline_ops[i].argc
+				&& !lookup(f, car(x).value.symbol))
+			break;
+	}
+
+	if (inline_ops[i].name) {
+		expand_op(test, inline_ops[i].test, base + 1);
+		expand_op(value, inline_ops[i].value, base + 1);
+		line(f, "if (IS_BUILTIN(v[%d], %s) && %s)", base, inline_ops[i].builtin, test);
+		line(f, "\tv[%d] = %s;", dest, value);
+		line(f, "else if ((err = native_call(ctx, v[%d], &v[%d], %d, &v[%d])))",
+			base, base + 1, argc, dest);
+		line(f, "\tgoto out;");
+		finish(f, dest, tail);
+	} else if (tail) {
+		line(f, "err = native_tail(ctx, &v[%d], %d);", base, argc + 1);
+		line(f, "goto out;");
+	} else {
+		line(f, "if ((err = native_call(ctx, v[%d], &v[%d], %d, &v[%d])))",
+			base, base + 1, argc, dest);
+		line(f, "\tgoto out;");
+	}
+
+	f->slots = base;
+	return Error_OK;
+}
+
+static int gen(struct Compiler *c, struct Func *f, Atom x, int dest, int tail)
+{
+	char buf[64];
+	Atom op;
+
+	if (x.type == AtomType_Symbol) {
+		gen_ref(c, f, x, dest);
+		finish(f, dest, tail);
+		return Error_OK;
+	}
+
+	if (x.type != AtomType_Pair) {
+		constant(c, x, buf);
+		line(f, "v[%d] = %s;", dest, buf);
+		finish(f, dest, tail);
+		return Error_OK;
+	}
+
+	if (!listp(x)) {
+		fail(f, "Error_Syntax");
+		return Error_OK;
+	}
+
+	op = car(x);
+	if (is(op, "QUOTE")) {
+		if (nilp(cdr(x)) || !nilp(cdr(cdr(x)))) {
+			fail(f, "Error_Args");
+			return Error_OK;
+		}
+		constant(c, car(cdr(x)), buf);
+		line(f, "v[%d] = %s;", dest, buf);
+		finish(f, dest, tail);
+		return Error_OK;
+	}
+
+	if (is(op, "IF"))
+		return gen_if(c, f, cdr(x), dest, tail);
+	if (is(op, "LAMBDA"))
+		return gen_lambda(c, f, x, dest, tail);
+	if (is(op, "DEFINE"))
+		return gen_define(c, f, cdr(x), dest, tail, 0);
+	if (is(op, "SET!"))
+		return gen_define(c, f, cdr(x), dest, tail, 1);
+	if (is(op, "APPLY"))
+		return gen_apply(c, f, cdr(x), dest, tail);
+	if (is(op, "CALL/CC") || is(op, "CALL/EC"))
+		return gen_call_cc(c, f, cdr(x), dest, tail, is(op, "CALL/EC"));
+	if (inline_lambda(x))
+		return gen_let(c, f, x, dest, tail);
+
+	return gen_call(c, f, x, dest, tail);
+}
+
+static int gen_function(struct Compiler *c, int id, Atom params, Atom body,
+	struct VarList *captures, int toplevel)
+{
+	struct Func f;
+	struct Var *v, *outer;
+	Atom p;
+	int argc = 0, rest = -1, dest, i;
+	Error err;
+
+	memset(&f, 0, sizeof(f));
+	f.out = open_memstream(&f.text, &f.len);
+	f.slots = f.max_slots = 1;
+
+	for (i = 0; i < captures->count; ++i) {
+		v = push_var(&f, captures->vars[i]->name, -1, captures->vars[i]->boxed);
+		v->index = i;
+	}
+	outer = f.scope;
+
+	for (p = params; p.type == AtomType_Pair; p = cdr(p), ++argc)
+		push_var(&f, car(p).value.symbol, alloc_slot(&f),
+			needs_box(body, car(p).value.symbol, 0));
+	if (p.type == AtomType_Symbol) {
+		rest = alloc_slot(&f);
+		push_var(&f, p.value.symbol, rest, needs_box(body, p.value.symbol, 0));
+	}
+
+	for (v = f.scope; v && v->slot >= 0; v = v->next)
+		if (v->boxed)
+			line(&f, "v[%d] = cons(ctx, v[%d], nil);", v->slot, v->slot);
+
+	/* Top-level definitions are global */
+	if (!toplevel)
+		bind_defines(&f, body, outer);
+	dest = alloc_slot(&f);
+	err = gen_body(c, &f, body, dest, 1);
+
+	pop_vars(&f, NULL);
+	fclose(f.out);
+
+	if (!err) {
+		fprintf(c->funcs, "static int fn_%d(Interp *ctx, Atom self, Atom *args, "
+			"int argc, Atom *result)\n{\n", id);
+		fprintf(c->funcs, "\tAtom v[%d] = { { AtomType_Nil } };\n", f.max_slots);
+		fprintf(c->funcs, "\tstruct Root root;\n\tError err = Error_OK;\n\n");
+		fprintf(c->funcs, "\tif (argc %s %d)\n\t\treturn Error_Args;\n",
+			rest < 0 ? "!=" : "<", argc);
+		fprintf(c->funcs, "\tv[0] = self;\n");
+		for (i = 0; i < argc; ++i)
+			fprintf(c->funcs, "\tv[%d] = args[%d];\n", i + 1, i);
+		if (rest >= 0)
+			fprintf(c->funcs, "\tv[%d] = native_list(ctx, args + %d, argc - %d);\n",
+				rest, argc, argc);
+		fprintf(c->funcs, "\tgc_protect(ctx, &root, v, %d);\n", f.max_slots);
+		fprintf(c->funcs, "\tif (!ctx->parent)\n\t\tgc_safepoint(ctx);\n\n");
+		fwrite(f.text, 1, f.len, c->funcs);
+		fprintf(c->funcs, "out:\n\tctx->roots = root.next;\n\treturn err;\n}\n\n");
+	}
+
+	free(f.text);
+	return err;
+}
+
+/* PROGRAM */
+
+static const char *error_names[] = {
+	"Error_OK", "Error_Syntax", "Error_Unbound", "Error_Args", "Error_Type",
+	"Error_Range", "Error_Throw", "Error_Yield", "Error_Deadlock",
+	"Error_Constant", "Error_Tail"
+};
+
+static int read_program(struct Compiler *c, const char *path, int echo, Atom *forms)
+{
+	Interp *ctx = c->ctx;
+	Atom a[2] = { nil, nil };
+	struct Root root;
+	const char *p;
+	char *text;
+	Error err = Error_OK;
+
+	text = slurp(path);
+	if (!text) {
+		perror(path);
+		return Error_Syntax;
+	}
+
+	gc_protect(ctx, &root, a, 2);
+	p = text;
+	while (read_expr(ctx, p, &p, &a[0]) == Error_OK) {
+		/* A form that fails to expand reports the error when run */
+		err = expand(c, a[0], &a[1]);
+		if (err)
+			a[1] = make_int(err);
+
+		/* (echo source error . expanded) */
+		a[1] = cons(ctx, make_int(err), a[1]);
+		*forms = cons(ctx, cons(ctx, make_int(echo), cons(ctx, a[0], a[1])),
+			*forms);
+	}
+	ctx->roots = root.next;
+	free(text);
+
+	return Error_OK;
+}
+
+int compile_program(Interp *ctx, const char *output, char **paths, int count)
+{
+	struct Compiler c;
+	struct VarList none = { NULL, 0, 0 };
+	Atom forms = nil, p;
+	struct Root root;
+	FILE *out;
+	char *table = NULL;
+	size_t table_len = 0;
+	FILE *tab;
+	int i, n = 0;
+	Error err;
+
+	memset(&c, 0, sizeof(c));
+	c.ctx = ctx;
+	c.funcs = open_memstream(&c.funcs_text, &c.funcs_len);
+	c.init = open_memstream(&c.init_text, &c.init_len);
+	tab = open_memstream(&table, &table_len);
+	/* S[0] is T */
+	sym_index(&c, ctx->sym_t.value.symbol);
+
+	gc_protect(ctx, &root, &forms, 1);
+	err = read_program(&c, "library.lisp", 0, &forms);
+	for (i = 0; !err && i < count; ++i)
+		err = read_program(&c, paths[i], 1, &forms);
+
+	/* In reading order */
+	for (p = nil; !nilp(forms); forms = cdr(forms))
+		p = cons(ctx, car(forms), p);
+	forms = p;
+
+	for (p = forms; !err && !nilp(p); p = cdr(p), ++n) {
+		Atom form = car(p);
+		int id = c.functions++;
+
+		Error failed = car(cdr(cdr(form))).value.integer;
+
+		if (failed)
+			fprintf(c.funcs, "static int fn_%d(Interp *ctx, Atom self, Atom *args, "
+				"int argc, Atom *result)\n{\n\treturn %s;\n}\n\n",
+				id, error_names[failed]);
+		else
+			err = gen_function(&c, id, nil,
+				cons(ctx, cdr(cdr(cdr(form))), nil), &none, 1);
+		if (car(form).value.integer)
+			fprintf(tab, "\t{ fn_%d, &K[%d] },\n", id,
+				constant_slot(&c, car(cdr(form))));
+		else
+			fprintf(tab, "\t{ fn_%d, NULL },\n", id);
+	}
+	ctx->roots = root.next;
+
+	fclose(c.funcs);
+	fclose(c.init);
+	fclose(tab);
+
+	if (err || c.failed) {
+		print_error(err ? err : Error_Type);
+		err = 1;
+	} else if (!(out = fopen(output, "w"))) {
+		perror(output);
+		err = 1;
+	} else {
+		fprintf(out, "/* Generated by lisp -C */\n#include \"lisp.h\"\n"
+			"#include <limits.h>\n\n");
+		fprintf(out, "#define SELF (v[0].value.compiled)\n"
+			"#define GLOBAL(i) if (!G[i] && (err = native_global(ctx, S[i], &G[i]))) goto out\n"
+			"#define IS_BUILTIN(a, fn) ((a).type == AtomType_Builtin && (a).value.builtin == (fn))\n"
+			"#define FIXNUMS(a, b) ((a).type == AtomType_Integer && (b).type == AtomType_Integer)\n\n");
+		fprintf(out, "static Atom S[%d], *G[%d], K[%d];\n\n",
+			c.syms.count, c.syms.count, c.consts + 1);
+		for (i = 0; i < c.functions; ++i)
+			fprintf(out, "static int fn_%d(Interp *ctx, Atom self, Atom *args, "
+				"int argc, Atom *result);\n", i);
+		fprintf(out, "\n");
+		fwrite(c.funcs_text, 1, c.funcs_len, out);
+
+		fprintf(out, "static void init(Interp *ctx)\n{\n");
+		for (i = 0; i < c.syms.count; ++i) {
+			fprintf(out, "\tS[%d] = make_sym(ctx, ", i);
+			write_string(out, c.syms.names[i], strlen(c.syms.names[i]));
+			fprintf(out, ");\n");
+		}
+		fwrite(c.init_text, 1, c.init_len, out);
+		fprintf(out, "}\n\n");
+
+		fprintf(out, "static const struct NativeForm forms[] = {\n");
+		fwrite(table, 1, table_len, out);
+		fprintf(out, "};\n\n");
+
+		fprintf(out, "int main(void)\n{\n"
+			"\tInterp *ctx = interp_create();\n"
+			"\tstruct Root root, syms;\n\n"
+			"\tif (!ctx)\n\t\treturn 1;\n\n"
+			"\tgc_protect(ctx, &root, K, %d);\n"
+			"\tgc_protect(ctx, &syms, S, %d);\n"
+			"\tinit(ctx);\n"
+			"\tnative_run(ctx, forms, %d);\n"
+			"\tctx->roots = root.next;\n"
+			"\tinterp_destroy(ctx);\n\n"
+			"\treturn 0;\n}\n", c.consts + 1, c.syms.count, n);
+		fclose(out);
+	}
+
+	free(c.funcs_text);
+	free(c.init_text);
+	free(table);
+	free(c.syms.names);
+	free(c.locals.names);
+
+	return err;
+}
@@ -1,29 +1,59 @@
 #include "lisp.h"
+#include "probe.h"
 #include <stdarg.h>
-#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
+/* Every heap object is preceded by this header */
 struct Allocation {
-	struct Pair pair;
-	int mark : 1;
 	struct Allocation *next;
+	char mark;
+	char type;
+	char constant;
 };
 
-struct Allocation *global_allocations = NULL;
+static struct Allocation *gc_sweep_next(Interp *ctx);
+static void gc_free(struct Allocation *a);
+static struct Allocation *gc_allocation(Atom atom);
 
-Atom cons(Atom car_val, Atom cdr_val)
+static void *gc_alloc(Interp *ctx, int type, size_t size)
 {
-	struct Allocation *a;
-	Atom p;
+	struct Allocation *a = NULL;
 
-	a = malloc(sizeof(struct Allocation));
-	a->mark = 0;
-	a->next = global_allocations;
-	global_allocations = a;
+	/* Reuse a dead pair if the sweep finds one nearby */
+	if (!ctx->parent) {
+		int n = 16;
+		while (a == NULL && n-- > 0 && ctx->gc_phase == GCPhase_Sweep) {
+			a = gc_sweep_next(ctx);
+			if (a && (a->type != AtomType_Pair || type != AtomType_Pair)) {
+				gc_free(a);
+				a = NULL;
+			}
+		}
+	}
+	if (a == NULL)
+		a = malloc(sizeof(struct Allocation) + size);
+
+	/* New objects are black while marking is in progress */
+	a->mark = (ctx->gc_phase == GCPhase_Mark);
+	a->type = type;
+	a->constant = 0;
+	a->next = ctx->allocations;
+	ctx->allocations = a;
+
+	return a + 1;
+}
+
+Atom cons(Interp *ctx, Atom car_val, Atom cdr_val)
+{
+	Atom p;
 
 	p.type = AtomType_Pair;
-	p.value.pair = &a->pair;
+	p.value.pair = gc_alloc(ctx, AtomType_Pair, sizeof(struct Pair));
 
 	car(p) = car_val;
 	cdr(p) = cdr_val;
@@ -31,6 +61,159 @@ Atom cons(Atom car_val, Atom cdr_val)
 	return p;
 }
 
+/*
+ * List segments. A long list built in one go is packed into 4 KB blocks
+ * of consecutive pairs under a single header, instead of a header and a
+ * malloc chunk per pair, which halves its size. Every pair keeps its own
+ * cdr, so nothing that walks or mutates lists needs to know; a segment
+ * simply lives as long as any of its pairs. The blocks are carved from
+ * one reserved range of address space, so the collector can tell a pair
+ * in a segment by its address and find the header by masking.
+ */
+
+#define SEGMENT_SIZE 4096
+#define SEGMENT_SPACE ((size_t) 1 << 32)
+
+/* Allocation type of a segment; no atom has it */
+#define SEGMENT_TYPE 0x7f
+
+struct Segment {
+	long count;
+	long pad;
+	struct Pair pairs[];
+};
+
+#define SEGMENT_PAIRS ((long) ((SEGMENT_SIZE - sizeof(struct Allocation) \
+	- sizeof(struct Segment)) / sizeof(struct Pair)))
+
+/* Shorter lists, or tails, are ordinary pairs */
+#define SEGMENT_MIN (SEGMENT_PAIRS / 2)
+
+static pthread_once_t segment_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *segment_base;
+static size_t segment_space, segment_top;
+static struct Allocation *segment_free;
+
+static void segment_init(void)
+{
+	void *p = mmap(NULL, SEGMENT_SPACE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	/* Without the range every list is made of ordinary pairs */
+	if (p != MAP_FAILED) {
+		segment_base = p;
+		segment_space = SEGMENT_SPACE;
+	}
+}
+
+static struct Pair *segment_alloc(Interp *ctx, long count)
+{
+	struct Allocation *a = NULL;
+	struct Segment *seg;
+
+	pthread_once(&segment_once, segment_init);
+
+	pthread_mutex_lock(&segment_lock);
+	if (segment_free) {
+		a = segment_free;
+		segment_free = a->next;
+	} else if (segment_top < segment_space) {
+		a = (struct Allocation *) (segment_base + segment_top);
+		segment_top += SEGMENT_SIZE;
+	}
+	pthread_mutex_unlock(&segment_lock);
+
+	if (a == NULL)
+		return NULL;
+
+	a->mark = (ctx->gc_phase == GCPhase_Mark);
+	a->type = SEGMENT_TYPE;
+	a->constant = 0;
+	a->next = ctx->allocations;
+	ctx->allocations = a;
+
+	seg = (struct Segment *) (a + 1);
+	seg->count = count;
+	return seg->pairs;
+}
+
+static void segment_release(struct Allocation *a)
+{
+	pthread_mutex_lock(&segment_lock);
+	a->next = segment_free;
+	segment_free = a;
+	pthread_mutex_unlock(&segment_lock);
+}
+
+/* A fresh list of n nils ending in tail, for the caller to fill in */
+Atom make_list(Interp *ctx, long n, Atom tail)
+{
+	Atom list = nil, last = nil, rest = tail, p;
+	struct Pair *pairs;
+	long i, k;
+
+	while (n >= SEGMENT_MIN) {
+		k = (n < SEGMENT_PAIRS) ? n : SEGMENT_PAIRS;
+		pairs = segment_alloc(ctx, k);
+		if (pairs == NULL)
+			break;
+
+		for (i = 0; i < k; ++i) {
+			pairs[i].atom[0] = nil;
+			pairs[i].atom[1].type = AtomType_Pair;
+			pairs[i].atom[1].value.pair = &pairs[i + 1];
+		}
+		pairs[k - 1].atom[1] = nil;
+
+		p.type = AtomType_Pair;
+		p.value.pair = pairs;
+		if (nilp(last))
+			list = p;
+		else
+			cdr(last) = p;
+		last.type = AtomType_Pair;
+		last.value.pair = &pairs[k - 1];
+		n -= k;
+	}
+
+	while (n-- > 0)
+		rest = cons(ctx, nil, rest);
+
+	if (nilp(last))
+		return rest;
+
+	cdr(last) = rest;
+	return list;
+}
+
+Atom make_vector(Interp *ctx, long length, Atom fill)
+{
+	Atom v;
+	long i;
+
+	v.type = AtomType_Vector;
+	v.value.vector = gc_alloc(ctx, AtomType_Vector,
+		sizeof(struct Vector) + length * sizeof(Atom));
+	v.value.vector->length = length;
+	for (i = 0; i < length; ++i)
+		v.value.vector->items[i] = fill;
+
+	return v;
+}
+
+Atom make_array(Interp *ctx, long length)
+{
+	Atom a;
+
+	a.type = AtomType_Array;
+	a.value.array = gc_alloc(ctx, AtomType_Array,
+		sizeof(struct Array) + length * sizeof(long));
+	a.value.array->length = length;
+
+	return a;
+}
+
 Atom make_int(long x)
 {
 	Atom a;
@@ -39,27 +222,319 @@ Atom make_int(long x)
 	return a;
 }
 
-static Atom sym_table = { AtomType_Nil };
+/*
+ * Symbols. The table is weak: it is not a root, so a symbol that nothing
+ * else refers to is collected with its name, and the entry is dropped
+ * when the mark phase ends. A symbol found in the table while marking is
+ * marked there and then, since the snapshot may not have reached it.
+ * Names live in the heap object just after its chain link, so
+ * value.symbol is still a plain C string.
+ */
+struct Symbol {
+	struct Symbol *next;
+	unsigned long hash;
+	char name[];
+};
+
+#define symbol_of(s) ((struct Symbol *) ((s) - offsetof(struct Symbol, name)))
 
-Atom make_sym(const char *s)
+static unsigned long sym_hash(const char *s)
 {
-	Atom a, p;
+	unsigned long h = 5381;
 
-	p = sym_table;
-	while (!nilp(p)) {
-		a = car(p);
-		if (strcmp(a.value.symbol, s) == 0)
-			return a;
-		p = cdr(p);
+	while (*s)
+		h = h * 33 + (unsigned char) *s++;
+	return h;
+}
+
+static void sym_grow(Interp *ctx)
+{
+	size_t size = ctx->sym_size ? ctx->sym_size * 2 : 1024, i;
+	struct Symbol **table = calloc(size, sizeof(struct Symbol *));
+
+	for (i = 0; i < ctx->sym_size; ++i) {
+		struct Symbol *sym = ctx->sym_table[i], *next;
+		for (; sym != NULL; sym = next) {
+			next = sym->next;
+			sym->next = table[sym->hash & (size - 1)];
+			table[sym->hash & (size - 1)] = sym;
+		}
+	}
+
+	free(ctx->sym_table);
+	ctx->sym_table = table;
+	ctx->sym_size = size;
+}
+
+/* Drop the symbols the mark phase left white */
+static void sym_purge(Interp *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->sym_size; ++i) {
+		struct Symbol **p = &ctx->sym_table[i];
+		while (*p != NULL) {
+			if (((struct Allocation *) *p - 1)->mark) {
+				p = &(*p)->next;
+			} else {
+				*p = (*p)->next;
+				--ctx->sym_count;
+			}
+		}
+	}
+}
+
+Atom make_sym(Interp *ctx, const char *s)
+{
+	Atom a;
+	struct Symbol *sym;
+	unsigned long h;
+	size_t len;
+
+	if (ctx->parent) {
+		/* Parallel workers share their parent's symbol table */
+		pthread_mutex_lock(&ctx->parent->lock);
+		a = make_sym(ctx->parent, s);
+		pthread_mutex_unlock(&ctx->parent->lock);
+		return a;
 	}
 
 	a.type = AtomType_Symbol;
-	a.value.symbol = strdup(s);
-	sym_table = cons(a, sym_table);
+	h = sym_hash(s);
+	if (ctx->sym_size > 0) {
+		for (sym = ctx->sym_table[h & (ctx->sym_size - 1)]; sym; sym = sym->next) {
+			if (sym->hash == h && strcmp(sym->name, s) == 0) {
+				if (ctx->gc_phase == GCPhase_Mark)
+					((struct Allocation *) sym - 1)->mark = 1;
+				a.value.symbol = sym->name;
+				return a;
+			}
+		}
+	}
+
+	if (ctx->sym_count >= ctx->sym_size)
+		sym_grow(ctx);
+
+	PROBE1(symbol_new, s);
+
+	len = strlen(s);
+	sym = gc_alloc(ctx, AtomType_Symbol, sizeof(struct Symbol) + len + 1);
+	memcpy(sym->name, s, len + 1);
+	sym->hash = h;
+	sym->next = ctx->sym_table[h & (ctx->sym_size - 1)];
+	ctx->sym_table[h & (ctx->sym_size - 1)] = sym;
+	++ctx->sym_count;
 
+	a.value.symbol = sym->name;
 	return a;
 }
 
+/*
+ * Shared constants (-H). The reader builds quoted data and literal
+ * strings and vectors from the bottom up through these, so each part
+ * is already canonical and two objects are equal exactly when their
+ * fields are identical. The table is weak in the same way as the
+ * symbol table, and everything in it is marked constant.
+ */
+static unsigned long const_mix(unsigned long h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	return h;
+}
+
+static unsigned long const_identity(Atom a)
+{
+	return nilp(a) ? 0 : const_mix((unsigned long) a.value.integer ^ a.type);
+}
+
+static unsigned long const_hash(Atom a)
+{
+	unsigned long h;
+	long i;
+
+	switch (a.type) {
+	case AtomType_Pair:
+		return const_mix(const_identity(car(a)) * 31 + const_identity(cdr(a)));
+	case AtomType_Vector:
+		h = a.value.vector->length;
+		for (i = 0; i < a.value.vector->length; ++i)
+			h = h * 31 + const_identity(a.value.vector->items[i]);
+		return const_mix(h);
+	default:
+		h = 23;
+		for (i = 0; i < a.value.string->length; ++i)
+			h = h * 31 + (unsigned char) a.value.string->data[i];
+		return const_mix(h);
+	}
+}
+
+static int const_same(Atom a, Atom b)
+{
+	long i;
+
+	if (a.type != b.type)
+		return 0;
+
+	switch (a.type) {
+	case AtomType_Pair:
+		return atom_eq(car(a), car(b)) && atom_eq(cdr(a), cdr(b));
+	case AtomType_Vector:
+		if (a.value.vector->length != b.value.vector->length)
+			return 0;
+		for (i = 0; i < a.value.vector->length; ++i) {
+			if (!atom_eq(a.value.vector->items[i], b.value.vector->items[i]))
+				return 0;
+		}
+		return 1;
+	default:
+		return a.value.string->length == b.value.string->length
+			&& memcmp(a.value.string->data, b.value.string->data,
+				a.value.string->length) == 0;
+	}
+}
+
+static void const_insert(Interp *ctx, Atom a)
+{
+	size_t i = const_hash(a) & (ctx->const_size - 1);
+
+	while (!nilp(ctx->const_table[i]))
+		i = (i + 1) & (ctx->const_size - 1);
+	ctx->const_table[i] = a;
+	++ctx->const_count;
+}
+
+/* Move the entries to a table of the given size, keeping those that keep */
+static void const_rebuild(Interp *ctx, size_t size, int marked_only)
+{
+	Atom *old = ctx->const_table;
+	size_t old_size = ctx->const_size, i;
+
+	ctx->const_table = malloc(size * sizeof(Atom));
+	ctx->const_size = size;
+	ctx->const_count = 0;
+	for (i = 0; i < size; ++i)
+		ctx->const_table[i] = nil;
+
+	for (i = 0; i < old_size; ++i) {
+		if (!nilp(old[i]) && (!marked_only || gc_allocation(old[i])->mark))
+			const_insert(ctx, old[i]);
+	}
+	free(old);
+}
+
+/* Drop the constants the mark phase left white */
+static void const_purge(Interp *ctx)
+{
+	if (ctx->const_count > 0)
+		const_rebuild(ctx, ctx->const_size, 1);
+}
+
+/* The canonical object equal to key, which may be a temporary, or nil */
+static Atom const_find(Interp *ctx, Atom key)
+{
+	Atom a;
+	size_t i;
+
+	if (ctx->const_size == 0)
+		return nil;
+
+	i = const_hash(key) & (ctx->const_size - 1);
+	for (; !nilp(ctx->const_table[i]); i = (i + 1) & (ctx->const_size - 1)) {
+		a = ctx->const_table[i];
+		if (const_same(a, key)) {
+			if (ctx->gc_phase == GCPhase_Mark)
+				gc_mark(ctx, a);
+			return a;
+		}
+	}
+
+	return nil;
+}
+
+static Atom const_add(Interp *ctx, Atom a)
+{
+	if (2 * (ctx->const_count + 1) > ctx->const_size)
+		const_rebuild(ctx, ctx->const_size ? 2 * ctx->const_size : 1024, 0);
+	gc_allocation(a)->constant = 1;
+	const_insert(ctx, a);
+	return a;
+}
+
+/* car_val and cdr_val must be canonical already */
+Atom constant_cons(Interp *ctx, Atom car_val, Atom cdr_val)
+{
+	struct Pair tmp;
+	Atom key, a;
+
+	if (ctx->parent) {
+		/* Parallel workers share their parent's table */
+		pthread_mutex_lock(&ctx->parent->lock);
+		a = constant_cons(ctx->parent, car_val, cdr_val);
+		pthread_mutex_unlock(&ctx->parent->lock);
+		return a;
+	}
+
+	tmp.atom[0] = car_val;
+	tmp.atom[1] = cdr_val;
+	key.type = AtomType_Pair;
+	key.value.pair = &tmp;
+	a = const_find(ctx, key);
+	if (!nilp(a))
+		return a;
+
+	return const_add(ctx, cons(ctx, car_val, cdr_val));
+}
+
+Atom constant_string(Interp *ctx, const char *data, long length)
+{
+	Atom key, a;
+
+	if (ctx->parent) {
+		/* Parallel workers share their parent's table */
+		pthread_mutex_lock(&ctx->parent->lock);
+		a = constant_string(ctx->parent, data, length);
+		pthread_mutex_unlock(&ctx->parent->lock);
+		return a;
+	}
+
+	key.type = AtomType_String;
+	key.value.string = malloc(sizeof(struct String) + length + 1);
+	key.value.string->length = length;
+	memcpy(key.value.string->data, data, length);
+	a = const_find(ctx, key);
+	free(key.value.string);
+	if (!nilp(a))
+		return a;
+
+	return const_add(ctx, make_string(ctx, data, length));
+}
+
+/* A vector of canonical items, replaced by its canonical copy */
+Atom constant_vector(Interp *ctx, Atom v)
+{
+	Atom a;
+
+	if (ctx->parent) {
+		/* Parallel workers share their parent's table */
+		pthread_mutex_lock(&ctx->parent->lock);
+		a = constant_vector(ctx->parent, v);
+		pthread_mutex_unlock(&ctx->parent->lock);
+		return a;
+	}
+
+	a = const_find(ctx, v);
+	return nilp(a) ? const_add(ctx, v) : a;
+}
+
+int atom_constant(Atom a)
+{
+	struct Allocation *alloc = gc_allocation(a);
+
+	return alloc != NULL && alloc->constant;
+}
+
 Atom make_builtin(Builtin fn)
 {
 	Atom a;
@@ -68,6 +543,202 @@ Atom make_builtin(Builtin fn)
 	return a;
 }
 
+/* With NULL data the contents are left for the caller to fill */
+Atom make_string(Interp *ctx, const char *data, long length)
+{
+	Atom s;
+
+	s.type = AtomType_String;
+	s.value.string = gc_alloc(ctx, AtomType_String,
+		sizeof(struct String) + length + 1);
+	s.value.string->length = length;
+	if (data)
+		memcpy(s.value.string->data, data, length);
+	s.value.string->data[length] = '\0';
+
+	return s;
+}
+
+Atom make_port(Interp *ctx, FILE *file, Atom source, int input)
+{
+	Atom p;
+
+	p.type = AtomType_Port;
+	p.value.port = gc_alloc(ctx, AtomType_Port, sizeof(struct Port));
+	p.value.port->source = source;
+	p.value.port->file = file;
+	p.value.port->buf = NULL;
+	p.value.port->size = 0;
+	p.value.port->input = input;
+
+	return p;
+}
+
+Atom make_task(Interp *ctx, Atom expr, Atom env)
+{
+	Atom t;
+
+	t.type = AtomType_Task;
+	t.value.task = gc_alloc(ctx, AtomType_Task, sizeof(struct Task));
+	t.value.task->expr = expr;
+	t.value.task->env = env;
+	t.value.task->stack = nil;
+	t.value.task->result = nil;
+	t.value.task->steps = 0;
+	t.value.task->done = 0;
+	t.value.task->err = Error_OK;
+
+	return t;
+}
+
+Atom make_channel(Interp *ctx)
+{
+	Atom c;
+
+	c.type = AtomType_Channel;
+	c.value.channel = gc_alloc(ctx, AtomType_Channel, sizeof(struct Channel));
+	c.value.channel->head = nil;
+	c.value.channel->tail = nil;
+
+	return c;
+}
+
+Atom make_promise(Interp *ctx, Atom value, int done)
+{
+	Atom p;
+
+	p.type = AtomType_Promise;
+	p.value.promise = gc_alloc(ctx, AtomType_Promise, sizeof(struct Promise));
+	p.value.promise->value = value;
+	p.value.promise->done = done;
+
+	return p;
+}
+
+Atom make_record(Interp *ctx, Atom type, long count)
+{
+	Atom r;
+	long i;
+
+	r.type = AtomType_Record;
+	r.value.record = gc_alloc(ctx, AtomType_Record,
+		sizeof(struct Record) + count * sizeof(Atom));
+	r.value.record->count = count;
+	r.value.record->type = type;
+	for (i = 0; i < count; ++i)
+		r.value.record->slots[i] = nil;
+
+	return r;
+}
+
+Atom make_compiled(Interp *ctx, Native fn, long count)
+{
+	Atom c;
+	long i;
+
+	c.type = AtomType_Compiled;
+	c.value.compiled = gc_alloc(ctx, AtomType_Compiled,
+		sizeof(struct Compiled) + count * sizeof(Atom));
+	c.value.compiled->fn = fn;
+	c.value.compiled->count = count;
+	for (i = 0; i < count; ++i)
+		c.value.compiled->vars[i] = nil;
+
+	return c;
+}
+
+Atom make_table(Interp *ctx, int equal)
+{
+	Atom t;
+
+	t.type = AtomType_Table;
+	t.value.table = gc_alloc(ctx, AtomType_Table, sizeof(struct Table));
+	t.value.table->buckets = make_vector(ctx, 16, nil);
+	t.value.table->hashes = make_array(ctx, 8);
+	memset(t.value.table->hashes.value.array->items, 0, 8 * sizeof(long));
+	t.value.table->old_buckets = nil;
+	t.value.table->old_hashes = nil;
+	t.value.table->count = 0;
+	t.value.table->used = 0;
+	t.value.table->migrated = 0;
+	t.value.table->equal = equal;
+
+	return t;
+}
+
+int atom_eq(Atom a, Atom b)
+{
+	if (a.type != b.type)
+		return 0;
+
+	switch (a.type) {
+	case AtomType_Nil:
+		return 1;
+	case AtomType_Pair:
+	case AtomType_Closure:
+	case AtomType_Macro:
+	case AtomType_Continuation:
+		return a.value.pair == b.value.pair;
+	case AtomType_Vector:
+		return a.value.vector == b.value.vector;
+	case AtomType_Array:
+		return a.value.array == b.value.array;
+	case AtomType_Table:
+		return a.value.table == b.value.table;
+	case AtomType_String:
+		return a.value.string == b.value.string;
+	case AtomType_Port:
+		return a.value.port == b.value.port;
+	case AtomType_Task:
+		return a.value.task == b.value.task;
+	case AtomType_Channel:
+		return a.value.channel == b.value.channel;
+	case AtomType_Promise:
+		return a.value.promise == b.value.promise;
+	case AtomType_Record:
+		return a.value.record == b.value.record;
+	case AtomType_Compiled:
+		return a.value.compiled == b.value.compiled;
+	case AtomType_Symbol:
+		return a.value.symbol == b.value.symbol;
+	case AtomType_Integer:
+		return a.value.integer == b.value.integer;
+	case AtomType_Builtin:
+		return a.value.builtin == b.value.builtin;
+	}
+
+	return 0;
+}
+
+int atom_equal(Atom a, Atom b)
+{
+	long i;
+
+	while (a.type == AtomType_Pair && b.type == AtomType_Pair) {
+		if (!atom_equal(car(a), car(b)))
+			return 0;
+		a = cdr(a);
+		b = cdr(b);
+	}
+
+	if (a.type == AtomType_Vector && b.type == AtomType_Vector) {
+		if (a.value.vector->length != b.value.vector->length)
+			return 0;
+		for (i = 0; i < a.value.vector->length; ++i) {
+			if (!atom_equal(a.value.vector->items[i], b.value.vector->items[i]))
+				return 0;
+		}
+		return 1;
+	}
+
+	if (a.type == AtomType_String && b.type == AtomType_String)
+		return a.value.string->length == b.value.string->length
+			&& memcmp(a.value.string->data, b.value.string->data,
+				a.value.string->length) == 0;
+
+	return atom_eq(a, b);
+}
+
 int listp(Atom expr)
 {
 	while (!nilp(expr)) {
@@ -78,27 +749,23 @@ int listp(Atom expr)
 	return 1;
 }
 
-Atom copy_list(Atom list)
+/* A fresh spine for list, sharing its elements and any dotted tail */
+Atom copy_list(Interp *ctx, Atom list)
 {
-	Atom a, p;
-
-	if (nilp(list))
-		return nil;
+	Atom a, p, q;
+	long n = 0;
 
-	a = cons(car(list), nil);
-	p = a;
-	list = cdr(list);
+	for (q = list; q.type == AtomType_Pair; q = cdr(q))
+		++n;
 
-	while (!nilp(list)) {
-		cdr(p) = cons(car(list), nil);
-		p = cdr(p);
-		list = cdr(list);
-	}
+	a = make_list(ctx, n, q);
+	for (p = a; n-- > 0; p = cdr(p), list = cdr(list))
+		car(p) = car(list);
 
 	return a;
 }
 
-Atom list_create(int n, ...)
+Atom list_create(Interp *ctx, int n, ...)
 {
 	va_list ap;
 	Atom list = nil;
@@ -106,11 +773,11 @@ Atom list_create(int n, ...)
 	va_start(ap, n);
 	while (n--) {
 		Atom item = va_arg(ap, Atom);
-		list = cons(item, list);
+		list = cons(ctx, item, list);
 	}
 	va_end(ap);
 
-	list_reverse(&list);
+	list_reverse(ctx, &list);
 	return list;
 }
 
@@ -121,70 +788,478 @@ Atom list_get(Atom list, int k)
 	return car(list);
 }
 
-void list_set(Atom list, int k, Atom value)
+void list_set(Interp *ctx, Atom list, int k, Atom value)
 {
 	while (k--)
 		list = cdr(list);
-	car(list) = value;
+	set_car(ctx, list, value);
 }
 
-void list_reverse(Atom *list)
+void list_reverse(Interp *ctx, Atom *list)
 {
 	Atom tail = nil;
 	while (!nilp(*list)) {
 		Atom p = cdr(*list);
-		cdr(*list) = tail;
+		set_cdr(ctx, *list, tail);
 		tail = *list;
 		*list = p;
 	}
 	*list = tail;
 }
 
-void gc_mark(Atom root)
+Atom list_to_vector(Interp *ctx, Atom list)
+{
+	Atom v, p;
+	long i, n = 0;
+
+	for (p = list; !nilp(p); p = cdr(p))
+		++n;
+
+	v = make_vector(ctx, n, nil);
+	for (i = 0; i < n; ++i) {
+		v.value.vector->items[i] = car(list);
+		list = cdr(list);
+	}
+
+	return v;
+}
+
+void gc_protect(Interp *ctx, struct Root *root, Atom *atoms, int count)
+{
+	root->atoms = atoms;
+	root->count = count;
+	root->next = ctx->roots;
+	ctx->roots = root;
+}
+
+void gc_merge(Interp *ctx, Interp *from)
 {
 	struct Allocation *a;
 
-	if (!(root.type == AtomType_Pair
-		|| root.type == AtomType_Closure
-		|| root.type == AtomType_Macro))
+	if (!from->allocations)
 		return;
 
-	a = (struct Allocation *)
-		((char *) root.value.pair
-			- offsetof(struct Allocation, pair));
+	a = from->allocations;
+	while (a->next != NULL)
+		a = a->next;
+	a->next = ctx->allocations;
+	ctx->allocations = from->allocations;
+	from->allocations = NULL;
+}
+
+static struct Allocation *gc_allocation(Atom atom)
+{
+	switch (atom.type) {
+	case AtomType_Pair:
+	case AtomType_Closure:
+	case AtomType_Macro:
+	case AtomType_Continuation:
+		if ((uintptr_t) atom.value.pair - (uintptr_t) segment_base < segment_space)
+			return (struct Allocation *) ((uintptr_t) atom.value.pair
+				& ~(uintptr_t) (SEGMENT_SIZE - 1));
+		return (struct Allocation *) atom.value.pair - 1;
+	case AtomType_Vector:
+		return (struct Allocation *) atom.value.vector - 1;
+	case AtomType_Array:
+		return (struct Allocation *) atom.value.array - 1;
+	case AtomType_Table:
+		return (struct Allocation *) atom.value.table - 1;
+	case AtomType_String:
+		return (struct Allocation *) atom.value.string - 1;
+	case AtomType_Port:
+		return (struct Allocation *) atom.value.port - 1;
+	case AtomType_Task:
+		return (struct Allocation *) atom.value.task - 1;
+	case AtomType_Channel:
+		return (struct Allocation *) atom.value.channel - 1;
+	case AtomType_Promise:
+		return (struct Allocation *) atom.value.promise - 1;
+	case AtomType_Record:
+		return (struct Allocation *) atom.value.record - 1;
+	case AtomType_Compiled:
+		return (struct Allocation *) atom.value.compiled - 1;
+	case AtomType_Symbol:
+		return (struct Allocation *) symbol_of(atom.value.symbol) - 1;
+	default:
+		return NULL;
+	}
+}
+
+/* The atoms an object refers to */
+static Atom *gc_fields(struct Allocation *a, long *count)
+{
+	switch (a->type) {
+	case AtomType_Vector:
+		*count = ((struct Vector *) (a + 1))->length;
+		return ((struct Vector *) (a + 1))->items;
+	case AtomType_Array:
+	case AtomType_String:
+	case AtomType_Symbol:
+		*count = 0;
+		return NULL;
+	case AtomType_Port:
+		*count = 1;
+		return &((struct Port *) (a + 1))->source;
+	case AtomType_Table:
+		/* The storage atoms at the start of struct Table */
+		*count = 4;
+		return &((struct Table *) (a + 1))->buckets;
+	case AtomType_Task:
+		*count = 4;
+		return &((struct Task *) (a + 1))->expr;
+	case AtomType_Channel:
+		*count = 2;
+		return &((struct Channel *) (a + 1))->head;
+	case AtomType_Promise:
+		*count = 1;
+		return &((struct Promise *) (a + 1))->value;
+	case AtomType_Record:
+		/* The type, then the slots */
+		*count = 1 + ((struct Record *) (a + 1))->count;
+		return &((struct Record *) (a + 1))->type;
+	case AtomType_Compiled:
+		*count = ((struct Compiled *) (a + 1))->count;
+		return ((struct Compiled *) (a + 1))->vars;
+	case SEGMENT_TYPE:
+		/* The car and cdr of every pair, one after the other */
+		*count = 2 * ((struct Segment *) (a + 1))->count;
+		return ((struct Segment *) (a + 1))->pairs[0].atom;
+	default:
+		*count = 2;
+		return ((struct Pair *) (a + 1))->atom;
+	}
+}
+
+static void gc_push(struct Allocation ***stack, long *count, long *size,
+	struct Allocation *a)
+{
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 1024;
+		*stack = realloc(*stack, *size * sizeof(struct Allocation *));
+	}
+	(*stack)[(*count)++] = a;
+}
+
+void gc_mark(Interp *ctx, Atom root)
+{
+	struct Allocation *a = gc_allocation(root);
 
-	if (a->mark)
+	if (a == NULL || a->mark)
 		return;
 
+	/* Grey: marked but children not yet scanned */
 	a->mark = 1;
+	gc_push(&ctx->gray, &ctx->gray_count, &ctx->gray_size, a);
+}
+
+/* Whether a survives the cycle being marked; atoms not on the heap do */
+int gc_marked(Atom a)
+{
+	struct Allocation *alloc = gc_allocation(a);
 
-	gc_mark(car(root));
-	gc_mark(cdr(root));
+	return alloc == NULL || alloc->mark;
 }
 
-void gc()
+/*
+ * Parallel marking. Each marker works on a private stack and publishes
+ * half of it to its shared deque whenever that runs empty, so that idle
+ * markers have something to steal.
+ */
+struct Marker {
+	pthread_t thread;
+	struct Allocation **stack;
+	long count, size;
+	pthread_mutex_t lock;
+	struct Allocation **shared;
+	long shared_count, shared_size;
+	struct MarkJob *job;
+	int id;
+};
+
+struct MarkJob {
+	struct Marker *markers;
+	int nmarkers;
+	int idle;
+};
+
+static void marker_visit(struct Marker *m, Atom atom)
 {
-	struct Allocation *a, **p;
+	struct Allocation *a = gc_allocation(atom);
 
-	gc_mark(sym_table);
+	if (a == NULL || __atomic_exchange_n(&a->mark, 1, __ATOMIC_RELAXED))
+		return;
 
-	/* Free unmarked allocations */
-	p = &global_allocations;
-	while (*p != NULL) {
-		a = *p;
-		if (!a->mark) {
-			*p = a->next;
-			free(a);
-		} else {
-			p = &a->next;
+	gc_push(&m->stack, &m->count, &m->size, a);
+}
+
+static void marker_publish(struct Marker *m)
+{
+	long n = m->count / 2;
+	long count;
+
+	pthread_mutex_lock(&m->lock);
+	count = m->shared_count;
+	while (n--)
+		gc_push(&m->shared, &count, &m->shared_size, m->stack[--m->count]);
+	__atomic_store_n(&m->shared_count, count, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m->lock);
+}
+
+static int marker_steal(struct Marker *m, struct Marker *victim)
+{
+	long n, count;
+
+	pthread_mutex_lock(&victim->lock);
+	count = victim->shared_count;
+	n = (count + 1) / 2;
+	while (n--)
+		gc_push(&m->stack, &m->count, &m->size, victim->shared[--count]);
+	__atomic_store_n(&victim->shared_count, count, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&victim->lock);
+
+	return m->count > 0;
+}
+
+static int marker_find_work(struct Marker *m)
+{
+	struct MarkJob *job = m->job;
+	int i;
+
+	for (i = 0; i < job->nmarkers; ++i) {
+		struct Marker *victim = &job->markers[(m->id + i) % job->nmarkers];
+		if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) > 0
+				&& marker_steal(m, victim))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int marker_work_available(struct MarkJob *job)
+{
+	int i;
+
+	for (i = 0; i < job->nmarkers; ++i) {
+		if (__atomic_load_n(&job->markers[i].shared_count, __ATOMIC_RELAXED) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *marker_run(void *arg)
+{
+	struct Marker *m = arg;
+	struct MarkJob *job = m->job;
+
+	for (;;) {
+		while (m->count > 0) {
+			struct Allocation *a = m->stack[--m->count];
+			Atom *fields;
+			long i, n;
+
+			fields = gc_fields(a, &n);
+			for (i = 0; i < n; ++i)
+				marker_visit(m, fields[i]);
+
+			if (m->count > 64
+					&& __atomic_load_n(&m->shared_count, __ATOMIC_RELAXED) == 0)
+				marker_publish(m);
+		}
+
+		if (marker_find_work(m))
+			continue;
+
+		/* Finished once every marker is out of work */
+		__atomic_add_fetch(&job->idle, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(&job->idle, __ATOMIC_SEQ_CST) == job->nmarkers)
+				return NULL;
+			if (marker_work_available(job)) {
+				__atomic_sub_fetch(&job->idle, 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+			sched_yield();
 		}
 	}
+}
 
-	/* Clear marks */
-	a = global_allocations;
-	while (a != NULL) {
-		a->mark = 0;
-		a = a->next;
+static void gc_mark_parallel(Interp *ctx)
+{
+	struct MarkJob job;
+	int i;
+
+	job.nmarkers = ctx->gc_threads;
+	job.markers = calloc(job.nmarkers, sizeof(struct Marker));
+	job.idle = 0;
+
+	for (i = 0; i < job.nmarkers; ++i) {
+		job.markers[i].job = &job;
+		job.markers[i].id = i;
+		pthread_mutex_init(&job.markers[i].lock, NULL);
+	}
+
+	/* Hand the grey set to the first marker; the others steal from it */
+	for (i = 0; i < ctx->gray_count; ++i)
+		gc_push(&job.markers[0].shared, &job.markers[0].shared_count,
+			&job.markers[0].shared_size, ctx->gray[i]);
+	ctx->gray_count = 0;
+
+	for (i = 1; i < job.nmarkers; ++i)
+		pthread_create(&job.markers[i].thread, NULL, marker_run, &job.markers[i]);
+	marker_run(&job.markers[0]);
+	for (i = 1; i < job.nmarkers; ++i)
+		pthread_join(job.markers[i].thread, NULL);
+
+	for (i = 0; i < job.nmarkers; ++i) {
+		free(job.markers[i].stack);
+		free(job.markers[i].shared);
+		pthread_mutex_destroy(&job.markers[i].lock);
 	}
+	free(job.markers);
 }
 
+static void gc_start(Interp *ctx)
+{
+	struct Root *r;
+	int i;
+
+	PROBE0(gc_start);
+	ctx->gc_phase = GCPhase_Mark;
+
+	gc_mark(ctx, ctx->env);
+	gc_mark(ctx, ctx->sym_t);
+	gc_mark(ctx, ctx->sym_quote);
+	gc_mark(ctx, ctx->sym_lambda);
+	gc_mark(ctx, ctx->throw_target);
+	gc_mark(ctx, ctx->throw_value);
+	gc_mark(ctx, ctx->run_queue);
+	jit_mark(ctx);
+	opt_mark(ctx);
+	for (i = 0; i < ctx->tail_count; ++i)
+		gc_mark(ctx, ctx->tail_args[i]);
+	for (i = 0; i < PARAMS_CACHE_SIZE; ++i)
+		gc_mark(ctx, ctx->params_cache[i]);
+	for (r = ctx->roots; r != NULL; r = r->next) {
+		for (i = 0; i < r->count; ++i)
+			gc_mark(ctx, r->atoms[i]);
+	}
+}
+
+/* Objects marked live and in all, counted only while traced */
+static void gc_probe_done(Interp *ctx)
+{
+	struct Allocation *a;
+	long live = 0, total = 0;
+
+	for (a = ctx->allocations; a != NULL; a = a->next) {
+		live += a->mark;
+		++total;
+	}
+	PROBE3(gc_done, live, total, ctx->sym_count);
+}
+
+static void gc_mark_step(Interp *ctx, long budget)
+{
+	int unlimited = (budget <= 0);
+
+	if (unlimited && ctx->gc_threads > 1)
+		gc_mark_parallel(ctx);
+
+	while (ctx->gray_count > 0 && (unlimited || budget-- > 0)) {
+		struct Allocation *a = ctx->gray[--ctx->gray_count];
+		Atom *fields;
+		long i, n;
+
+		fields = gc_fields(a, &n);
+		for (i = 0; i < n; ++i)
+			gc_mark(ctx, fields[i]);
+	}
+
+	if (ctx->gray_count == 0) {
+		if (PROBE_ENABLED(gc_done))
+			gc_probe_done(ctx);
+
+		/* Everything left white is garbage */
+		sym_purge(ctx);
+		const_purge(ctx);
+		jit_purge(ctx);
+		opt_purge(ctx);
+		ctx->sweep = ctx->allocations;
+		ctx->allocations = NULL;
+		ctx->gc_phase = GCPhase_Sweep;
+	}
+}
+
+static void gc_free(struct Allocation *a)
+{
+	if (a != NULL && a->type == SEGMENT_TYPE) {
+		segment_release(a);
+		return;
+	}
+
+	if (a != NULL && a->type == AtomType_Port) {
+		struct Port *port = (struct Port *) (a + 1);
+		if (port->file)
+			fclose(port->file);
+		free(port->buf);
+	}
+
+	free(a);
+}
+
+/* Move one allocation off the sweep list, returning it if dead */
+static struct Allocation *gc_sweep_next(Interp *ctx)
+{
+	struct Allocation *a = ctx->sweep;
+
+	if (a == NULL) {
+		ctx->gc_phase = GCPhase_Idle;
+		return NULL;
+	}
+
+	ctx->sweep = a->next;
+	if (!a->mark)
+		return a;
+
+	a->mark = 0;
+	a->next = ctx->allocations;
+	ctx->allocations = a;
+
+	return NULL;
+}
+
+void gc_step(Interp *ctx, long budget)
+{
+	int unlimited = (budget <= 0);
+
+	if (ctx->gc_phase == GCPhase_Mark)
+		gc_mark_step(ctx, budget);
+
+	while (ctx->gc_phase == GCPhase_Sweep && (unlimited || budget-- > 0))
+		gc_free(gc_sweep_next(ctx));
+}
+
+void gc_safepoint(Interp *ctx)
+{
+	if (++ctx->gc_count == 100000) {
+		ctx->gc_count = 0;
+		if (ctx->gc_budget <= 0)
+			gc(ctx);
+		else if (ctx->gc_phase == GCPhase_Idle)
+			gc_start(ctx);
+	}
+
+	if (ctx->gc_phase != GCPhase_Idle && ctx->gc_budget > 0)
+		gc_step(ctx, ctx->gc_budget);
+}
+
+void gc(Interp *ctx)
+{
+	/* Finish the previous cycle, then mark; cons sweeps lazily */
+	if (ctx->gc_phase == GCPhase_Sweep)
+		gc_step(ctx, 0);
+	if (ctx->gc_phase == GCPhase_Idle)
+		gc_start(ctx);
+	gc_mark_step(ctx, 0);
+}
@@ -1,25 +1,31 @@
 #include "lisp.h"
+#include "probe.h"
+#include <stdint.h>
 #include <string.h>
 
-Atom env_create(Atom parent)
+Atom env_create(Interp *ctx, Atom parent)
 {
-	return cons(parent, nil);
+	return cons(ctx, parent, nil);
 }
 
-int env_define(Atom env, Atom symbol, Atom value)
+int env_define(Interp *ctx, Atom env, Atom symbol, Atom value)
 {
 	Atom bs = cdr(env);
 
 	while (!nilp(bs)) {
 		Atom b = car(bs);
 		if (car(b).value.symbol == symbol.value.symbol) {
-			cdr(b) = value;
+			set_cdr(ctx, b, value);
+			if (env.value.pair == ctx->env.value.pair)
+				++ctx->env_version;
 			return Error_OK;
 		}
 		bs = cdr(bs);
 	}
 
-	cdr(env) = cons(cons(symbol, value), cdr(env));
+	set_cdr(ctx, env, cons(ctx, cons(ctx, symbol, value), cdr(env)));
+	if (env.value.pair == ctx->env.value.pair)
+		++ctx->env_version;
 
 	return Error_OK;
 }
@@ -44,7 +50,7 @@ int env_get(Atom env, Atom symbol, Atom *result)
 	return env_get(parent, symbol, result);
 }
 
-int env_set(Atom env, Atom symbol, Atom value)
+int env_set(Interp *ctx, Atom env, Atom symbol, Atom value)
 {
 	Atom parent = car(env);
 	Atom bs = cdr(env);
@@ -52,7 +58,9 @@ int env_set(Atom env, Atom symbol, Atom value)
 	while (!nilp(bs)) {
 		Atom b = car(bs);
 		if (car(b).value.symbol == symbol.value.symbol) {
-			cdr(b) = value;
+			set_cdr(ctx, b, value);
+			if (env.value.pair == ctx->env.value.pair)
+				++ctx->env_version;
 			return Error_OK;
 		}
 		bs = cdr(bs);
@@ -61,102 +69,327 @@ int env_set(Atom env, Atom symbol, Atom value)
 	if (nilp(parent))
 		return Error_Unbound;
 
-	return env_set(parent, symbol, value);
+	return env_set(ctx, parent, symbol, value);
 }
 
-int make_closure(Atom env, Atom args, Atom body, Atom *result)
+static int params_match(Atom a, Atom b)
 {
-	Atom p;
+	while (a.type == AtomType_Pair && b.type == AtomType_Pair) {
+		if (car(a).value.symbol != car(b).value.symbol)
+			return 0;
+		a = cdr(a);
+		b = cdr(b);
+	}
 
-	if (!listp(body))
-		return Error_Syntax;
+	return a.type == b.type && (nilp(a) || a.value.symbol == b.value.symbol);
+}
+
+/*
+ * The descriptor is a vector of the parameter list as written, the
+ * number of fixed parameters, the rest parameter or nil and then the
+ * fixed names. It depends only on the names, so evaluating the same
+ * lambda expression again finds it in the cache.
+ */
+static int make_params(Interp *ctx, Atom args, Atom *result)
+{
+	uintptr_t hash = 0;
+	Atom p, *slot, *items;
+	long n = 0, i;
 
 	/* Check argument names are all symbols */
-	p = args;
-	while (!nilp(p)) {
-		if (p.type == AtomType_Symbol)
-			break;
-		else if (p.type != AtomType_Pair
-				|| car(p).type != AtomType_Symbol)
+	for (p = args; p.type == AtomType_Pair; p = cdr(p)) {
+		if (car(p).type != AtomType_Symbol)
 			return Error_Type;
-		p = cdr(p);
+		hash = 31 * hash + ((uintptr_t) car(p).value.symbol >> 4);
+		++n;
 	}
+	if (p.type == AtomType_Symbol)
+		hash = 31 * hash + ((uintptr_t) p.value.symbol >> 4) + 1;
+	else if (!nilp(p))
+		return Error_Type;
+
+	slot = &ctx->params_cache[hash & (PARAMS_CACHE_SIZE - 1)];
+	if (!nilp(*slot) && params_match(slot->value.vector->items[0], args)) {
+		*result = *slot;
+		return Error_OK;
+	}
+
+	*result = make_vector(ctx, 3 + n, nil);
+	items = result->value.vector->items;
+	items[0] = args;
+	items[1] = make_int(n);
+	items[2] = p;
+	for (i = 3, p = args; p.type == AtomType_Pair; p = cdr(p))
+		items[i++] = car(p);
+
+	/* Workers share the cache and leave it alone */
+	if (!ctx->parent)
+		*slot = *result;
+
+	return Error_OK;
+}
+
+int make_closure(Interp *ctx, Atom env, Atom args, Atom body, Atom *result)
+{
+	Atom desc;
+	Error err;
 
-	*result = cons(env, cons(args, body));
+	if (!listp(body))
+		return Error_Syntax;
+
+	err = make_params(ctx, args, &desc);
+	if (err)
+		return err;
+
+	*result = cons(ctx, env, cons(ctx, desc, body));
 	result->type = AtomType_Closure;
 
 	return Error_OK;
 }
 
-Atom make_frame(Atom parent, Atom env, Atom tail)
+Atom make_frame(Interp *ctx, Atom parent, Atom env, Atom tail)
 {
-	return cons(parent,
-		cons(env,
-		cons(nil, /* op */
-		cons(tail,
-		cons(nil, /* args */
-		cons(nil, /* body */
+	return cons(ctx, parent,
+		cons(ctx, env,
+		cons(ctx, nil, /* op */
+		cons(ctx, tail,
+		cons(ctx, nil, /* args */
+		cons(ctx, nil, /* body */
 		nil))))));
 }
 
-int eval_do_exec(Atom *stack, Atom *expr, Atom *env)
+/*
+ * A continuation is (depth stack . escape), where depth identifies the
+ * nested eval_expr it resumes in. A full continuation holds a private
+ * copy of the stack, since frames are updated in place as evaluation
+ * proceeds. An escape holds its CALL/EC frame instead and is only good
+ * while that frame is still on the stack. The frame keeps the escape in
+ * its argument slot while the procedure runs.
+ */
+static Atom stack_copy(Interp *ctx, Atom stack)
+{
+	Atom result = nil, p = nil;
+
+	while (!nilp(stack)) {
+		/* The evaluated arguments are reversed in place later */
+		Atom frame = copy_list(ctx, stack);
+		if (list_get(frame, 4).type == AtomType_Pair)
+			list_set(ctx, frame, 4, copy_list(ctx, list_get(frame, 4)));
+
+		if (nilp(p))
+			result = frame;
+		else
+			set_car(ctx, p, frame);
+		p = frame;
+		stack = car(stack);
+	}
+
+	return result;
+}
+
+/*
+ * A continuation names its evaluation by the task running it and the
+ * depth within that task, since a task resumes at whatever depth the
+ * scheduler happens to be called from
+ */
+static Atom eval_owner(Interp *ctx)
+{
+	Atom task = nil;
+
+	if (ctx->task) {
+		task.type = AtomType_Task;
+		task.value.task = ctx->task;
+	}
+
+	return task;
+}
+
+static long eval_level(Interp *ctx)
+{
+	return ctx->task ? ctx->eval_depth - ctx->task_depth : ctx->eval_depth;
+}
+
+static int eval_owns(Interp *ctx, Atom k)
+{
+	Atom owner = cdr(car(k));
+
+	return nilp(owner) ? ctx->task == NULL : owner.value.task == ctx->task;
+}
+
+static Atom make_continuation(Interp *ctx, Atom stack, int escape)
+{
+	Atom k;
+
+	k = cons(ctx, cons(ctx, make_int(eval_level(ctx)), eval_owner(ctx)),
+		cons(ctx, stack, escape ? ctx->sym_t : nil));
+	k.type = AtomType_Continuation;
+
+	return k;
+}
+
+/* Unwind to the evaluation that owns k; see eval_catch */
+static int continuation_throw(Interp *ctx, Atom k, Atom args)
+{
+	int escape = !nilp(cdr(cdr(k)));
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	/* Another task's evaluation can only be found by unwinding to it */
+	if ((eval_owns(ctx, k) && car(car(k)).value.integer > eval_level(ctx))
+			|| (escape && nilp(car(cdr(k))))) {
+		/* Its evaluation has already returned */
+		ctx->throw_target = nil;
+		return Error_Throw;
+	}
+
+	ctx->throw_target = k;
+	ctx->throw_value = car(args);
+
+	return Error_Throw;
+}
+
+static int eval_catch(Interp *ctx, Atom *stack, Atom *expr)
+{
+	Atom k = ctx->throw_target;
+	Atom target, p;
+
+	if (nilp(k) || !eval_owns(ctx, k)
+			|| car(car(k)).value.integer != eval_level(ctx))
+		return Error_Throw;
+
+	target = car(cdr(k));
+	if (nilp(cdr(cdr(k)))) {
+		*stack = stack_copy(ctx, target);
+	} else {
+		for (p = *stack; !nilp(p); p = car(p)) {
+			if (p.value.pair == target.value.pair)
+				break;
+		}
+		if (nilp(p)) {
+			ctx->throw_target = ctx->throw_value = nil;
+			return Error_Throw;
+		}
+
+		/* Return from the CALL/EC frame; the escape is used up */
+		set_car(ctx, cdr(k), nil);
+		*stack = car(target);
+	}
+
+	*expr = cons(ctx, ctx->sym_quote,
+		cons(ctx, ctx->throw_value, nil));
+	ctx->throw_target = ctx->throw_value = nil;
+
+	return Error_OK;
+}
+
+/* The name a closure or macro is bound to where it was made */
+static const char *closure_name(Atom fn)
+{
+	Atom env, bs, value;
+
+	for (env = car(fn); !nilp(env); env = car(env)) {
+		for (bs = cdr(env); !nilp(bs); bs = cdr(bs)) {
+			value = cdr(car(bs));
+			if ((value.type == AtomType_Closure || value.type == AtomType_Macro)
+					&& value.value.pair == fn.value.pair)
+				return car(car(bs)).value.symbol;
+		}
+	}
+
+	return "";
+}
+
+int eval_do_exec(Interp *ctx, Atom *stack, Atom *expr, Atom *env)
 {
 	Atom body;
+	const char *name = NULL;
 
 	*env = list_get(*stack, 1);
 	body = list_get(*stack, 5);
 	*expr = car(body);
 	body = cdr(body);
 	if (nilp(body)) {
-		/* Finished function; pop the stack */
+		/* Finished function; the last expression is a tail call */
+		if (PROBE_ENABLED(closure_return))
+			name = closure_name(list_get(*stack, 2));
+		PROBE2(closure_return, name, list_get(*stack, 2).value.pair);
+
+		/* Pop the stack */
 		*stack = car(*stack);
 	} else {
-		list_set(*stack, 5, body);
+		list_set(ctx, *stack, 5, body);
 	}
 
 	return Error_OK;
 }
 
-int eval_do_bind(Atom *stack, Atom *expr, Atom *env)
+int eval_do_bind(Interp *ctx, Atom *stack, Atom *expr, Atom *env)
 {
-	Atom op, args, arg_names, body;
+	Atom op, args, body, value, bindings, *items;
+	struct Root root;
+	const char *name = NULL;
+	long n, i;
+	int err, entered;
 
 	body = list_get(*stack, 5);
 	if (!nilp(body))
-		return eval_do_exec(stack, expr, env);
+		return eval_do_exec(ctx, stack, expr, env);
 
 	op = list_get(*stack, 2);
 	args = list_get(*stack, 4);
 
-	*env = env_create(car(op));
-	arg_names = car(cdr(op));
-	body = cdr(cdr(op));
-	list_set(*stack, 1, *env);
-	list_set(*stack, 5, body);
-
-	/* Bind the arguments */
-	while (!nilp(arg_names)) {
-		if (arg_names.type == AtomType_Symbol) {
-			env_define(*env, arg_names, args);
-			args = nil;
-			break;
-		}
+	if (PROBE_ENABLED(closure_entry) || PROBE_ENABLED(closure_return))
+		name = closure_name(op);
+	PROBE2(closure_entry, name, op.value.pair);
+
+	/*
+	 * Hot closures run as compiled code instead. Neither the argument
+	 * list nor the caller's expression and environment stay reachable
+	 * meanwhile, so that a loop over a lazy stream does not keep its
+	 * head alive.
+	 */
+	gc_protect(ctx, &root, &args, 1);
+	*expr = nil;
+	*env = car(op);
+	list_set(ctx, *stack, 1, *env);
+	list_set(ctx, *stack, 4, nil);
+	entered = jit_enter(ctx, op, &args, &value, &err);
+	ctx->roots = root.next;
+	if (entered) {
+		if (err)
+			return err;
+		PROBE2(closure_return, name, op.value.pair);
+		*stack = car(*stack);
+		*expr = cons(ctx, ctx->sym_quote, cons(ctx, value, nil));
+		return Error_OK;
+	}
+
+	/* Check the arity, then bind in order without looking back */
+	items = car(cdr(op)).value.vector->items;
+	n = items[1].value.integer;
+	for (i = 0, value = args; i < n && !nilp(value); ++i)
+		value = cdr(value);
+	if (i < n || (nilp(items[2]) && !nilp(value)))
+		return Error_Args;
 
-		if (nilp(args))
-			return Error_Args;
-		env_define(*env, car(arg_names), car(args));
-		arg_names = cdr(arg_names);
+	bindings = nil;
+	for (i = 0; i < n; ++i) {
+		bindings = cons(ctx, cons(ctx, items[3 + i], car(args)), bindings);
 		args = cdr(args);
 	}
-	if (!nilp(args))
-		return Error_Args;
+	if (!nilp(items[2]))
+		bindings = cons(ctx, cons(ctx, items[2], args), bindings);
 
-	list_set(*stack, 4, nil);
+	*env = cons(ctx, car(op), bindings);
+	body = opt_body(ctx, op);
+	list_set(ctx, *stack, 1, *env);
+	list_set(ctx, *stack, 5, body);
 
-	return eval_do_exec(stack, expr, env);
+	return eval_do_exec(ctx, stack, expr, env);
 }
 
-int eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
+int eval_do_apply(Interp *ctx, Atom *stack, Atom *expr, Atom *env, Atom *result)
 {
 	Atom op, args;
 
@@ -164,37 +397,74 @@ int eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
 	args = list_get(*stack, 4);
 
 	if (!nilp(args)) {
-		list_reverse(&args);
-		list_set(*stack, 4, args);
+		list_reverse(ctx, &args);
+		list_set(ctx, *stack, 4, args);
 	}
 
 	if (op.type == AtomType_Symbol) {
 		if (strcmp(op.value.symbol, "APPLY") == 0) {
 			/* Replace the current frame */
 			*stack = car(*stack);
-			*stack = make_frame(*stack, *env, nil);
+			*stack = make_frame(ctx, *stack, *env, nil);
 			op = car(args);
 			args = car(cdr(args));
 			if (!listp(args))
 				return Error_Syntax;
 
-			list_set(*stack, 2, op);
-			list_set(*stack, 4, args);
+			list_set(ctx, *stack, 2, op);
+			list_set(ctx, *stack, 4, args);
+		} else if (strcmp(op.value.symbol, "CALL/CC") == 0) {
+			/* Replace the current frame, passing on its continuation */
+			Atom k;
+
+			*stack = car(*stack);
+			k = make_continuation(ctx, stack_copy(ctx, *stack), 0);
+			*stack = make_frame(ctx, *stack, *env, nil);
+			op = car(args);
+			args = cons(ctx, k, nil);
+
+			list_set(ctx, *stack, 2, op);
+			list_set(ctx, *stack, 4, args);
+		} else if (strcmp(op.value.symbol, "CALL/EC") == 0) {
+			/* Keep the current frame as the escape target */
+			Atom k;
+
+			k = make_continuation(ctx, *stack, 1);
+			list_set(ctx, *stack, 4, k);
+			*stack = make_frame(ctx, *stack, *env, nil);
+			op = car(args);
+			args = cons(ctx, k, nil);
+
+			list_set(ctx, *stack, 2, op);
+			list_set(ctx, *stack, 4, args);
 		}
 	}
 
-	if (op.type == AtomType_Builtin) {
+	if (op.type == AtomType_Continuation) {
+		*stack = car(*stack);
+		return continuation_throw(ctx, op, args);
+	} else if (op.type == AtomType_Builtin) {
+		*stack = car(*stack);
+		*expr = cons(ctx, op, args);
+		return Error_OK;
+	} else if (op.type == AtomType_Compiled) {
+		Atom value;
+		Error err;
+
 		*stack = car(*stack);
-		*expr = cons(op, args);
+		err = native_apply(ctx, op, args, &value);
+		if (err)
+			return err;
+		*expr = cons(ctx, ctx->sym_quote, cons(ctx, value, nil));
 		return Error_OK;
 	} else if (op.type != AtomType_Closure) {
 		return Error_Type;
 	}
 
-	return eval_do_bind(stack, expr, env);
+	return eval_do_bind(ctx, stack, expr, env);
 }
 
-int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
+int eval_do_return(Interp *ctx, Atom *stack, Atom *expr, Atom *env, Atom *result)
 {
 	Atom op, args, body;
 
@@ -204,36 +474,50 @@ int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 
 	if (!nilp(body)) {
 		/* Still running a procedure; ignore the result */
-		return eval_do_apply(stack, expr, env, result);
+		return eval_do_apply(ctx, stack, expr, env, result);
 	}
 
 	if (nilp(op)) {
 		/* Finished evaluating operator */
 		op = *result;
-		list_set(*stack, 2, op);
+		list_set(ctx, *stack, 2, op);
 
 		if (op.type == AtomType_Macro) {
+			PROBE1(macro_expand, PROBE_ENABLED(macro_expand)
+				? closure_name(op) : NULL);
+
 			/* Don't evaluate macro arguments */
 			args = list_get(*stack, 3);
-			*stack = make_frame(*stack, *env, nil);
+			*stack = make_frame(ctx, *stack, *env, nil);
 			op.type = AtomType_Closure;
-			list_set(*stack, 2, op);
-			list_set(*stack, 4, args);
-			return eval_do_bind(stack, expr, env);
+			list_set(ctx, *stack, 2, op);
+			list_set(ctx, *stack, 4, args);
+			return eval_do_bind(ctx, stack, expr, env);
 		}
 	} else if (op.type == AtomType_Symbol) {
 		/* Finished working on special form */
 		if (strcmp(op.value.symbol, "DEFINE") == 0) {
 			Atom sym = list_get(*stack, 4);
-			(void) env_define(*env, sym, *result);
+			(void) env_define(ctx, *env, sym, *result);
+			if (env->value.pair == ctx->env.value.pair)
+				opt_define(ctx, sym, *result);
 			*stack = car(*stack);
-			*expr = cons(make_sym("QUOTE"), cons(sym, nil));
+			*expr = cons(ctx, ctx->sym_quote, cons(ctx, sym, nil));
 			return Error_OK;
 		} else if (strcmp(op.value.symbol, "SET!") == 0) {
 			Atom sym = list_get(*stack, 4);
 			*stack = car(*stack);
-			*expr = cons(make_sym("QUOTE"), cons(sym, nil));
-			return env_set(*env, sym, *result);
+			*expr = cons(ctx, ctx->sym_quote, cons(ctx, sym, nil));
+			return env_set(ctx, *env, sym, *result);
+		} else if (strcmp(op.value.symbol, "CALL/EC") == 0
+				&& list_get(*stack, 4).type == AtomType_Continuation) {
+			/* Returned normally, so the escape is dead */
+			Atom k = list_get(*stack, 4);
+			if (car(cdr(k)).value.pair == stack->value.pair)
+				set_car(ctx, cdr(k), nil);
+			*stack = car(*stack);
+			*expr = cons(ctx, ctx->sym_quote, cons(ctx, *result, nil));
+			return Error_OK;
 		} else if (strcmp(op.value.symbol, "IF") == 0) {
 			args = list_get(*stack, 3);
 			*expr = nilp(*result) ? car(cdr(args)) : car(args);
@@ -244,6 +528,8 @@ int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 		}
 	} else if (op.type == AtomType_Macro) {
 		/* Finished evaluating macro */
+		PROBE1(macro_done, PROBE_ENABLED(macro_done)
+			? closure_name(op) : NULL);
 		*expr = *result;
 		*stack = car(*stack);
 		return Error_OK;
@@ -251,34 +537,74 @@ int eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 	store_arg:
 		/* Store evaluated argument */
 		args = list_get(*stack, 4);
-		list_set(*stack, 4, cons(*result, args));
+		list_set(ctx, *stack, 4, cons(ctx, *result, args));
 	}
 
 	args = list_get(*stack, 3);
 	if (nilp(args)) {
 		/* No more arguments left to evaluate */
-		return eval_do_apply(stack, expr, env, result);
+		return eval_do_apply(ctx, stack, expr, env, result);
 	}
 
 	/* Evaluate next argument */
 	*expr = car(args);
-	list_set(*stack, 3, cdr(args));
+	list_set(ctx, *stack, 3, cdr(args));
 	return Error_OK;
 }
 
-int eval_expr(Atom expr, Atom env, Atom *result)
+/*
+ * A call whose operator names a builtin and whose arguments are all
+ * symbols or constants needs no frame; evaluates them in place.
+ */
+static int eval_simple(Interp *ctx, Atom env, Atom expr, Atom *fn, Atom *args)
+{
+	Atom p, value, tail = nil;
+
+	for (p = cdr(expr); !nilp(p); p = cdr(p))
+		if (car(p).type == AtomType_Pair)
+			return 0;
+
+	if (env_get(env, car(expr), fn) || fn->type != AtomType_Builtin)
+		return 0;
+
+	*args = nil;
+	for (p = cdr(expr); !nilp(p); p = cdr(p)) {
+		value = car(p);
+		if (value.type == AtomType_Symbol && env_get(env, value, &value))
+			return 0;
+
+		if (nilp(*args)) {
+			*args = tail = cons(ctx, value, nil);
+		} else {
+			set_cdr(ctx, tail, cons(ctx, value, nil));
+			tail = cdr(tail);
+		}
+	}
+
+	return 1;
+}
+
+/* With a task, runs until its steps are used up and saves the state */
+static int eval_loop(Interp *ctx, Atom expr, Atom env, Atom stack,
+	struct Task *task, Atom *result)
 {
-	static int count = 0;
 	Error err = Error_OK;
-	Atom stack = nil;
+	Atom fn, args, values = nil;
+	struct Root roots[4];
+
+	/* Unregistered by eval_expr when we return */
+	gc_protect(ctx, &roots[0], &expr, 1);
+	gc_protect(ctx, &roots[1], &env, 1);
+	gc_protect(ctx, &roots[2], &stack, 1);
+	gc_protect(ctx, &roots[3], &values, 1);
 
 	do {
-		if (++count == 100000) {
-			gc_mark(expr);
-			gc_mark(env);
-			gc_mark(stack);
-			gc();
-			count = 0;
+		if (!ctx->parent)
+			gc_safepoint(ctx);
+
+		if (task && task->steps-- <= 0) {
+			err = Error_Yield;
+			break;
 		}
 
 		if (expr.type == AtomType_Symbol) {
@@ -289,8 +615,8 @@ int eval_expr(Atom expr, Atom env, Atom *result)
 			return Error_Syntax;
 		} else {
 			Atom op = car(expr);
-			Atom args = cdr(expr);
 
+			args = cdr(expr);
 			if (op.type == AtomType_Symbol) {
 				/* Handle special forms */
 
@@ -307,18 +633,20 @@ int eval_expr(Atom expr, Atom env, Atom *result)
 
 					sym = car(args);
 					if (sym.type == AtomType_Pair) {
-						err = make_closure(env, cdr(sym), cdr(args), result);
+						err = make_closure(ctx, env, cdr(sym), cdr(args), result);
 						sym = car(sym);
 						if (sym.type != AtomType_Symbol)
 							return Error_Type;
-						(void) env_define(env, sym, *result);
+						(void) env_define(ctx, env, sym, *result);
+						if (env.value.pair == ctx->env.value.pair)
+							opt_define(ctx, sym, *result);
 						*result = sym;
 					} else if (sym.type == AtomType_Symbol) {
 						if (!nilp(cdr(cdr(args))))
 							return Error_Args;
-						stack = make_frame(stack, env, nil);
-						list_set(stack, 2, op);
-						list_set(stack, 4, sym);
+						stack = make_frame(ctx, stack, env, nil);
+						list_set(ctx, stack, 2, op);
+						list_set(ctx, stack, 4, sym);
 						expr = car(cdr(args));
 						continue;
 					} else {
@@ -328,14 +656,14 @@ int eval_expr(Atom expr, Atom env, Atom *result)
 					if (nilp(args) || nilp(cdr(args)))
 						return Error_Args;
 
-					err = make_closure(env, car(args), cdr(args), result);
+					err = make_closure(ctx, env, car(args), cdr(args), result);
 				} else if (strcmp(op.value.symbol, "IF") == 0) {
 					if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
 							|| !nilp(cdr(cdr(cdr(args)))))
 						return Error_Args;
 
-					stack = make_frame(stack, env, cdr(args));
-					list_set(stack, 2, op);
+					stack = make_frame(ctx, stack, env, cdr(args));
+					list_set(ctx, stack, 2, op);
 					expr = car(args);
 					continue;
 				} else if (strcmp(op.value.symbol, "DEFMACRO") == 0) {
@@ -351,19 +679,28 @@ int eval_expr(Atom expr, Atom env, Atom *result)
 					if (name.type != AtomType_Symbol)
 						return Error_Type;
 
-					err = make_closure(env, cdr(car(args)),
+					err = make_closure(ctx, env, cdr(car(args)),
 						cdr(args), &macro);
 					if (!err) {
 						macro.type = AtomType_Macro;
 						*result = name;
-						(void) env_define(env, name, macro);
+						(void) env_define(ctx, env, name, macro);
 					}
 				} else if (strcmp(op.value.symbol, "APPLY") == 0) {
 					if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 						return Error_Args;
 
-					stack = make_frame(stack, env, cdr(args));
-					list_set(stack, 2, op);
+					stack = make_frame(ctx, stack, env, cdr(args));
+					list_set(ctx, stack, 2, op);
+					expr = car(args);
+					continue;
+				} else if (strcmp(op.value.symbol, "CALL/CC") == 0
+						|| strcmp(op.value.symbol, "CALL/EC") == 0) {
+					if (nilp(args) || !nilp(cdr(args)))
+						return Error_Args;
+
+					stack = make_frame(ctx, stack, env, nil);
+					list_set(ctx, stack, 2, op);
 					expr = car(args);
 					continue;
 				} else if (strcmp(op.value.symbol, "SET!") == 0) {
@@ -371,32 +708,122 @@ int eval_expr(Atom expr, Atom env, Atom *result)
 						return Error_Args;
 					if (car(args).type != AtomType_Symbol)
 						return Error_Type;
-					stack = make_frame(stack, env, nil);
-					list_set(stack, 2, op);
-					list_set(stack, 4, car(args));
+					stack = make_frame(ctx, stack, env, nil);
+					list_set(ctx, stack, 2, op);
+					list_set(ctx, stack, 4, car(args));
 					expr = car(cdr(args));
 					continue;
+				} else if (eval_simple(ctx, env, expr, &fn, &values)) {
+					PROBE1(builtin, fn.value.builtin);
+					err = (*fn.value.builtin)(ctx, values, result);
+					/* Blocked; call it again with the same values */
+					if (err == Error_Yield)
+						expr = cons(ctx, fn, values);
+					values = nil;
 				} else {
 					goto push;
 				}
 			} else if (op.type == AtomType_Builtin) {
-				err = (*op.value.builtin)(args, result);
+				PROBE1(builtin, op.value.builtin);
+				err = (*op.value.builtin)(ctx, args, result);
 			} else {
 			push:
 				/* Handle function application */
-				stack = make_frame(stack, env, args);
+				stack = make_frame(ctx, stack, env, args);
 				expr = op;
 				continue;
 			}
 		}
 
-		if (nilp(stack))
+		if (!err && nilp(stack))
 			break;
 
 		if (!err)
-			err = eval_do_return(&stack, &expr, &env, result);
+			err = eval_do_return(ctx, &stack, &expr, &env, result);
+
+		/* Resume here if a continuation of this level was invoked */
+		if (err == Error_Throw)
+			err = eval_catch(ctx, &stack, &expr);
 	} while (!err);
 
+	/* Suspended; a builtin that blocked is called again on resume */
+	if (task && err == Error_Yield) {
+		gc_barrier(ctx, task->expr);
+		gc_barrier(ctx, task->env);
+		gc_barrier(ctx, task->stack);
+		task->expr = expr;
+		task->env = env;
+		task->stack = stack;
+	}
+
+	return err;
+}
+
+
+int eval_expr(Interp *ctx, Atom expr, Atom env, Atom *result)
+{
+	struct Root *roots = ctx->roots;
+	Error err;
+
+	++ctx->eval_depth;
+	err = eval_loop(ctx, expr, env, nil, NULL, result);
+	--ctx->eval_depth;
+	ctx->roots = roots;
+
+	/* Nothing left that could resume */
+	if (err == Error_Throw && ctx->eval_depth == 0)
+		ctx->throw_target = ctx->throw_value = nil;
+
 	return err;
 }
 
+int eval_resume(Interp *ctx, struct Task *task, Atom *result)
+{
+	struct Root *roots = ctx->roots;
+	Error err;
+
+	++ctx->eval_depth;
+	err = eval_loop(ctx, task->expr, task->env, task->stack, task, result);
+	--ctx->eval_depth;
+	ctx->roots = roots;
+
+	return err;
+}
+
+/* An expression which applies fn to already evaluated args */
+Atom make_call(Interp *ctx, Atom fn, Atom args)
+{
+	Atom expr, p;
+
+	/* Builtins are called with the values as they are */
+	if (fn.type == AtomType_Builtin)
+		return cons(ctx, fn, args);
+
+	/* Quote the arguments so they are not evaluated again */
+	expr = cons(ctx, fn, nil);
+	p = expr;
+	while (!nilp(args)) {
+		set_cdr(ctx, p, cons(ctx, cons(ctx, ctx->sym_quote,
+			cons(ctx, car(args), nil)), nil));
+		p = cdr(p);
+		args = cdr(args);
+	}
+
+	return expr;
+}
+
+int apply(Interp *ctx, Atom fn, Atom args, Atom *result)
+{
+	if (fn.type == AtomType_Builtin) {
+		PROBE1(builtin, fn.value.builtin);
+		return (*fn.value.builtin)(ctx, args, result);
+	}
+	else if (fn.type == AtomType_Continuation)
+		return continuation_throw(ctx, fn, args);
+	else if (fn.type == AtomType_Compiled)
+		return native_apply(ctx, fn, args, result);
+	else if (fn.type != AtomType_Closure)
+		return Error_Type;
+
+	return eval_expr(ctx, make_call(ctx, fn, args), ctx->env, result);
+}
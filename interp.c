@@ -0,0 +1,232 @@
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Interp *interp_create(void)
+{
+	Interp *ctx;
+	int i;
+
+	ctx = malloc(sizeof(Interp));
+	if (!ctx)
+		return NULL;
+
+	ctx->allocations = NULL;
+	ctx->sym_table = NULL;
+	ctx->sym_count = ctx->sym_size = 0;
+	ctx->share_constants = 0;
+	ctx->const_table = NULL;
+	ctx->const_count = ctx->const_size = 0;
+	ctx->roots = NULL;
+	ctx->gc_count = 0;
+	ctx->gc_budget = 0;
+	ctx->gc_threads = 1;
+	ctx->gc_phase = GCPhase_Idle;
+	ctx->gray = NULL;
+	ctx->gray_count = ctx->gray_size = 0;
+	ctx->sweep = NULL;
+	ctx->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	ctx->parent = NULL;
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->eval_depth = 0;
+	ctx->throw_target = ctx->throw_value = nil;
+	ctx->run_queue = ctx->run_tail = nil;
+	ctx->run_count = 0;
+	ctx->task_slice = 1000;
+	ctx->task = NULL;
+	ctx->task_depth = 0;
+	ctx->jit = NULL;
+	ctx->jit_threshold = 1000;
+	ctx->jit_depth = 0;
+	ctx->opt = NULL;
+	ctx->optimize = 1;
+	ctx->env_version = 0;
+	ctx->tail_args = NULL;
+	ctx->tail_count = ctx->tail_size = 0;
+	for (i = 0; i < PARAMS_CACHE_SIZE; ++i)
+		ctx->params_cache[i] = nil;
+	ctx->sym_t = make_sym(ctx, "T");
+	ctx->sym_quote = make_sym(ctx, "QUOTE");
+	ctx->sym_lambda = make_sym(ctx, "LAMBDA");
+	ctx->env = env_create(ctx, nil);
+
+	/* Set up the initial environment */
+	interp_define_builtin(ctx, "CAR", builtin_car);
+	interp_define_builtin(ctx, "CDR", builtin_cdr);
+	interp_define_builtin(ctx, "CONS", builtin_cons);
+	interp_define_builtin(ctx, "LIST", builtin_list);
+	interp_define_builtin(ctx, "APPEND", builtin_append);
+	interp_define_builtin(ctx, "REVERSE", builtin_reverse);
+	interp_define_builtin(ctx, "+", builtin_add);
+	interp_define_builtin(ctx, "-", builtin_subtract);
+	interp_define_builtin(ctx, "*", builtin_multiply);
+	interp_define_builtin(ctx, "/", builtin_divide);
+	env_define(ctx, ctx->env, ctx->sym_t, ctx->sym_t);
+	interp_define_builtin(ctx, "=", builtin_numeq);
+	interp_define_builtin(ctx, "<", builtin_less);
+	interp_define_builtin(ctx, "EQ?", builtin_eq);
+	interp_define_builtin(ctx, "EQUAL?", builtin_equal);
+	interp_define_builtin(ctx, "PAIR?", builtin_pairp);
+	interp_define_builtin(ctx, "PROCEDURE?", builtin_procp);
+	interp_define_builtin(ctx, "VECTOR?", builtin_vectorp);
+	interp_define_builtin(ctx, "MAKE-VECTOR", builtin_make_vector);
+	interp_define_builtin(ctx, "VECTOR-LENGTH", builtin_vector_length);
+	interp_define_builtin(ctx, "VECTOR-REF", builtin_vector_ref);
+	interp_define_builtin(ctx, "VECTOR-SET!", builtin_vector_set);
+	interp_define_builtin(ctx, "VECTOR->LIST", builtin_vector_to_list);
+	interp_define_builtin(ctx, "LIST->VECTOR", builtin_list_to_vector);
+	interp_define_builtin(ctx, "ARRAY?", builtin_arrayp);
+	interp_define_builtin(ctx, "MAKE-ARRAY", builtin_make_array);
+	interp_define_builtin(ctx, "ARRAY-LENGTH", builtin_array_length);
+	interp_define_builtin(ctx, "ARRAY-REF", builtin_array_ref);
+	interp_define_builtin(ctx, "ARRAY-SET!", builtin_array_set);
+	interp_define_builtin(ctx, "LIST->ARRAY", builtin_list_to_array);
+	interp_define_builtin(ctx, "ARRAY->LIST", builtin_array_to_list);
+	interp_define_builtin(ctx, "ARRAY-SUM", builtin_array_sum);
+	interp_define_builtin(ctx, "ARRAY-DOT", builtin_array_dot);
+	interp_define_builtin(ctx, "ARRAY-MIN", builtin_array_min);
+	interp_define_builtin(ctx, "ARRAY-MAX", builtin_array_max);
+	interp_define_builtin(ctx, "ARRAY-ADD", builtin_array_add);
+	interp_define_builtin(ctx, "ARRAY-SUBTRACT", builtin_array_subtract);
+	interp_define_builtin(ctx, "ARRAY-MULTIPLY", builtin_array_multiply);
+	interp_define_builtin(ctx, "ARRAY-SCALE", builtin_array_scale);
+	interp_define_builtin(ctx, "ARRAY-PREFIX-SUM", builtin_array_prefix_sum);
+	interp_define_builtin(ctx, "ARRAY-FILTER", builtin_array_filter);
+	interp_define_builtin(ctx, "HASH-TABLE?", builtin_hash_tablep);
+	interp_define_builtin(ctx, "MAKE-HASH-TABLE", builtin_make_hash_table);
+	interp_define_builtin(ctx, "HASH-TABLE-REF", builtin_hash_table_ref);
+	interp_define_builtin(ctx, "HASH-TABLE-SET!", builtin_hash_table_set);
+	interp_define_builtin(ctx, "HASH-TABLE-DELETE!", builtin_hash_table_delete);
+	interp_define_builtin(ctx, "HASH-TABLE-COUNT", builtin_hash_table_count);
+	interp_define_builtin(ctx, "HASH-TABLE-KEYS", builtin_hash_table_keys);
+	interp_define_builtin(ctx, "HASH-TABLE-FOLD", builtin_hash_table_fold);
+	interp_define_builtin(ctx, "STRING?", builtin_stringp);
+	interp_define_builtin(ctx, "STRING-LENGTH", builtin_string_length);
+	interp_define_builtin(ctx, "STRING-REF", builtin_string_ref);
+	interp_define_builtin(ctx, "SUBSTRING", builtin_substring);
+	interp_define_builtin(ctx, "STRING-APPEND", builtin_string_append);
+	interp_define_builtin(ctx, "STRING=?", builtin_string_eq);
+	interp_define_builtin(ctx, "STRING<?", builtin_string_less);
+	interp_define_builtin(ctx, "STRING->SYMBOL", builtin_string_to_symbol);
+	interp_define_builtin(ctx, "SYMBOL->STRING", builtin_symbol_to_string);
+	interp_define_builtin(ctx, "NUMBER->STRING", builtin_number_to_string);
+	interp_define_builtin(ctx, "STRING->NUMBER", builtin_string_to_number);
+	interp_define_builtin(ctx, "OPEN-INPUT-STRING", builtin_open_input_string);
+	interp_define_builtin(ctx, "OPEN-OUTPUT-STRING", builtin_open_output_string);
+	interp_define_builtin(ctx, "GET-OUTPUT-STRING", builtin_get_output_string);
+	interp_define_builtin(ctx, "OPEN-INPUT-FILE", builtin_open_input_file);
+	interp_define_builtin(ctx, "OPEN-OUTPUT-FILE", builtin_open_output_file);
+	interp_define_builtin(ctx, "CLOSE-PORT", builtin_close_port);
+	interp_define_builtin(ctx, "READ-LINE", builtin_read_line);
+	interp_define_builtin(ctx, "READ", builtin_read);
+	interp_define_builtin(ctx, "WRITE-STRING", builtin_write_string);
+	interp_define_builtin(ctx, "SPAWN", builtin_spawn);
+	interp_define_builtin(ctx, "YIELD", builtin_yield);
+	interp_define_builtin(ctx, "JOIN", builtin_join);
+	interp_define_builtin(ctx, "MAKE-CHANNEL", builtin_make_channel);
+	interp_define_builtin(ctx, "CHANNEL-SEND", builtin_channel_send);
+	interp_define_builtin(ctx, "CHANNEL-RECEIVE", builtin_channel_receive);
+	interp_define_builtin(ctx, "PARALLEL-MAP", builtin_parallel_map);
+	interp_define_builtin(ctx, "PARALLEL-FOR-EACH", builtin_parallel_for_each);
+	interp_define_builtin(ctx, "PROMISE?", builtin_promisep);
+	interp_define_builtin(ctx, "MAKE-PROMISE", builtin_make_promise);
+	interp_define_builtin(ctx, "MAKE-LAZY-PROMISE", builtin_make_lazy_promise);
+	interp_define_builtin(ctx, "FORCE", builtin_force);
+	interp_define_builtin(ctx, "RECORD?", builtin_recordp);
+	interp_define_builtin(ctx, "MAKE-RECORD-TYPE", builtin_make_record_type);
+	interp_define_builtin(ctx, "RECORD-CONSTRUCTOR", builtin_record_constructor);
+	interp_define_builtin(ctx, "RECORD-PREDICATE", builtin_record_predicate);
+	interp_define_builtin(ctx, "RECORD-ACCESSOR", builtin_record_accessor);
+	interp_define_builtin(ctx, "RECORD-MODIFIER", builtin_record_modifier);
+	interp_define_builtin(ctx, "DEFINE-RECORD-PROCEDURES",
+		builtin_define_record_procedures);
+
+	return ctx;
+}
+
+void interp_destroy(Interp *ctx)
+{
+	int i;
+
+	/* A cycle in progress would keep its snapshot alive */
+	gc_step(ctx, 0);
+
+	jit_destroy(ctx);
+	opt_destroy(ctx);
+	ctx->env = nil;
+	ctx->sym_t = ctx->sym_quote = ctx->sym_lambda = nil;
+	ctx->run_queue = ctx->run_tail = nil;
+	ctx->tail_count = 0;
+	for (i = 0; i < PARAMS_CACHE_SIZE; ++i)
+		ctx->params_cache[i] = nil;
+	gc(ctx);
+	gc_step(ctx, 0);
+
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->sym_table);
+	free(ctx->const_table);
+	free(ctx->tail_args);
+	free(ctx->gray);
+	free(ctx);
+}
+
+void interp_define_builtin(Interp *ctx, const char *name, Builtin fn)
+{
+	env_define(ctx, ctx->env, make_sym(ctx, name), make_builtin(fn));
+}
+
+int interp_eval_string(Interp *ctx, const char *input, Atom *result)
+{
+	const char *p = input;
+	Atom expr;
+	Error err;
+
+	*result = nil;
+
+	for (;;) {
+		/* Skip trailing whitespace and comments */
+		p += strspn(p, " \t\n");
+		if (*p == ';') {
+			p = strchr(p, '\n');
+			if (!p)
+				break;
+			continue;
+		}
+		if (*p == '\0')
+			break;
+
+		err = read_expr(ctx, p, &p, &expr);
+		if (!err)
+			err = eval_expr(ctx, expr, ctx->env, result);
+		if (err)
+			return err;
+	}
+
+	return Error_OK;
+}
+
+char *slurp(const char *path)
+{
+	FILE *file;
+	char *buf;
+	long len;
+
+	file = fopen(path, "r");
+	if (!file)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	buf = malloc(len + 1);
+	if (!buf)
+		return NULL;
+
+	fread(buf, 1, len, file);
+	buf[len] = 0;
+	fclose(file);
+
+	return buf;
+}
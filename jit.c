@@ -0,0 +1,1083 @@
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Baseline JIT. Every call of a top-level closure is counted against
+ * its body; once the count reaches jit_threshold the body is translated
+ * into x86-64 machine code, one template per form. The code keeps its
+ * values in a frame of Atom slots registered as a GC root, does fixnum
+ * arithmetic inline behind type guards, calls builtins directly and
+ * turns self tail calls into jumps. Whenever a guard fails it falls
+ * back to the interpreter's general operation for that one form. Macro
+ * uses are expanded while compiling; if one is redefined the code is
+ * discarded and the closure runs interpreted until it is hot again.
+ * Calls are counted in a small table indexed by the body's address,
+ * and an entry is only made for a body that gets hot; entries are weak
+ * on their body, so that the code of redefined procedures is dropped.
+ */
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define JIT_MAX_ARGS 16
+#define JIT_MAX_VARS 256
+#define JIT_MAX_DEPTH 1000
+#define JIT_MAX_FAILURES 4
+#define JIT_HOT_SIZE 1024
+
+typedef int (*JitCode)(Interp *ctx, Atom *argv, Atom *result, struct Pair *self);
+
+enum {
+	JitState_Cold,
+	JitState_Compiling,
+	JitState_Failed
+};
+
+/* Executable memory, unmapped with its entry */
+struct JitBlock {
+	struct JitBlock *next;
+	size_t size;
+	unsigned char code[];
+};
+
+struct JitEntry {
+	struct Pair *body;
+	Atom keep, guards;
+	JitCode code;
+	struct JitBlock *blocks;
+	long count;
+	int nargs, state, failures;
+};
+
+/* Calls of bodies with no entry yet; collisions only share a count */
+struct Jit {
+	struct JitEntry **entries;
+	long count, size;
+	long hot[JIT_HOT_SIZE];
+};
+
+struct Compiler {
+	Interp *ctx;
+	struct JitEntry *entry;
+	Atom self;
+	unsigned char *buf;
+	size_t len, size;
+	struct {
+		const char *name;
+		int slot;
+	} vars[JIT_MAX_VARS];
+	int nvars, nslots, max_slots;
+	size_t frame_at, clear_at, count_at, body_at;
+	size_t *exits;
+	long nexits, exits_size;
+};
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum {
+	CC_E = 0x4, CC_NE = 0x5, CC_GE = 0xd
+};
+
+/* Frame below the saved registers: Root at FRAME_ROOT, then the slots */
+#define FRAME_ROOT (-80)
+#define ROOT_FIELD(f) (FRAME_ROOT + (int32_t) offsetof(struct Root, f))
+#define SLOT(i) ((int32_t) (16 * (i)))
+
+/* Entry points for the generated code */
+
+static int jit_builtin(Interp *ctx, Builtin fn, Atom *argv, long argc, Atom *result)
+{
+	Atom args = nil;
+	struct Root root;
+	Error err;
+
+	gc_safepoint(ctx);
+
+	gc_protect(ctx, &root, &args, 1);
+	while (argc > 0)
+		args = cons(ctx, argv[--argc], args);
+	err = (*fn)(ctx, args, result);
+	ctx->roots = root.next;
+
+	return err;
+}
+
+static struct JitEntry *jit_ready(Interp *ctx, Atom fn, long argc);
+
+static int jit_apply(Interp *ctx, Atom *argv, long argc, Atom *result)
+{
+	struct JitEntry *e;
+	Atom args = nil;
+	struct Root root;
+	Error err;
+
+	gc_safepoint(ctx);
+
+	/* Straight into compiled code if there is any */
+	e = jit_ready(ctx, argv[0], argc - 1);
+	if (e)
+		return e->code(ctx, argv + 1, result, argv[0].value.pair);
+
+	gc_protect(ctx, &root, &args, 1);
+	while (argc > 1)
+		args = cons(ctx, argv[--argc], args);
+	err = apply(ctx, argv[0], args, result);
+	ctx->roots = root.next;
+
+	return err;
+}
+
+/* Emitter */
+
+static void emit(struct Compiler *c, int byte)
+{
+	if (c->len == c->size) {
+		c->size = c->size ? c->size * 2 : 4096;
+		c->buf = realloc(c->buf, c->size);
+	}
+	c->buf[c->len++] = byte;
+}
+
+static void emit32(struct Compiler *c, int32_t x)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		emit(c, ((uint32_t) x >> (8 * i)) & 0xff);
+}
+
+static void emit64(struct Compiler *c, uint64_t x)
+{
+	emit32(c, (int32_t) x);
+	emit32(c, (int32_t) (x >> 32));
+}
+
+static void patch32(struct Compiler *c, size_t at, int32_t x)
+{
+	memcpy(c->buf + at, &x, 4);
+}
+
+/* Point the rel32 field at 'at' to target */
+static void patch_jump(struct Compiler *c, size_t at, size_t target)
+{
+	patch32(c, at, (int32_t) (target - (at + 4)));
+}
+
+static void emit_rex(struct Compiler *c, int w, int reg, int rm)
+{
+	int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+
+	if (rex != 0x40)
+		emit(c, rex);
+}
+
+static void emit_opcode(struct Compiler *c, int opcode)
+{
+	if (opcode > 0xff)
+		emit(c, opcode >> 8);
+	emit(c, opcode & 0xff);
+}
+
+/* opcode reg, [base + disp32] */
+static void emit_mem(struct Compiler *c, int w, int opcode, int reg, int base, int32_t disp)
+{
+	emit_rex(c, w, reg, base);
+	emit_opcode(c, opcode);
+	emit(c, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		emit(c, 0x24);
+	emit32(c, disp);
+}
+
+/* opcode reg, rm */
+static void emit_reg(struct Compiler *c, int w, int opcode, int reg, int rm)
+{
+	emit_rex(c, w, reg, rm);
+	emit_opcode(c, opcode);
+	emit(c, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_mov_imm64(struct Compiler *c, int reg, uint64_t x)
+{
+	emit_rex(c, 1, 0, reg);
+	emit(c, 0xb8 + (reg & 7));
+	emit64(c, x);
+}
+
+static void emit_mov_imm32(struct Compiler *c, int reg, int32_t x)
+{
+	emit_rex(c, 0, 0, reg);
+	emit(c, 0xb8 + (reg & 7));
+	emit32(c, x);
+}
+
+static void emit_push(struct Compiler *c, int reg)
+{
+	emit_rex(c, 0, 0, reg);
+	emit(c, 0x50 + (reg & 7));
+}
+
+static void emit_pop(struct Compiler *c, int reg)
+{
+	emit_rex(c, 0, 0, reg);
+	emit(c, 0x58 + (reg & 7));
+}
+
+/* cmp dword [base + disp], x */
+static void emit_cmp_mem_imm(struct Compiler *c, int base, int32_t disp, int32_t x)
+{
+	emit_mem(c, 0, 0x81, 7, base, disp);
+	emit32(c, x);
+}
+
+static void emit_call_abs(struct Compiler *c, void *fn)
+{
+	emit_mov_imm64(c, RAX, (uintptr_t) fn);
+	emit_reg(c, 0, 0xff, 2, RAX);
+}
+
+/* Jumps return the position of their rel32 field */
+static size_t emit_jcc(struct Compiler *c, int cc)
+{
+	emit(c, 0x0f);
+	emit(c, 0x80 | cc);
+	emit32(c, 0);
+	return c->len - 4;
+}
+
+static size_t emit_jmp(struct Compiler *c)
+{
+	emit(c, 0xe9);
+	emit32(c, 0);
+	return c->len - 4;
+}
+
+/* Leave the function with the error code in eax */
+static void emit_exit(struct Compiler *c, int cc)
+{
+	if (c->nexits == c->exits_size) {
+		c->exits_size = c->exits_size ? c->exits_size * 2 : 16;
+		c->exits = realloc(c->exits, c->exits_size * sizeof(size_t));
+	}
+	c->exits[c->nexits++] = cc < 0 ? emit_jmp(c) : emit_jcc(c, cc);
+}
+
+/* Values are computed into edx (type) and rax (payload) */
+
+static void emit_load(struct Compiler *c, int base, int32_t disp)
+{
+	emit_mem(c, 1, 0x8b, RDX, base, disp);
+	emit_mem(c, 1, 0x8b, RAX, base, disp + 8);
+}
+
+static void emit_store(struct Compiler *c, int base, int32_t disp)
+{
+	emit_mem(c, 1, 0x89, RDX, base, disp);
+	emit_mem(c, 1, 0x89, RAX, base, disp + 8);
+}
+
+static void emit_const(struct Compiler *c, Atom a)
+{
+	emit_mov_imm32(c, RDX, a.type);
+	emit_mov_imm64(c, RAX, (uint64_t) a.value.integer);
+}
+
+/* Check an error code returned in eax, then load the result slot */
+static void emit_result(struct Compiler *c, int slot)
+{
+	emit_reg(c, 0, 0x85, RAX, RAX);
+	emit_exit(c, CC_NE);
+	emit_load(c, RBX, SLOT(slot));
+}
+
+static int alloc_slot(struct Compiler *c)
+{
+	int slot = c->nslots++;
+
+	if (c->nslots > c->max_slots)
+		c->max_slots = c->nslots;
+	return slot;
+}
+
+/* Compiler */
+
+static int compile_expr(struct Compiler *c, Atom expr, int tail);
+
+static int compile_body(struct Compiler *c, Atom body, int tail)
+{
+	if (nilp(body))
+		return -1;
+
+	for (; !nilp(body); body = cdr(body)) {
+		if (compile_expr(c, car(body), tail && nilp(cdr(body))))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int find_var(struct Compiler *c, Atom sym)
+{
+	int i;
+
+	for (i = c->nvars - 1; i >= 0; --i) {
+		if (c->vars[i].name == sym.value.symbol)
+			return c->vars[i].slot;
+	}
+
+	return -1;
+}
+
+/* The top-level (symbol . value) pair, which stays put once made */
+static Atom find_global(struct Compiler *c, Atom sym)
+{
+	Atom bs;
+
+	for (bs = cdr(c->ctx->env); !nilp(bs); bs = cdr(bs)) {
+		if (car(car(bs)).value.symbol == sym.value.symbol)
+			return car(bs);
+	}
+
+	return nil;
+}
+
+static int special_form(Atom op)
+{
+	static const char *const names[] = {
+		"QUOTE", "DEFINE", "LAMBDA", "IF", "DEFMACRO",
+		"APPLY", "CALL/CC", "CALL/EC", "SET!", NULL
+	};
+	int i;
+
+	for (i = 0; names[i]; ++i) {
+		if (strcmp(op.value.symbol, names[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int compile_ref(struct Compiler *c, Atom sym)
+{
+	int slot = find_var(c, sym);
+	Atom b;
+
+	if (slot >= 0) {
+		emit_load(c, RBX, SLOT(slot));
+		return 0;
+	}
+
+	b = find_global(c, sym);
+	if (nilp(b))
+		return -1;
+
+	emit_mov_imm64(c, R11, (uintptr_t) &cdr(b));
+	emit_load(c, R11, 0);
+	return 0;
+}
+
+static int compile_if(struct Compiler *c, Atom args, int tail)
+{
+	size_t to_else, to_end;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
+		return -1;
+
+	if (compile_expr(c, car(args), 0))
+		return -1;
+	emit_reg(c, 0, 0x85, RDX, RDX);
+	to_else = emit_jcc(c, CC_E);
+
+	if (compile_expr(c, car(cdr(args)), tail))
+		return -1;
+	to_end = emit_jmp(c);
+
+	patch_jump(c, to_else, c->len);
+	if (compile_expr(c, car(cdr(cdr(args))), tail))
+		return -1;
+	patch_jump(c, to_end, c->len);
+
+	return 0;
+}
+
+/* ((lambda (names...) body...) values...) binds slots, as LET does */
+static int compile_let(struct Compiler *c, Atom lambda, Atom args, int tail)
+{
+	Atom names, body;
+	int nvars = c->nvars, nslots = c->nslots;
+
+	if (nilp(cdr(lambda)) || !listp(cdr(lambda)))
+		return -1;
+	names = car(cdr(lambda));
+	body = cdr(cdr(lambda));
+
+	for (; !nilp(names); names = cdr(names), args = cdr(args)) {
+		int slot;
+
+		if (names.type != AtomType_Pair || car(names).type != AtomType_Symbol
+				|| nilp(args) || c->nvars == JIT_MAX_VARS)
+			return -1;
+
+		if (compile_expr(c, car(args), 0))
+			return -1;
+		slot = alloc_slot(c);
+		emit_store(c, RBX, SLOT(slot));
+
+		/* Not visible until the body */
+		c->vars[c->nvars].name = car(names).value.symbol;
+		c->vars[c->nvars].slot = slot;
+		++c->nvars;
+	}
+	if (!nilp(args))
+		return -1;
+
+	if (compile_body(c, body, tail))
+		return -1;
+
+	c->nvars = nvars;
+	c->nslots = nslots;
+	return 0;
+}
+
+/* Operator then arguments into consecutive slots */
+static int compile_operands(struct Compiler *c, Atom op, Atom args, int *base, int *argc)
+{
+	*base = c->nslots;
+	*argc = 0;
+
+	if (compile_expr(c, op, 0))
+		return -1;
+	emit_store(c, RBX, SLOT(alloc_slot(c)));
+
+	for (; !nilp(args); args = cdr(args)) {
+		if (compile_expr(c, car(args), 0))
+			return -1;
+		emit_store(c, RBX, SLOT(alloc_slot(c)));
+		++*argc;
+	}
+
+	return 0;
+}
+
+/* jit_apply on the operands, which leaves the result in the first slot */
+static void emit_apply(struct Compiler *c, int base, int argc)
+{
+	emit_reg(c, 1, 0x89, R13, RDI);
+	emit_mem(c, 1, 0x8d, RSI, RBX, SLOT(base));
+	emit_mov_imm32(c, RDX, argc + 1);
+	emit_mem(c, 1, 0x8d, RCX, RBX, SLOT(base));
+	emit_call_abs(c, jit_apply);
+	emit_result(c, base);
+}
+
+static void emit_builtin(struct Compiler *c, Builtin fn, int base, int argc)
+{
+	emit_reg(c, 1, 0x89, R13, RDI);
+	emit_mov_imm64(c, RSI, (uintptr_t) fn);
+	emit_mem(c, 1, 0x8d, RDX, RBX, SLOT(base + 1));
+	emit_mov_imm32(c, RCX, argc);
+	emit_mem(c, 1, 0x8d, R8, RBX, SLOT(base));
+	emit_call_abs(c, jit_builtin);
+	emit_result(c, base);
+}
+
+/* Two fixnum arguments in place, or the builtin itself */
+static void emit_arith(struct Compiler *c, Builtin fn, int base)
+{
+	int32_t a = SLOT(base + 1), b = SLOT(base + 2);
+	size_t to_slow[2], to_done, to_false;
+
+	emit_cmp_mem_imm(c, RBX, a, AtomType_Integer);
+	to_slow[0] = emit_jcc(c, CC_NE);
+	emit_cmp_mem_imm(c, RBX, b, AtomType_Integer);
+	to_slow[1] = emit_jcc(c, CC_NE);
+
+	emit_mem(c, 1, 0x8b, RAX, RBX, a + 8);
+	if (fn == builtin_add) {
+		emit_mem(c, 1, 0x03, RAX, RBX, b + 8);
+	} else if (fn == builtin_subtract) {
+		emit_mem(c, 1, 0x2b, RAX, RBX, b + 8);
+	} else if (fn == builtin_multiply) {
+		emit_mem(c, 1, 0x0faf, RAX, RBX, b + 8);
+	} else {
+		emit_mem(c, 1, 0x3b, RAX, RBX, b + 8);
+		to_false = emit_jcc(c, fn == builtin_numeq ? CC_NE : CC_GE);
+		emit_const(c, c->ctx->sym_t);
+		to_done = emit_jmp(c);
+		patch_jump(c, to_false, c->len);
+		emit_const(c, nil);
+		patch_jump(c, to_done, c->len);
+	}
+	if (fn == builtin_add || fn == builtin_subtract || fn == builtin_multiply)
+		emit_mov_imm32(c, RDX, AtomType_Integer);
+
+	to_done = emit_jmp(c);
+	patch_jump(c, to_slow[0], c->len);
+	patch_jump(c, to_slow[1], c->len);
+	emit_builtin(c, fn, base, 2);
+	patch_jump(c, to_done, c->len);
+}
+
+static int inline_builtin(Builtin fn)
+{
+	return fn == builtin_add || fn == builtin_subtract || fn == builtin_multiply
+		|| fn == builtin_numeq || fn == builtin_less;
+}
+
+/* A call through a top-level binding whose current value is known */
+static int compile_global_call(struct Compiler *c, Atom b, Atom args, int tail)
+{
+	Atom value = cdr(b);
+	int base, argc, i;
+	size_t to_generic[2], to_done;
+
+	if (value.type == AtomType_Macro) {
+		Atom expansion;
+		struct Root root;
+		Error err;
+
+		value.type = AtomType_Closure;
+		err = apply(c->ctx, value, args, &expansion);
+		if (err)
+			return -1;
+
+		/* Keep the expansion, and the macro to check on entry */
+		gc_protect(c->ctx, &root, &expansion, 1);
+		c->entry->keep = cons(c->ctx, expansion, c->entry->keep);
+		c->entry->guards = cons(c->ctx, cons(c->ctx, b, cdr(b)), c->entry->guards);
+		c->ctx->roots = root.next;
+
+		return compile_expr(c, expansion, tail);
+	}
+
+	if (compile_operands(c, car(b), args, &base, &argc))
+		return -1;
+
+	if (value.type == AtomType_Builtin) {
+		/* Still the same builtin? */
+		emit_cmp_mem_imm(c, RBX, SLOT(base), AtomType_Builtin);
+		to_generic[0] = emit_jcc(c, CC_NE);
+		emit_mov_imm64(c, RCX, (uintptr_t) value.value.builtin);
+		emit_mem(c, 1, 0x3b, RCX, RBX, SLOT(base) + 8);
+		to_generic[1] = emit_jcc(c, CC_NE);
+
+		if (argc == 2 && inline_builtin(value.value.builtin))
+			emit_arith(c, value.value.builtin, base);
+		else
+			emit_builtin(c, value.value.builtin, base, argc);
+	} else if (value.type == AtomType_Closure
+			&& value.value.pair == c->self.value.pair
+			&& argc == c->entry->nargs) {
+		/* Still this closure? */
+		emit_cmp_mem_imm(c, RBX, SLOT(base), AtomType_Closure);
+		to_generic[0] = emit_jcc(c, CC_NE);
+		emit_mem(c, 1, 0x3b, R14, RBX, SLOT(base) + 8);
+		to_generic[1] = emit_jcc(c, CC_NE);
+
+		if (tail) {
+			/* New arguments, and back to the top */
+			for (i = 0; i < argc; ++i) {
+				emit_mem(c, 1, 0x8b, RAX, RBX, SLOT(base + 1 + i));
+				emit_mem(c, 1, 0x89, RAX, RBX, SLOT(i));
+				emit_mem(c, 1, 0x8b, RAX, RBX, SLOT(base + 1 + i) + 8);
+				emit_mem(c, 1, 0x89, RAX, RBX, SLOT(i) + 8);
+			}
+			patch_jump(c, emit_jmp(c), c->body_at);
+		} else {
+			size_t to_deep;
+
+			/* Deep recursion is left to the interpreter's own stack */
+			emit_cmp_mem_imm(c, R13, offsetof(Interp, jit_depth), JIT_MAX_DEPTH);
+			to_deep = emit_jcc(c, CC_GE);
+			emit_reg(c, 1, 0x89, R13, RDI);
+			emit_mem(c, 1, 0x8d, RSI, RBX, SLOT(base + 1));
+			emit_mem(c, 1, 0x8d, RDX, RBX, SLOT(base));
+			emit_reg(c, 1, 0x89, R14, RCX);
+			emit(c, 0xe8);
+			emit32(c, 0);
+			patch_jump(c, c->len - 4, 0);
+			emit_result(c, base);
+			to_done = emit_jmp(c);
+
+			patch_jump(c, to_deep, c->len);
+			emit_apply(c, base, argc);
+			patch_jump(c, to_done, c->len);
+			c->nslots = base;
+			return 0;
+		}
+	} else {
+		emit_apply(c, base, argc);
+		c->nslots = base;
+		return 0;
+	}
+
+	to_done = emit_jmp(c);
+	patch_jump(c, to_generic[0], c->len);
+	patch_jump(c, to_generic[1], c->len);
+	emit_apply(c, base, argc);
+	patch_jump(c, to_done, c->len);
+
+	c->nslots = base;
+	return 0;
+}
+
+static int compile_expr(struct Compiler *c, Atom expr, int tail)
+{
+	Atom op, args, b;
+	int base, argc;
+
+	if (expr.type == AtomType_Symbol)
+		return compile_ref(c, expr);
+
+	if (expr.type != AtomType_Pair) {
+		emit_const(c, expr);
+		return 0;
+	}
+
+	if (!listp(expr))
+		return -1;
+
+	op = car(expr);
+	args = cdr(expr);
+
+	if (op.type == AtomType_Symbol) {
+		if (strcmp(op.value.symbol, "QUOTE") == 0) {
+			if (nilp(args) || !nilp(cdr(args)))
+				return -1;
+			emit_const(c, car(args));
+			return 0;
+		} else if (strcmp(op.value.symbol, "IF") == 0) {
+			return compile_if(c, args, tail);
+		} else if (special_form(op)) {
+			return -1;
+		}
+
+		if (find_var(c, op) < 0) {
+			b = find_global(c, op);
+			if (nilp(b))
+				return -1;
+			return compile_global_call(c, b, args, tail);
+		}
+	} else if (op.type == AtomType_Pair && car(op).type == AtomType_Symbol
+			&& strcmp(car(op).value.symbol, "LAMBDA") == 0) {
+		return compile_let(c, op, args, tail);
+	} else if (op.type == AtomType_Builtin) {
+		/* Only made by make_call */
+		return -1;
+	}
+
+	if (compile_operands(c, op, args, &base, &argc))
+		return -1;
+	emit_apply(c, base, argc);
+	c->nslots = base;
+
+	return 0;
+}
+
+static void emit_prologue(struct Compiler *c)
+{
+	int i;
+
+	emit_push(c, RBP);
+	emit_reg(c, 1, 0x89, RSP, RBP);
+	emit_push(c, RBX);
+	emit_push(c, R12);
+	emit_push(c, R13);
+	emit_push(c, R14);
+	emit_push(c, R15);
+	emit_reg(c, 1, 0x89, RDI, R13);
+	emit_reg(c, 1, 0x89, RDX, R12);
+	emit_reg(c, 1, 0x89, RCX, R14);
+
+	/* sub rsp, frame size; filled in once the slots are known */
+	emit_reg(c, 1, 0x81, 5, RSP);
+	c->frame_at = c->len;
+	emit32(c, 0);
+	emit_reg(c, 1, 0x89, RSP, RBX);
+
+	/* Clear the slots: rep stosq */
+	emit_reg(c, 1, 0x89, RBX, RDI);
+	emit_mov_imm32(c, RCX, 0);
+	c->clear_at = c->len - 4;
+	emit_reg(c, 0, 0x31, RAX, RAX);
+	emit(c, 0xf3);
+	emit(c, 0x48);
+	emit(c, 0xab);
+
+	for (i = 0; i < c->entry->nargs; ++i) {
+		emit_mem(c, 1, 0x8b, RAX, RSI, SLOT(i));
+		emit_mem(c, 1, 0x89, RAX, RBX, SLOT(i));
+		emit_mem(c, 1, 0x8b, RAX, RSI, SLOT(i) + 8);
+		emit_mem(c, 1, 0x89, RAX, RBX, SLOT(i) + 8);
+	}
+
+	/* Register the slots with the collector */
+	emit_mem(c, 1, 0x89, RBX, RBP, ROOT_FIELD(atoms));
+	emit_mem(c, 0, 0xc7, 0, RBP, ROOT_FIELD(count));
+	emit32(c, 0);
+	c->count_at = c->len - 4;
+	emit_mem(c, 1, 0x8b, RAX, R13, offsetof(Interp, roots));
+	emit_mem(c, 1, 0x89, RAX, RBP, ROOT_FIELD(next));
+	emit_mem(c, 1, 0x8d, RAX, RBP, FRAME_ROOT);
+	emit_mem(c, 1, 0x89, RAX, R13, offsetof(Interp, roots));
+	emit_mem(c, 0, 0xff, 0, R13, offsetof(Interp, jit_depth));
+
+	c->body_at = c->len;
+}
+
+static void emit_epilogue(struct Compiler *c)
+{
+	long i;
+
+	/* Store the result and succeed */
+	emit_mem(c, 1, 0x89, RDX, R12, 0);
+	emit_mem(c, 1, 0x89, RAX, R12, 8);
+	emit_reg(c, 0, 0x31, RAX, RAX);
+
+	for (i = 0; i < c->nexits; ++i)
+		patch_jump(c, c->exits[i], c->len);
+
+	emit_mem(c, 1, 0x8b, RCX, RBP, ROOT_FIELD(next));
+	emit_mem(c, 1, 0x89, RCX, R13, offsetof(Interp, roots));
+	emit_mem(c, 0, 0xff, 1, R13, offsetof(Interp, jit_depth));
+	emit_mem(c, 1, 0x8d, RSP, RBP, -40);
+	emit_pop(c, R15);
+	emit_pop(c, R14);
+	emit_pop(c, R13);
+	emit_pop(c, R12);
+	emit_pop(c, RBX);
+	emit_pop(c, RBP);
+	emit(c, 0xc3);
+}
+
+/* Fill in the frame size and slot count */
+static void finish_frame(struct Compiler *c)
+{
+	/* Saved registers and the Root sit above the slots */
+	patch32(c, c->frame_at, 40 + SLOT(c->max_slots));
+	patch32(c, c->clear_at, 2 * c->max_slots);
+	patch32(c, c->count_at, c->max_slots);
+}
+
+static JitCode install(struct JitEntry *e, struct Compiler *c)
+{
+	struct JitBlock *block;
+	size_t size = sizeof(struct JitBlock) + c->len;
+
+	block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (block == MAP_FAILED)
+		return NULL;
+
+	/* Code discarded by a guard may still be running further up */
+	block->size = size;
+	block->next = e->blocks;
+	memcpy(block->code, c->buf, c->len);
+	if (mprotect(block, size, PROT_READ | PROT_EXEC) < 0) {
+		munmap(block, size);
+		return NULL;
+	}
+	e->blocks = block;
+
+	return (JitCode) (void *) block->code;
+}
+
+static void jit_compile(Interp *ctx, struct JitEntry *e, Atom fn)
+{
+	struct Compiler c;
+	Atom names;
+
+	memset(&c, 0, sizeof(c));
+	c.ctx = ctx;
+	c.entry = e;
+	c.self = fn;
+
+	/* Fixed arguments only */
+	e->nargs = 0;
+	for (names = closure_params(fn); !nilp(names); names = cdr(names)) {
+		if (names.type != AtomType_Pair || e->nargs == JIT_MAX_ARGS)
+			return;
+		c.vars[c.nvars].name = car(names).value.symbol;
+		c.vars[c.nvars].slot = alloc_slot(&c);
+		++c.nvars;
+		++e->nargs;
+	}
+
+	e->state = JitState_Compiling;
+	e->keep = e->guards = nil;
+
+	emit_prologue(&c);
+	if (compile_body(&c, cdr(cdr(fn)), 1) == 0) {
+		emit_epilogue(&c);
+
+		finish_frame(&c);
+		e->code = install(e, &c);
+	}
+
+	e->state = e->code ? JitState_Cold : JitState_Failed;
+
+	free(c.buf);
+	free(c.exits);
+}
+
+/* Entry table, keyed on the closure body which make_closure shares */
+
+static long jit_hash(struct Pair *body, long size)
+{
+	return ((uintptr_t) body >> 4) & (size - 1);
+}
+
+static void jit_insert(struct Jit *jit, struct JitEntry *e)
+{
+	long i = jit_hash(e->body, jit->size);
+
+	while (jit->entries[i])
+		i = (i + 1) & (jit->size - 1);
+	jit->entries[i] = e;
+	++jit->count;
+}
+
+/* Move the entries to a new table, dropping those whose body died */
+static void jit_rebuild(struct Jit *jit, long size, int marked_only)
+{
+	struct JitEntry **old = jit->entries;
+	long n = jit->size, i;
+
+	jit->entries = calloc(size, sizeof(struct JitEntry *));
+	jit->size = size;
+	jit->count = 0;
+	for (i = 0; i < n; ++i) {
+		struct JitEntry *e = old[i];
+		Atom body;
+
+		if (!e)
+			continue;
+
+		body.type = AtomType_Pair;
+		body.value.pair = e->body;
+		if (!marked_only || gc_marked(body)) {
+			jit_insert(jit, e);
+			continue;
+		}
+
+		/* Nothing can be running code for a body nothing refers to */
+		while (e->blocks) {
+			struct JitBlock *block = e->blocks;
+			e->blocks = block->next;
+			munmap(block, block->size);
+		}
+		free(e);
+	}
+	free(old);
+}
+
+static struct JitEntry *jit_lookup(Interp *ctx, struct Pair *body)
+{
+	struct Jit *jit = ctx->jit;
+	long i;
+
+	if (!jit || jit->size == 0)
+		return NULL;
+
+	i = jit_hash(body, jit->size);
+	for (; jit->entries[i]; i = (i + 1) & (jit->size - 1)) {
+		if (jit->entries[i]->body == body)
+			return jit->entries[i];
+	}
+
+	return NULL;
+}
+
+/* Count a call of a body with no entry; an entry once it is hot */
+static struct JitEntry *jit_count(Interp *ctx, struct Pair *body)
+{
+	struct Jit *jit = ctx->jit;
+	struct JitEntry *e;
+	long *hot;
+
+	if (!jit) {
+		jit = ctx->jit = calloc(1, sizeof(struct Jit));
+		if (!jit)
+			return NULL;
+	}
+
+	hot = &jit->hot[jit_hash(body, JIT_HOT_SIZE)];
+	if (++*hot < ctx->jit_threshold)
+		return NULL;
+	*hot = 0;
+
+	if (2 * (jit->count + 1) > jit->size)
+		jit_rebuild(jit, jit->size ? 2 * jit->size : 64, 0);
+
+	e = calloc(1, sizeof(struct JitEntry));
+	e->body = body;
+	e->keep = e->guards = nil;
+	e->count = ctx->jit_threshold;
+	jit_insert(jit, e);
+
+	return e;
+}
+
+static int jit_usable(Interp *ctx, Atom fn)
+{
+	return ctx->jit_threshold > 0 && !ctx->parent && !ctx->task
+		&& fn.type == AtomType_Closure
+		&& car(fn).value.pair == ctx->env.value.pair
+		&& !nilp(cdr(cdr(fn)));
+}
+
+/* Drop code compiled against a macro that has since changed */
+static int check_guards(struct JitEntry *e)
+{
+	Atom g;
+
+	for (g = e->guards; !nilp(g); g = cdr(g)) {
+		Atom b = car(car(g));
+		if (!atom_eq(cdr(b), cdr(car(g)))) {
+			e->code = NULL;
+			e->count = 0;
+			e->keep = e->guards = nil;
+			if (++e->failures >= JIT_MAX_FAILURES)
+				e->state = JitState_Failed;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static struct JitEntry *jit_ready(Interp *ctx, Atom fn, long argc)
+{
+	struct JitEntry *e;
+
+	if (!jit_usable(ctx, fn) || !ctx->jit || ctx->jit_depth >= JIT_MAX_DEPTH)
+		return NULL;
+
+	e = jit_lookup(ctx, cdr(cdr(fn)).value.pair);
+	if (!e || !e->code || e->nargs != argc || !check_guards(e))
+		return NULL;
+
+	return e;
+}
+
+int jit_enter(Interp *ctx, Atom fn, Atom *args, Atom *result, int *err)
+{
+	struct JitEntry *e;
+	Atom argv[JIT_MAX_ARGS], a;
+	long argc = 0;
+
+	if (!jit_usable(ctx, fn))
+		return 0;
+
+	e = jit_lookup(ctx, cdr(cdr(fn)).value.pair);
+	if (!e) {
+		e = jit_count(ctx, cdr(cdr(fn)).value.pair);
+		if (!e)
+			return 0;
+	} else if (!e->code && e->state == JitState_Cold) {
+		++e->count;
+	}
+
+	if (!e->code && e->state == JitState_Cold
+			&& e->count >= ctx->jit_threshold)
+		jit_compile(ctx, e, fn);
+
+	e = jit_ready(ctx, fn, e->nargs);
+	if (!e)
+		return 0;
+
+	for (a = *args; !nilp(a); a = cdr(a)) {
+		if (argc == e->nargs)
+			return 0;
+		argv[argc++] = car(a);
+	}
+	if (argc != e->nargs)
+		return 0;
+
+	/* The slots hold the arguments now; let go of the list */
+	*args = nil;
+	*err = e->code(ctx, argv, result, fn.value.pair);
+	return 1;
+}
+
+/* The bodies are weak; see jit_purge */
+void jit_mark(Interp *ctx)
+{
+	struct Jit *jit = ctx->jit;
+	long i;
+
+	if (!jit)
+		return;
+
+	for (i = 0; i < jit->size; ++i) {
+		struct JitEntry *e = jit->entries[i];
+		if (!e)
+			continue;
+		gc_mark(ctx, e->keep);
+		gc_mark(ctx, e->guards);
+	}
+}
+
+/* Drop the entries of bodies the mark phase left white */
+void jit_purge(Interp *ctx)
+{
+	struct Jit *jit = ctx->jit;
+
+	if (jit && jit->count > 0)
+		jit_rebuild(jit, jit->size, 1);
+}
+
+void jit_destroy(Interp *ctx)
+{
+	struct Jit *jit = ctx->jit;
+	long i;
+
+	if (!jit)
+		return;
+
+	for (i = 0; i < jit->size; ++i) {
+		struct JitEntry *e = jit->entries[i];
+		if (!e)
+			continue;
+		while (e->blocks) {
+			struct JitBlock *block = e->blocks;
+			e->blocks = block->next;
+			munmap(block, block->size);
+		}
+		free(e);
+	}
+	free(jit->entries);
+	free(jit);
+	ctx->jit = NULL;
+}
+
+#else
+
+/* No code generator for this platform; everything is interpreted */
+
+int jit_enter(Interp *ctx, Atom fn, Atom *args, Atom *result, int *err)
+{
+	return 0;
+}
+
+void jit_mark(Interp *ctx)
+{
+}
+
+void jit_purge(Interp *ctx)
+{
+}
+
+void jit_destroy(Interp *ctx)
+{
+}
+
+#endif
@@ -2,8 +2,6 @@
 ;; Functions used in macro definitions
 ;;
 
-(define (append a b) (foldr cons b a))
-
 (define (caar x) (car (car x)))
 (define (cadr x) (car (cdr x)))
 (define (cdar x) (cdr (car x)))
@@ -22,20 +20,21 @@
             (foldr proc init (cdr list)))
       init))
 
-(define (list . items)
-  (foldr cons nil items))
-
+;; LIST, APPEND and REVERSE are builtins, so long results come out packed
 (define (unary-map proc list)
-  (foldr (lambda (x rest) (cons (proc x) rest))
-         nil
-         list))
+  (reverse (foldl (lambda (acc x) (cons (proc x) acc)) nil list)))
+
+(define (map-lists proc lists acc)
+  (if (car lists)
+      (map-lists proc
+                 (unary-map cdr lists)
+                 (cons (apply proc (unary-map car lists)) acc))
+      (reverse acc)))
 
 (define (map proc . arg-lists)
-  (if (car arg-lists)
-      (cons (apply proc (unary-map car arg-lists))
-            (apply map (cons proc
-                             (unary-map cdr arg-lists))))
-      nil))
+  (if (cdr arg-lists)
+      (map-lists proc arg-lists nil)
+      (unary-map proc (car arg-lists))))
 
 ;;
 ;; Quasiquote
@@ -98,28 +97,6 @@
 ;; Numeric functions
 ;;
 
-(define +
-  (let ((old+ +))
-    (lambda xs (foldl old+ 0 xs))))
-
-(define -
-  (let ((old- -))
-    (lambda (x . xs)
-      (if xs
-          (foldl old- x xs)
-          (old- 0 x)))))
-
-(define *
-  (let ((old* *))
-    (lambda xs (foldl old* 1 xs))))
-
-(define /
-  (let ((old/ /))
-    (lambda (x . xs)
-      (if xs
-          (foldl old/ x xs)
-          (old/ 1 x)))))
-
 (define (<= a b) (or (= a b) (< a b)))
 (define (> a b) (< b a))
 (define (>= a b) (<= b a))
@@ -181,8 +158,66 @@
       x
       (list-tail (cdr x) (- k 1))))
 
-(define (reverse list)
-  (foldl (lambda (a x) (cons x a)) nil list))
+;;
+;; Vector functions
+;;
+
+(define (vector . items) (list->vector items))
+
+;;
+;; Promises and streams
+;;
+
+(defmacro (delay expr)
+  `(make-lazy-promise (lambda () ,expr)))
+
+;; A stream is nil or a pair whose cdr is a promise of the rest
+(defmacro (stream-cons a b)
+  `(cons ,a (delay ,b)))
+
+(define (stream-car s) (car s))
+(define (stream-cdr s) (force (cdr s)))
+
+(define (stream-map proc s)
+  (if s
+      (stream-cons (proc (stream-car s))
+                   (stream-map proc (stream-cdr s)))
+      nil))
+
+(define (stream-filter pred s)
+  (if s
+      (if (pred (stream-car s))
+          (stream-cons (stream-car s)
+                       (stream-filter pred (stream-cdr s)))
+          (stream-filter pred (stream-cdr s)))
+      nil))
+
+(define (stream-fold proc init s)
+  (if s
+      (stream-fold proc (proc init (stream-car s)) (stream-cdr s))
+      init))
+
+;; The expressions in a file, read as the stream is forced
+(define (stream-from-file path)
+  (define port (open-input-file path))
+  (define eof (list 'eof))
+  (define (next)
+    (let ((x (read port eof)))
+      (if (eq? x eof)
+          (begin (close-port port) nil)
+          (stream-cons x (next)))))
+  (next))
+
+;;
+;; Records
+;;
+
+;; (define-record-type point (make-point x y) point? (x point-x set-point-x!))
+;; The procedures are bound globally, even inside a body
+(defmacro (define-record-type type constructor predicate . fields)
+  `(define ,type
+     (define-record-procedures (make-record-type ',type ',(map car fields))
+                               ',constructor ',predicate ',fields)))
 
 ;;
 ;; Other functions
@@ -1,14 +1,26 @@
+#include <pthread.h>
+#include <stdio.h>
+
 typedef enum {
 	Error_OK = 0,
 	Error_Syntax,
 	Error_Unbound,
 	Error_Args,
-	Error_Type
+	Error_Type,
+	Error_Range,
+	Error_Throw,
+	Error_Yield,
+	Error_Deadlock,
+	Error_Constant,
+	Error_Tail
 } Error;
 
 struct Atom;
+struct Interp;
 
-typedef int (*Builtin)(struct Atom args, struct Atom *result);
+typedef int (*Builtin)(struct Interp *ctx, struct Atom args, struct Atom *result);
+typedef int (*Native)(struct Interp *ctx, struct Atom self, struct Atom *args, int argc,
+	struct Atom *result);
 
 struct Atom {
 	enum {
@@ -18,11 +30,32 @@ struct Atom {
 		AtomType_Integer,
 		AtomType_Builtin,
 		AtomType_Closure,
-		AtomType_Macro
+		AtomType_Macro,
+		AtomType_Continuation,
+		AtomType_Vector,
+		AtomType_Array,
+		AtomType_Table,
+		AtomType_String,
+		AtomType_Port,
+		AtomType_Task,
+		AtomType_Channel,
+		AtomType_Compiled,
+		AtomType_Promise,
+		AtomType_Record
 	} type;
 
 	union {
 		struct Pair *pair;
+		struct Vector *vector;
+		struct Array *array;
+		struct Table *table;
+		struct String *string;
+		struct Port *port;
+		struct Task *task;
+		struct Channel *channel;
+		struct Compiled *compiled;
+		struct Promise *promise;
+		struct Record *record;
 		const char *symbol;
 		long integer;
 		Builtin builtin;
@@ -33,6 +66,76 @@ struct Pair {
 	struct Atom atom[2];
 };
 
+struct Vector {
+	long length;
+	struct Atom items[];
+};
+
+/* Unboxed integers; holds no references */
+struct Array {
+	long length;
+	long items[];
+};
+
+/* Hash table; old_* is storage still being migrated after a resize */
+struct Table {
+	struct Atom buckets, hashes;
+	struct Atom old_buckets, old_hashes;
+	long count, used, migrated;
+	int equal;
+};
+
+/* Immutable; data is also NUL-terminated */
+struct String {
+	long length;
+	char data[];
+};
+
+/* Buffered file, or a memory stream over a string */
+struct Port {
+	struct Atom source;
+	FILE *file;
+	char *buf;
+	size_t size;
+	int input;
+};
+
+/* Green thread; a suspended task resumes from expr, env and stack */
+struct Task {
+	struct Atom expr, env, stack, result;
+	long steps;
+	int done, err;
+};
+
+/* Unbounded FIFO of messages */
+struct Channel {
+	struct Atom head, tail;
+};
+
+/* Procedure compiled by lisp -C, with the values it captured */
+struct Compiled {
+	Native fn;
+	long count;
+	struct Atom vars[];
+};
+
+/* Holds a thunk until forced, then its value */
+struct Promise {
+	struct Atom value;
+	int done;
+};
+
+/*
+ * Instance of a record type, whose descriptor is the type; slots follow
+ * it directly. A descriptor is itself a record with a nil type and the
+ * slots (name fields count).
+ */
+struct Record {
+	long count;
+	struct Atom type;
+	struct Atom slots[];
+};
+
 typedef struct Atom Atom;
 
 #define car(p) ((p).value.pair->atom[0])
@@ -41,49 +144,259 @@ typedef struct Atom Atom;
 
 static const Atom nil = { AtomType_Nil };
 
+/* INTERPRETER */
+
+/* Locations outside the heap which the collector must treat as live */
+struct Root {
+	Atom *atoms;
+	int count;
+	struct Root *next;
+};
+
+typedef enum {
+	GCPhase_Idle = 0,
+	GCPhase_Mark,
+	GCPhase_Sweep
+} GCPhase;
+
+#define PARAMS_CACHE_SIZE 256
+
+typedef struct Interp {
+	struct Allocation *allocations;
+	struct Symbol **sym_table;
+	size_t sym_count, sym_size;
+	/* Made once, so that workers need no lock for them */
+	Atom sym_t, sym_quote, sym_lambda;
+	int share_constants;
+	Atom *const_table;
+	size_t const_count, const_size;
+	Atom env;
+	struct Root *roots;
+	int gc_count;
+	long gc_budget;
+	int gc_threads;
+	GCPhase gc_phase;
+	struct Allocation **gray;
+	long gray_count, gray_size;
+	struct Allocation *sweep;
+	int threads;
+	struct Interp *parent;
+	pthread_mutex_t lock;
+	int eval_depth;
+	Atom throw_target, throw_value;
+	Atom run_queue, run_tail;
+	long run_count, task_slice;
+	struct Task *task;
+	int task_depth;
+	struct Jit *jit;
+	long jit_threshold;
+	int jit_depth;
+	struct Optimizer *opt;
+	int optimize;
+	long env_version;
+	Atom *tail_args;
+	int tail_count, tail_size;
+	Atom params_cache[PARAMS_CACHE_SIZE];
+} Interp;
+
+Interp *interp_create(void);
+void interp_destroy(Interp *ctx);
+void interp_define_builtin(Interp *ctx, const char *name, Builtin fn);
+int interp_eval_string(Interp *ctx, const char *input, Atom *result);
+char *slurp(const char *path);
+
 /* READER */
 
-int read_expr(const char *input, const char **end, Atom *result);
+int lex(const char *str, const char **start, const char **end);
+int read_expr(Interp *ctx, const char *input, const char **end, Atom *result);
 
 /* PRINTER */
 
 void print_expr(Atom atom);
+void print_error(Error err);
+
+/* SERVER */
+
+int serve(Interp *ctx, const char *path, int workers);
+
+/* COMPILED CODE */
+
+/* One top-level form of a compiled program; source is echoed on error */
+struct NativeForm {
+	Native fn;
+	Atom *source;
+};
+
+int compile_program(Interp *ctx, const char *output, char **paths, int count);
+int native_call(Interp *ctx, Atom fn, Atom *args, int argc, Atom *result);
+int native_tail(Interp *ctx, Atom *args, int count);
+int native_apply(Interp *ctx, Atom fn, Atom list, Atom *result);
+int native_tail_apply(Interp *ctx, Atom fn, Atom list);
+int native_call_cc(Interp *ctx, Atom fn, int escape, Atom *result);
+int native_global(Interp *ctx, Atom symbol, Atom **value);
+Atom native_list(Interp *ctx, Atom *items, int count);
+void native_run(Interp *ctx, const struct NativeForm *forms, int count);
+
+/* JIT */
+
+int jit_enter(Interp *ctx, Atom fn, Atom *args, Atom *result, int *err);
+void jit_mark(Interp *ctx);
+void jit_purge(Interp *ctx);
+void jit_destroy(Interp *ctx);
+
+/* OPTIMIZER */
+
+void opt_define(Interp *ctx, Atom symbol, Atom fn);
+Atom opt_body(Interp *ctx, Atom fn);
+void opt_mark(Interp *ctx);
+void opt_purge(Interp *ctx);
+void opt_destroy(Interp *ctx);
 
 /* EVALUATOR */
 
-Atom env_create(Atom parent);
-int env_define(Atom env, Atom symbol, Atom value);
+/* A closure is (env desc . body); the descriptor keeps the parameters */
+#define closure_params(fn) (car(cdr(fn)).value.vector->items[0])
+
+Atom env_create(Interp *ctx, Atom parent);
+int env_define(Interp *ctx, Atom env, Atom symbol, Atom value);
 int env_get(Atom env, Atom symbol, Atom *result);
-int env_set(Atom env, Atom symbol, Atom value);
-int eval_expr(Atom expr, Atom env, Atom *result);
+int env_set(Interp *ctx, Atom env, Atom symbol, Atom value);
+int eval_expr(Interp *ctx, Atom expr, Atom env, Atom *result);
+int eval_resume(Interp *ctx, struct Task *task, Atom *result);
+Atom make_call(Interp *ctx, Atom fn, Atom args);
+int apply(Interp *ctx, Atom fn, Atom args, Atom *result);
 
 /* DATA */
 
-Atom cons(Atom car_val, Atom cdr_val);
+Atom cons(Interp *ctx, Atom car_val, Atom cdr_val);
+Atom make_vector(Interp *ctx, long length, Atom fill);
+Atom make_array(Interp *ctx, long length);
+Atom make_table(Interp *ctx, int equal);
+Atom make_string(Interp *ctx, const char *data, long length);
+Atom make_port(Interp *ctx, FILE *file, Atom source, int input);
+Atom make_task(Interp *ctx, Atom expr, Atom env);
+Atom make_channel(Interp *ctx);
+Atom make_compiled(Interp *ctx, Native fn, long count);
+Atom make_promise(Interp *ctx, Atom value, int done);
+Atom make_record(Interp *ctx, Atom type, long count);
 Atom make_int(long x);
-Atom make_sym(const char *s);
+Atom make_sym(Interp *ctx, const char *s);
 Atom make_builtin(Builtin fn);
+Atom constant_cons(Interp *ctx, Atom car_val, Atom cdr_val);
+Atom constant_string(Interp *ctx, const char *data, long length);
+Atom constant_vector(Interp *ctx, Atom v);
+int atom_constant(Atom a);
+Atom make_list(Interp *ctx, long n, Atom tail);
+int atom_eq(Atom a, Atom b);
+int atom_equal(Atom a, Atom b);
 int listp(Atom expr);
-Atom copy_list(Atom list);
-Atom list_create(int n, ...);
+Atom copy_list(Interp *ctx, Atom list);
+Atom list_create(Interp *ctx, int n, ...);
 Atom list_get(Atom list, int k);
-void list_set(Atom list, int k, Atom value);
-void list_reverse(Atom *list);
-void gc_mark(Atom root);
-void gc();
+void list_set(Interp *ctx, Atom list, int k, Atom value);
+void list_reverse(Interp *ctx, Atom *list);
+Atom list_to_vector(Interp *ctx, Atom list);
+void gc_protect(Interp *ctx, struct Root *root, Atom *atoms, int count);
+void gc_merge(Interp *ctx, Interp *from);
+void gc_mark(Interp *ctx, Atom root);
+int gc_marked(Atom a);
+void gc_step(Interp *ctx, long budget);
+void gc_safepoint(Interp *ctx);
+void gc(Interp *ctx);
+
+/* Write barrier: keep the old value alive while marking */
+#define gc_barrier(ctx, old) \
+	((ctx)->gc_phase == GCPhase_Mark ? gc_mark((ctx), (old)) : (void) 0)
+#define set_car(ctx, p, v) (gc_barrier((ctx), car(p)), car(p) = (v))
+#define set_cdr(ctx, p, v) (gc_barrier((ctx), cdr(p)), cdr(p) = (v))
 
 /* BUILTINS */
 
-int builtin_car(Atom args, Atom *result);
-int builtin_cdr(Atom args, Atom *result);
-int builtin_cons(Atom args, Atom *result);
-int builtin_eq(Atom args, Atom *result);
-int builtin_pairp(Atom args, Atom *result);
-int builtin_procp(Atom args, Atom *result);
-int builtin_add(Atom args, Atom *result);
-int builtin_subtract(Atom args, Atom *result);
-int builtin_multiply(Atom args, Atom *result);
-int builtin_divide(Atom args, Atom *result);
-int builtin_numeq(Atom args, Atom *result);
-int builtin_less(Atom args, Atom *result);
+int builtin_car(Interp *ctx, Atom args, Atom *result);
+int builtin_cdr(Interp *ctx, Atom args, Atom *result);
+int builtin_cons(Interp *ctx, Atom args, Atom *result);
+int builtin_list(Interp *ctx, Atom args, Atom *result);
+int builtin_append(Interp *ctx, Atom args, Atom *result);
+int builtin_reverse(Interp *ctx, Atom args, Atom *result);
+int builtin_eq(Interp *ctx, Atom args, Atom *result);
+int builtin_equal(Interp *ctx, Atom args, Atom *result);
+int builtin_pairp(Interp *ctx, Atom args, Atom *result);
+int builtin_procp(Interp *ctx, Atom args, Atom *result);
+int builtin_add(Interp *ctx, Atom args, Atom *result);
+int builtin_subtract(Interp *ctx, Atom args, Atom *result);
+int builtin_multiply(Interp *ctx, Atom args, Atom *result);
+int builtin_divide(Interp *ctx, Atom args, Atom *result);
+int builtin_numeq(Interp *ctx, Atom args, Atom *result);
+int builtin_less(Interp *ctx, Atom args, Atom *result);
+int builtin_vectorp(Interp *ctx, Atom args, Atom *result);
+int builtin_make_vector(Interp *ctx, Atom args, Atom *result);
+int builtin_vector_length(Interp *ctx, Atom args, Atom *result);
+int builtin_vector_ref(Interp *ctx, Atom args, Atom *result);
+int builtin_vector_set(Interp *ctx, Atom args, Atom *result);
+int builtin_vector_to_list(Interp *ctx, Atom args, Atom *result);
+int builtin_list_to_vector(Interp *ctx, Atom args, Atom *result);
+int builtin_arrayp(Interp *ctx, Atom args, Atom *result);
+int builtin_make_array(Interp *ctx, Atom args, Atom *result);
+int builtin_array_length(Interp *ctx, Atom args, Atom *result);
+int builtin_array_ref(Interp *ctx, Atom args, Atom *result);
+int builtin_array_set(Interp *ctx, Atom args, Atom *result);
+int builtin_list_to_array(Interp *ctx, Atom args, Atom *result);
+int builtin_array_to_list(Interp *ctx, Atom args, Atom *result);
+int builtin_array_sum(Interp *ctx, Atom args, Atom *result);
+int builtin_array_dot(Interp *ctx, Atom args, Atom *result);
+int builtin_array_min(Interp *ctx, Atom args, Atom *result);
+int builtin_array_max(Interp *ctx, Atom args, Atom *result);
+int builtin_array_add(Interp *ctx, Atom args, Atom *result);
+int builtin_array_subtract(Interp *ctx, Atom args, Atom *result);
+int builtin_array_multiply(Interp *ctx, Atom args, Atom *result);
+int builtin_array_scale(Interp *ctx, Atom args, Atom *result);
+int builtin_array_prefix_sum(Interp *ctx, Atom args, Atom *result);
+int builtin_array_filter(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_tablep(Interp *ctx, Atom args, Atom *result);
+int builtin_make_hash_table(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_ref(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_set(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_delete(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_count(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_keys(Interp *ctx, Atom args, Atom *result);
+int builtin_hash_table_fold(Interp *ctx, Atom args, Atom *result);
+int builtin_stringp(Interp *ctx, Atom args, Atom *result);
+int builtin_string_length(Interp *ctx, Atom args, Atom *result);
+int builtin_string_ref(Interp *ctx, Atom args, Atom *result);
+int builtin_substring(Interp *ctx, Atom args, Atom *result);
+int builtin_string_append(Interp *ctx, Atom args, Atom *result);
+int builtin_string_eq(Interp *ctx, Atom args, Atom *result);
+int builtin_string_less(Interp *ctx, Atom args, Atom *result);
+int builtin_string_to_symbol(Interp *ctx, Atom args, Atom *result);
+int builtin_symbol_to_string(Interp *ctx, Atom args, Atom *result);
+int builtin_number_to_string(Interp *ctx, Atom args, Atom *result);
+int builtin_string_to_number(Interp *ctx, Atom args, Atom *result);
+int builtin_open_input_string(Interp *ctx, Atom args, Atom *result);
+int builtin_open_output_string(Interp *ctx, Atom args, Atom *result);
+int builtin_get_output_string(Interp *ctx, Atom args, Atom *result);
+int builtin_open_input_file(Interp *ctx, Atom args, Atom *result);
+int builtin_open_output_file(Interp *ctx, Atom args, Atom *result);
+int builtin_close_port(Interp *ctx, Atom args, Atom *result);
+int builtin_read_line(Interp *ctx, Atom args, Atom *result);
+int builtin_read(Interp *ctx, Atom args, Atom *result);
+int builtin_write_string(Interp *ctx, Atom args, Atom *result);
+int builtin_spawn(Interp *ctx, Atom args, Atom *result);
+int builtin_yield(Interp *ctx, Atom args, Atom *result);
+int builtin_join(Interp *ctx, Atom args, Atom *result);
+int builtin_make_channel(Interp *ctx, Atom args, Atom *result);
+int builtin_channel_send(Interp *ctx, Atom args, Atom *result);
+int builtin_channel_receive(Interp *ctx, Atom args, Atom *result);
+int builtin_parallel_map(Interp *ctx, Atom args, Atom *result);
+int builtin_parallel_for_each(Interp *ctx, Atom args, Atom *result);
+int builtin_promisep(Interp *ctx, Atom args, Atom *result);
+int builtin_make_promise(Interp *ctx, Atom args, Atom *result);
+int builtin_make_lazy_promise(Interp *ctx, Atom args, Atom *result);
+int builtin_force(Interp *ctx, Atom args, Atom *result);
+int builtin_recordp(Interp *ctx, Atom args, Atom *result);
+int builtin_make_record_type(Interp *ctx, Atom args, Atom *result);
+int builtin_record_constructor(Interp *ctx, Atom args, Atom *result);
+int builtin_record_predicate(Interp *ctx, Atom args, Atom *result);
+int builtin_record_accessor(Interp *ctx, Atom args, Atom *result);
+int builtin_record_modifier(Interp *ctx, Atom args, Atom *result);
+int builtin_define_record_procedures(Interp *ctx, Atom args, Atom *result);
 
@@ -1,33 +1,11 @@
 #include "lisp.h"
+#include "probe.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <readline/readline.h>
 
-char *slurp(const char *path)
-{
-	FILE *file;
-	char *buf;
-	long len;
-
-	file = fopen(path, "r");
-	if (!file)
-		return NULL;
-	fseek(file, 0, SEEK_END);
-	len = ftell(file);
-	fseek(file, 0, SEEK_SET);
-
-	buf = malloc(len + 1);
-	if (!buf)
-		return NULL;
-
-	fread(buf, 1, len, file);
-	buf[len] = 0;
-	fclose(file);
-
-	return buf;
-}
-
-void load_file(Atom env, const char *path)
+void load_file(Interp *ctx, const char *path)
 {
 	char *text;
 
@@ -35,10 +13,23 @@ void load_file(Atom env, const char *path)
 	text = slurp(path);
 	if (text) {
 		const char *p = text;
-		Atom expr;
-		while (read_expr(p, &p, &expr) == Error_OK) {
+		Atom expr = nil;
+		struct Root root;
+
+		/* Still printed after evaluation has moved on from it */
+		gc_protect(ctx, &root, &expr, 1);
+		for (;;) {
 			Atom result;
-			Error err = eval_expr(expr, env, &result);
+			Error err;
+
+			/* Offsets into the file, for timing the reader */
+			PROBE2(read_start, path, p - text);
+			err = read_expr(ctx, p, &p, &expr);
+			PROBE3(read_done, path, p - text, err);
+			if (err)
+				break;
+
+			err = eval_expr(ctx, expr, ctx->env, &result);
 			if (err) {
 				printf("Error in expression:\n\t");
 				print_expr(expr);
@@ -48,33 +39,84 @@ void load_file(Atom env, const char *path)
 				putchar('\n');
 			}
 		}
+		ctx->roots = root.next;
 		free(text);
 	}
 }
 
 int main(int argc, char **argv)
 {
-	Atom env;
+	Interp *ctx;
+	const char *socket_path = NULL, *compile_path = NULL;
+	int workers = 4;
 	char *input;
+	int opt;
+
+	ctx = interp_create();
+	if (!ctx)
+		return 1;
+
+	while ((opt = getopt(argc, argv, "C:g:Hi:j:O:p:s:S:w:")) != -1) {
+		switch (opt) {
+		case 'C':
+			/* Translate the files to C instead of running them */
+			compile_path = optarg;
+			break;
+		case 'g':
+			/* Threads used to mark during a full collection */
+			ctx->gc_threads = atoi(optarg);
+			break;
+		case 'H':
+			/* Share equal quoted data and literals, read-only */
+			ctx->share_constants = 1;
+			break;
+		case 'i':
+			/* Incremental GC with this much work per step */
+			ctx->gc_budget = atol(optarg);
+			break;
+		case 'j':
+			/* Calls before a closure is compiled; 0 disables the JIT */
+			ctx->jit_threshold = atol(optarg);
+			break;
+		case 'O':
+			/* Rewrite top-level procedures; 0 disables the optimizer */
+			ctx->optimize = atoi(optarg);
+			break;
+		case 'p':
+			/* Threads for PARALLEL-MAP; the online CPUs by default */
+			ctx->threads = atoi(optarg);
+			break;
+		case 's':
+			/* Evaluation steps per task before switching */
+			ctx->task_slice = atol(optarg);
+			break;
+		case 'S':
+			/* Serve requests on this Unix socket */
+			socket_path = optarg;
+			break;
+		case 'w':
+			/* Worker processes in server mode */
+			workers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-g gc-threads] [-H] [-i gc-step-budget] [-j jit-threshold]\n"
+				"\t[-O level] [-p threads] [-s task-slice] [-S socket [-w workers]] [preload-file...]\n"
+				"       %s -C output.c file...\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+
+	load_file(ctx, "library.lisp");
+	if (compile_path) {
+		int status = compile_program(ctx, compile_path, argv + optind, argc - optind);
+		interp_destroy(ctx);
+		return status;
+	}
+	for (; optind < argc; ++optind)
+		load_file(ctx, argv[optind]);
 
-	env = env_create(nil);
-
-	/* Set up the initial environment */
-	env_define(env, make_sym("CAR"), make_builtin(builtin_car));
-	env_define(env, make_sym("CDR"), make_builtin(builtin_cdr));
-	env_define(env, make_sym("CONS"), make_builtin(builtin_cons));
-	env_define(env, make_sym("+"), make_builtin(builtin_add));
-	env_define(env, make_sym("-"), make_builtin(builtin_subtract));
-	env_define(env, make_sym("*"), make_builtin(builtin_multiply));
-	env_define(env, make_sym("/"), make_builtin(builtin_divide));
-	env_define(env, make_sym("T"), make_sym("T"));
-	env_define(env, make_sym("="), make_builtin(builtin_numeq));
-	env_define(env, make_sym("<"), make_builtin(builtin_less));
-	env_define(env, make_sym("EQ?"), make_builtin(builtin_eq));
-	env_define(env, make_sym("PAIR?"), make_builtin(builtin_pairp));
-	env_define(env, make_sym("PROCEDURE?"), make_builtin(builtin_procp));
-
-	load_file(env, "library.lisp");
+	if (socket_path)
+		return serve(ctx, socket_path, workers);
 
 	/* Main loop */
 	while ((input = readline("> ")) != NULL) {
@@ -82,33 +124,23 @@ int main(int argc, char **argv)
 		Error err;
 		Atom expr, result;
 
-		err = read_expr(p, &p, &expr);		
+		err = read_expr(ctx, p, &p, &expr);		
 
 		if (!err)
-			err = eval_expr(expr, env, &result);
+			err = eval_expr(ctx, expr, ctx->env, &result);
 
-		switch (err) {
-		case Error_OK:
+		if (err) {
+			print_error(err);
+		} else {
 			print_expr(result);
 			putchar('\n');
-			break;
-		case Error_Syntax:
-			puts("Syntax error");
-			break;
-		case Error_Unbound:
-			puts("Symbol not bound");
-			break;
-		case Error_Args:
-			puts("Wrong number of arguments");
-			break;
-		case Error_Type:
-			puts("Wrong type");
-			break;
 		}
 
 		free(input);
 	}
 
+	interp_destroy(ctx);
+
 	return 0;
 }
 
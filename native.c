@@ -0,0 +1,204 @@
+#include "lisp.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Runtime support for programs compiled by lisp -C (see compile.c). A
+ * compiled procedure is a C function plus the values it captured. A
+ * call in tail position leaves the procedure and its arguments in
+ * ctx->tail_args and returns Error_Tail; native_call keeps calling
+ * until something returns a value, so tail calls use no C stack.
+ */
+
+/* Other calls do, so programs run on a thread with a large stack */
+#define NATIVE_STACK (1L << 30)
+#define NATIVE_MAX_DEPTH 1000000
+
+int native_call(Interp *ctx, Atom fn, Atom *args, int argc, Atom *result)
+{
+	Atom list = nil;
+	struct Root root;
+	Error err;
+
+	if (ctx->eval_depth >= NATIVE_MAX_DEPTH)
+		return Error_Range;
+
+	/* A task cannot be suspended with C frames on the stack, so
+	 * builtins called from here wait as in a nested evaluation */
+	++ctx->eval_depth;
+
+	while (fn.type == AtomType_Compiled) {
+		/* The callee copies its arguments before anything else */
+		err = (*fn.value.compiled->fn)(ctx, fn, args, argc, result);
+		if (err != Error_Tail)
+			goto done;
+
+		fn = ctx->tail_args[0];
+		args = ctx->tail_args + 1;
+		argc = ctx->tail_count - 1;
+	}
+
+	gc_protect(ctx, &root, &list, 1);
+	list = native_list(ctx, args, argc);
+	err = apply(ctx, fn, list, result);
+	ctx->roots = root.next;
+
+done:
+	--ctx->eval_depth;
+	return err;
+}
+
+static void tail_reserve(Interp *ctx, int count)
+{
+	if (count > ctx->tail_size) {
+		ctx->tail_size = count > 2 * ctx->tail_size ? count : 2 * ctx->tail_size;
+		ctx->tail_args = realloc(ctx->tail_args, ctx->tail_size * sizeof(Atom));
+	}
+}
+
+/* args[0] is the procedure */
+int native_tail(Interp *ctx, Atom *args, int count)
+{
+	tail_reserve(ctx, count);
+	memcpy(ctx->tail_args, args, count * sizeof(Atom));
+	ctx->tail_count = count;
+
+	return Error_Tail;
+}
+
+int native_apply(Interp *ctx, Atom fn, Atom list, Atom *result)
+{
+	Atom buf[8], *args = buf, p;
+	struct Root root;
+	int argc = 0, i;
+	Error err;
+
+	for (p = list; !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair)
+			return Error_Syntax;
+		++argc;
+	}
+
+	if (argc > 8)
+		args = malloc(argc * sizeof(Atom));
+	for (i = 0, p = list; i < argc; ++i, p = cdr(p))
+		args[i] = car(p);
+
+	gc_protect(ctx, &root, args, argc);
+	err = native_call(ctx, fn, args, argc, result);
+	ctx->roots = root.next;
+
+	if (args != buf)
+		free(args);
+
+	return err;
+}
+
+int native_tail_apply(Interp *ctx, Atom fn, Atom list)
+{
+	Atom p;
+	int count = 1;
+
+	for (p = list; !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair)
+			return Error_Syntax;
+		++count;
+	}
+
+	tail_reserve(ctx, count);
+	ctx->tail_args[0] = fn;
+	for (count = 1, p = list; !nilp(p); p = cdr(p))
+		ctx->tail_args[count++] = car(p);
+	ctx->tail_count = count;
+
+	return Error_Tail;
+}
+
+/* Continuations belong to the interpreter, so let it make them */
+int native_call_cc(Interp *ctx, Atom fn, int escape, Atom *result)
+{
+	Atom expr;
+
+	expr = cons(ctx, ctx->sym_quote, cons(ctx, fn, nil));
+	expr = cons(ctx, make_sym(ctx, escape ? "CALL/EC" : "CALL/CC"),
+		cons(ctx, expr, nil));
+
+	return eval_expr(ctx, expr, ctx->env, result);
+}
+
+/* Where a top-level variable's value lives; bindings never move */
+int native_global(Interp *ctx, Atom symbol, Atom **value)
+{
+	Atom bs;
+
+	for (bs = cdr(ctx->env); !nilp(bs); bs = cdr(bs)) {
+		if (car(car(bs)).value.symbol == symbol.value.symbol) {
+			*value = &cdr(car(bs));
+			return Error_OK;
+		}
+	}
+
+	return Error_Unbound;
+}
+
+Atom native_list(Interp *ctx, Atom *items, int count)
+{
+	Atom list = nil;
+
+	while (count > 0)
+		list = cons(ctx, items[--count], list);
+
+	return list;
+}
+
+struct Program {
+	Interp *ctx;
+	const struct NativeForm *forms;
+	int count;
+};
+
+static void *run_forms(void *arg)
+{
+	struct Program *prog = arg;
+	Interp *ctx = prog->ctx;
+	const struct NativeForm *forms = prog->forms;
+	int i;
+
+	for (i = 0; i < prog->count; ++i) {
+		Atom result;
+		Error err;
+
+		err = native_call(ctx, make_compiled(ctx, forms[i].fn, 0), NULL, 0, &result);
+		if (!forms[i].source)
+			continue;
+
+		if (err) {
+			printf("Error in expression:\n\t");
+			print_expr(*forms[i].source);
+			putchar('\n');
+		} else {
+			print_expr(result);
+			putchar('\n');
+		}
+	}
+
+	return NULL;
+}
+
+/* Run a program's top-level forms in order, as load_file does */
+void native_run(Interp *ctx, const struct NativeForm *forms, int count)
+{
+	struct Program prog = { ctx, forms, count };
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, NATIVE_STACK);
+	if (pthread_create(&thread, &attr, run_forms, &prog) == 0)
+		pthread_join(thread, NULL);
+	else
+		run_forms(&prog);
+	pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,940 @@
+#include "lisp.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Source optimizer. When a top-level DEFINE binds a closure, its body
+ * is rewritten once: macro uses are expanded, arithmetic builtins
+ * applied to constants are folded, calls of small non-recursive
+ * top-level procedures are inlined and IF forms with a constant test
+ * lose their dead branch. The closure keeps its own body and
+ * eval_do_bind finds the rewritten one in a table keyed on it. Each
+ * global the rewrite relied on is recorded with its value; after any
+ * global DEFINE or SET! they are checked again before the rewritten
+ * body is next used, and if one has changed the original runs instead.
+ * Lambdas inside a rewritten body have entries of their own, falling
+ * back to their body as the interpreter would have seen it.
+ *
+ * A call of a global that is still unbound is left exactly as written,
+ * since a later DEFMACRO would see its arguments unexpanded; for every
+ * other global called, the rewrite is dropped should it become a macro.
+ * Entries are weak on their key, and go once the closure body does.
+ */
+
+#define OPT_MAX_DEPTH 4
+#define OPT_MAX_PARAMS 8
+#define OPT_MAX_INLINE 24
+
+struct OptEntry {
+	struct Pair *key;
+	Atom body, fallback, guards;
+	Atom heads;	/* bindings of the procedures called */
+	Atom params, form;	/* form is nil unless calls can be inlined */
+	long version;
+	int valid;
+};
+
+struct Optimizer {
+	struct OptEntry **entries;
+	long count, size;
+};
+
+struct Names {
+	const char **names;
+	int count, size;
+};
+
+/* One closure being rewritten */
+struct Opt {
+	Interp *ctx;
+	Atom lambdas, guards, heads;
+	struct Names locals;
+	struct OptEntry **inner;
+	int ninner, inner_size;
+	Atom body;
+	int depth;
+	int unbound;	/* called a global with no binding */
+};
+
+static void names_push(struct Names *n, const char *name)
+{
+	if (n->count == n->size) {
+		n->size = n->size ? 2 * n->size : 16;
+		n->names = realloc(n->names, n->size * sizeof(char *));
+	}
+	n->names[n->count++] = name;
+}
+
+static int names_find(struct Names *n, const char *name)
+{
+	int i;
+
+	for (i = n->count - 1; i >= 0; --i)
+		if (n->names[i] == name)
+			return i;
+	return -1;
+}
+
+static int is(Atom a, const char *name)
+{
+	return a.type == AtomType_Symbol && strcmp(a.value.symbol, name) == 0;
+}
+
+static int list_length(Atom list)
+{
+	int n = 0;
+
+	for (; list.type == AtomType_Pair; list = cdr(list))
+		++n;
+	return n;
+}
+
+/* Entry table, keyed on a closure body as make_closure shares it */
+
+static long opt_hash(struct Pair *key, long size)
+{
+	return ((uintptr_t) key >> 4) & (size - 1);
+}
+
+static struct OptEntry *opt_find(Interp *ctx, struct Pair *key)
+{
+	struct Optimizer *opt = ctx->opt;
+	long i;
+
+	if (!opt || opt->size == 0)
+		return NULL;
+
+	i = opt_hash(key, opt->size);
+	for (; opt->entries[i]; i = (i + 1) & (opt->size - 1)) {
+		if (opt->entries[i]->key == key)
+			return opt->entries[i];
+	}
+
+	return NULL;
+}
+
+static void opt_place(struct Optimizer *opt, struct OptEntry *e)
+{
+	long i = opt_hash(e->key, opt->size);
+
+	while (opt->entries[i])
+		i = (i + 1) & (opt->size - 1);
+	opt->entries[i] = e;
+	++opt->count;
+}
+
+static struct OptEntry *opt_insert(Interp *ctx, struct Pair *key, Atom body,
+	Atom fallback, Atom guards)
+{
+	struct Optimizer *opt = ctx->opt;
+	struct OptEntry *e;
+
+	if (!opt) {
+		opt = ctx->opt = calloc(1, sizeof(struct Optimizer));
+		if (!opt)
+			return NULL;
+	}
+
+	if (2 * (opt->count + 1) > opt->size) {
+		struct OptEntry **old = opt->entries;
+		long n = opt->size, j;
+
+		opt->size = n ? 2 * n : 64;
+		opt->entries = calloc(opt->size, sizeof(struct OptEntry *));
+		opt->count = 0;
+		for (j = 0; j < n; ++j)
+			if (old[j])
+				opt_place(opt, old[j]);
+		free(old);
+	}
+
+	e = calloc(1, sizeof(struct OptEntry));
+	e->key = key;
+	e->body = body;
+	e->fallback = fallback;
+	e->guards = guards;
+	e->heads = e->params = e->form = nil;
+	e->version = ctx->env_version;
+	e->valid = 1;
+	opt_place(opt, e);
+
+	return e;
+}
+
+/* For good: let go of the rewrite and everything it relied on */
+static void opt_invalidate(struct OptEntry *e)
+{
+	e->valid = 0;
+	e->body = e->guards = e->heads = nil;
+	e->params = e->form = nil;
+}
+
+/* Whether the globals the rewrite relied on are unchanged */
+static int opt_valid(Interp *ctx, struct OptEntry *e)
+{
+	Atom g;
+
+	if (!e->valid || e->version == ctx->env_version)
+		return e->valid;
+
+	for (g = e->guards; !nilp(g); g = cdr(g))
+		if (!atom_eq(cdr(car(car(g))), cdr(car(g))))
+			break;
+	if (nilp(g)) {
+		for (g = e->heads; !nilp(g); g = cdr(g))
+			if (cdr(car(g)).type == AtomType_Macro)
+				break;
+	}
+
+	if (!nilp(g)) {
+		/* Workers share the table and leave it alone */
+		if (!ctx->parent)
+			opt_invalidate(e);
+		return 0;
+	}
+
+	if (!ctx->parent)
+		e->version = ctx->env_version;
+	return 1;
+}
+
+static Atom global_binding(Interp *ctx, Atom symbol)
+{
+	Atom bs;
+
+	for (bs = cdr(ctx->env); !nilp(bs); bs = cdr(bs))
+		if (car(car(bs)).value.symbol == symbol.value.symbol)
+			return car(bs);
+
+	return nil;
+}
+
+static void add_guard(struct Opt *o, Atom binding)
+{
+	Atom g;
+
+	for (g = o->guards; !nilp(g); g = cdr(g))
+		if (car(car(g)).value.pair == binding.value.pair)
+			return;
+
+	o->guards = cons(o->ctx, cons(o->ctx, binding, cdr(binding)), o->guards);
+}
+
+static void add_head(struct Opt *o, Atom binding)
+{
+	Atom h;
+
+	for (h = o->heads; !nilp(h); h = cdr(h))
+		if (car(h).value.pair == binding.value.pair)
+			return;
+
+	o->heads = cons(o->ctx, binding, o->heads);
+}
+
+static void bind_params(struct Names *names, Atom params)
+{
+	for (; params.type == AtomType_Pair; params = cdr(params))
+		if (car(params).type == AtomType_Symbol)
+			names_push(names, car(params).value.symbol);
+	if (params.type == AtomType_Symbol)
+		names_push(names, params.value.symbol);
+}
+
+/* Names a body defines directly, which are local to it */
+static void bind_defines(struct Names *names, Atom x)
+{
+	if (x.type != AtomType_Pair || !listp(x))
+		return;
+
+	if (is(car(x), "QUOTE") || is(car(x), "LAMBDA"))
+		return;
+
+	if (is(car(x), "DEFINE")) {
+		if (nilp(cdr(x)))
+			return;
+		if (car(cdr(x)).type == AtomType_Symbol)
+			names_push(names, car(cdr(x)).value.symbol);
+		else if (car(cdr(x)).type == AtomType_Pair
+				&& car(car(cdr(x))).type == AtomType_Symbol)
+			names_push(names, car(car(cdr(x))).value.symbol);
+	}
+
+	for (; !nilp(x); x = cdr(x))
+		bind_defines(names, car(x));
+}
+
+static void bind_body(struct Names *names, Atom params, Atom body)
+{
+	bind_params(names, params);
+	for (; body.type == AtomType_Pair; body = cdr(body))
+		bind_defines(names, car(body));
+}
+
+/* EXPANSION */
+
+static int expand(struct Opt *o, Atom x, Atom *result);
+
+static int expand_list(struct Opt *o, Atom list, Atom *result)
+{
+	Atom first = nil;
+	struct Root root;
+	Error err;
+
+	if (list.type != AtomType_Pair) {
+		*result = list;
+		return Error_OK;
+	}
+
+	gc_protect(o->ctx, &root, &first, 1);
+	err = expand(o, car(list), &first);
+	if (!err)
+		err = expand_list(o, cdr(list), result);
+	if (!err)
+		*result = cons(o->ctx, first, *result);
+	o->ctx->roots = root.next;
+
+	return err;
+}
+
+/* A lambda, remembering the body the interpreter would have used */
+static int expand_lambda(struct Opt *o, Atom params, Atom body, Atom *result)
+{
+	Interp *ctx = o->ctx;
+	int n = o->locals.count;
+	Error err;
+
+	bind_body(&o->locals, params, body);
+	err = expand_list(o, body, result);
+	o->locals.count = n;
+
+	if (!err) {
+		*result = cons(ctx, ctx->sym_lambda, cons(ctx, params, *result));
+		o->lambdas = cons(ctx, cons(ctx, *result, body), o->lambdas);
+	}
+
+	return err;
+}
+
+static int expand(struct Opt *o, Atom x, Atom *result)
+{
+	Interp *ctx = o->ctx;
+	Atom op, a[2] = { nil, nil };
+	struct Root root;
+	Error err = Error_OK;
+
+	if (x.type != AtomType_Pair || !listp(x)) {
+		*result = x;
+		return Error_OK;
+	}
+
+	op = car(x);
+	if (op.type != AtomType_Symbol)
+		return expand_list(o, x, result);
+
+	gc_protect(ctx, &root, a, 2);
+
+	if (is(op, "QUOTE") || ((is(op, "LAMBDA") || is(op, "DEFINE")
+			|| is(op, "SET!")) && nilp(cdr(x)))) {
+		*result = x;
+	} else if (is(op, "LAMBDA")) {
+		err = expand_lambda(o, car(cdr(x)), cdr(cdr(x)), result);
+	} else if (is(op, "DEFINE") && car(cdr(x)).type == AtomType_Pair) {
+		Atom target = car(cdr(x));
+
+		if (car(target).type != AtomType_Symbol) {
+			*result = x;
+		} else {
+			err = expand_lambda(o, cdr(target), cdr(cdr(x)), &a[0]);
+			if (!err)
+				*result = cons(ctx, op, cons(ctx, car(target),
+					cons(ctx, a[0], nil)));
+		}
+	} else if (is(op, "DEFINE") || is(op, "SET!")) {
+		err = expand_list(o, cdr(cdr(x)), &a[0]);
+		if (!err)
+			*result = cons(ctx, op, cons(ctx, car(cdr(x)), a[0]));
+	} else if (is(op, "DEFMACRO")) {
+		/* Defines at run time; leave the closure alone */
+		err = Error_Syntax;
+	} else if (is(op, "IF") || is(op, "APPLY")
+			|| is(op, "CALL/CC") || is(op, "CALL/EC")) {
+		err = expand_list(o, cdr(x), &a[0]);
+		if (!err)
+			*result = cons(ctx, op, a[0]);
+	} else if (names_find(&o->locals, op.value.symbol) >= 0) {
+		err = expand_list(o, x, result);
+	} else if (nilp(a[1] = global_binding(ctx, op))) {
+		/* It may yet be defined as a macro */
+		o->unbound = 1;
+		*result = x;
+	} else if (cdr(a[1]).type == AtomType_Macro) {
+		add_guard(o, a[1]);
+		a[0] = cdr(a[1]);
+		a[0].type = AtomType_Closure;
+		err = apply(ctx, a[0], cdr(x), &a[1]);
+		if (!err)
+			err = expand(o, a[1], result);
+	} else {
+		add_head(o, a[1]);
+		err = expand_list(o, x, result);
+	}
+
+	ctx->roots = root.next;
+
+	return err;
+}
+
+/* REWRITING; allocates but never collects */
+
+static int constantp(Atom x)
+{
+	if (x.type == AtomType_Pair)
+		return is(car(x), "QUOTE") && cdr(x).type == AtomType_Pair
+			&& nilp(cdr(cdr(x)));
+	return x.type != AtomType_Symbol;
+}
+
+static Atom constant_value(Atom x)
+{
+	return x.type == AtomType_Pair ? car(cdr(x)) : x;
+}
+
+static Atom make_constant(Interp *ctx, Atom value)
+{
+	if (value.type == AtomType_Symbol || value.type == AtomType_Pair)
+		return cons(ctx, ctx->sym_quote, cons(ctx, value, nil));
+	return value;
+}
+
+static int foldable(Builtin fn)
+{
+	return fn == builtin_add || fn == builtin_subtract
+		|| fn == builtin_multiply || fn == builtin_divide
+		|| fn == builtin_numeq || fn == builtin_less;
+}
+
+static int param_index(Atom params, Atom x)
+{
+	int i;
+
+	if (x.type != AtomType_Symbol)
+		return -1;
+	for (i = 0; params.type == AtomType_Pair; params = cdr(params), ++i)
+		if (car(params).value.symbol == x.value.symbol)
+			return i;
+	return -1;
+}
+
+static int assigned(Atom x, Atom symbol)
+{
+	if (x.type != AtomType_Pair || !listp(x) || is(car(x), "QUOTE"))
+		return 0;
+
+	if (is(car(x), "SET!") && !nilp(cdr(x))
+			&& car(cdr(x)).type == AtomType_Symbol
+			&& car(cdr(x)).value.symbol == symbol.value.symbol)
+		return 1;
+
+	for (; !nilp(x); x = cdr(x))
+		if (assigned(car(x), symbol))
+			return 1;
+	return 0;
+}
+
+/* Where each parameter is used, in evaluation order */
+struct Uses {
+	Atom params;
+	int count[OPT_MAX_PARAMS];
+	int late[OPT_MAX_PARAMS];	/* after a call, or maybe not at all */
+	int order[OPT_MAX_PARAMS];
+	int norder, applied;
+};
+
+static void find_uses(struct Uses *u, Atom x, int conditional)
+{
+	int i;
+
+	if (x.type == AtomType_Symbol) {
+		i = param_index(u->params, x);
+		if (i >= 0) {
+			++u->count[i];
+			if (conditional || u->applied)
+				u->late[i] = 1;
+			if (u->norder < OPT_MAX_PARAMS)
+				u->order[u->norder++] = i;
+		}
+		return;
+	}
+
+	if (x.type != AtomType_Pair || is(car(x), "QUOTE"))
+		return;
+
+	if (is(car(x), "IF")) {
+		find_uses(u, car(cdr(x)), conditional);
+		u->applied = 1;
+		find_uses(u, car(cdr(cdr(x))), 1);
+		find_uses(u, car(cdr(cdr(cdr(x)))), 1);
+		return;
+	}
+
+	for (; !nilp(x); x = cdr(x))
+		find_uses(u, car(x), conditional);
+	u->applied = 1;
+}
+
+/* Whether evaluating the arguments inside the body is unobservable */
+static int substitutable(struct Opt *o, struct OptEntry *e, Atom args)
+{
+	struct Uses u;
+	int i, last = -1;
+	Atom a;
+
+	memset(&u, 0, sizeof(u));
+	u.params = e->params;
+	find_uses(&u, e->form, 0);
+
+	for (i = 0, a = args; !nilp(a); a = cdr(a), ++i) {
+		Atom arg = car(a);
+
+		if (constantp(arg))
+			continue;
+
+		if (arg.type == AtomType_Symbol) {
+			/* A local nothing assigns reads the same at any time */
+			if (u.late[i] && (names_find(&o->locals, arg.value.symbol) < 0
+					|| assigned(o->body, arg)))
+				return 0;
+			/* Dropping an unbound one would hide the error */
+			if (u.count[i] == 0 && names_find(&o->locals, arg.value.symbol) < 0
+					&& nilp(global_binding(o->ctx, arg)))
+				return 0;
+			continue;
+		}
+
+		if (u.count[i] != 1 || u.late[i])
+			return 0;
+	}
+
+	/* Other arguments are evaluated once, and in their own order */
+	for (i = 0; i < u.norder; ++i) {
+		int k;
+
+		for (k = 0, a = args; k < u.order[i]; ++k)
+			a = cdr(a);
+		if (constantp(car(a)) || car(a).type == AtomType_Symbol)
+			continue;
+		if (u.order[i] < last)
+			return 0;
+		last = u.order[i];
+	}
+
+	return 1;
+}
+
+/* Whether the caller binds a name the inlined body means globally */
+static int captures(struct Opt *o, Atom params, Atom x)
+{
+	if (x.type == AtomType_Symbol)
+		return param_index(params, x) < 0
+			&& names_find(&o->locals, x.value.symbol) >= 0;
+
+	if (x.type != AtomType_Pair || is(car(x), "QUOTE"))
+		return 0;
+
+	for (; !nilp(x); x = cdr(x))
+		if (captures(o, params, car(x)))
+			return 1;
+	return 0;
+}
+
+static int has_lambda(Atom x)
+{
+	if (x.type != AtomType_Pair || !listp(x) || is(car(x), "QUOTE"))
+		return 0;
+	if (is(car(x), "LAMBDA") || is(car(x), "DEFINE"))
+		return 1;
+	for (; !nilp(x); x = cdr(x))
+		if (has_lambda(car(x)))
+			return 1;
+	return 0;
+}
+
+static Atom substitute(Interp *ctx, Atom x, Atom params, Atom args)
+{
+	int i = param_index(params, x);
+
+	if (i >= 0) {
+		while (i-- > 0)
+			args = cdr(args);
+		return car(args);
+	}
+
+	if (x.type != AtomType_Pair || is(car(x), "QUOTE"))
+		return x;
+
+	return cons(ctx, substitute(ctx, car(x), params, args),
+		substitute(ctx, cdr(x), params, args));
+}
+
+static Atom optimize(struct Opt *o, Atom x);
+
+static Atom optimize_list(struct Opt *o, Atom list)
+{
+	Atom first;
+
+	if (list.type != AtomType_Pair)
+		return list;
+
+	first = optimize(o, car(list));
+	return cons(o->ctx, first, optimize_list(o, cdr(list)));
+}
+
+static Atom optimize_lambda(struct Opt *o, Atom x)
+{
+	Interp *ctx = o->ctx;
+	Atom p, params = car(cdr(x)), body;
+	struct OptEntry *e;
+	int n = o->locals.count;
+
+	bind_body(&o->locals, params, cdr(cdr(x)));
+	body = optimize_list(o, cdr(cdr(x)));
+	o->locals.count = n;
+
+	/* Closures made from it need the original body to fall back on */
+	for (p = o->lambdas; !nilp(p); p = cdr(p))
+		if (car(car(p)).value.pair == x.value.pair)
+			break;
+	if (nilp(p) || body.type != AtomType_Pair)
+		return x;
+
+	e = opt_insert(ctx, body.value.pair, body, cdr(car(p)), nil);
+	if (e) {
+		if (o->ninner == o->inner_size) {
+			o->inner_size = o->inner_size ? 2 * o->inner_size : 8;
+			o->inner = realloc(o->inner, o->inner_size * sizeof(struct OptEntry *));
+		}
+		o->inner[o->ninner++] = e;
+	}
+
+	return cons(ctx, car(x), cons(ctx, params, body));
+}
+
+static Atom optimize_call(struct Opt *o, Atom x)
+{
+	Interp *ctx = o->ctx;
+	Atom op = car(x), args = cdr(x), b, fn, p;
+	struct OptEntry *e;
+
+	if (op.type != AtomType_Symbol || names_find(&o->locals, op.value.symbol) >= 0)
+		return x;
+
+	b = global_binding(ctx, op);
+	if (nilp(b))
+		return x;
+	fn = cdr(b);
+
+	if (fn.type == AtomType_Builtin && foldable(fn.value.builtin)) {
+		Atom values = nil, result;
+
+		for (p = args; !nilp(p); p = cdr(p)) {
+			if (!constantp(car(p)))
+				return x;
+			/* Leave traps for run time */
+			if (fn.value.builtin == builtin_divide
+					&& car(p).type == AtomType_Integer
+					&& (car(p).value.integer == 0
+						|| car(p).value.integer == -1))
+				return x;
+		}
+		for (p = args; !nilp(p); p = cdr(p))
+			values = cons(ctx, constant_value(car(p)), values);
+		list_reverse(ctx, &values);
+
+		if ((*fn.value.builtin)(ctx, values, &result) != Error_OK)
+			return x;
+
+		add_guard(o, b);
+		return make_constant(ctx, result);
+	}
+
+	if (fn.type != AtomType_Closure || o->depth >= OPT_MAX_DEPTH
+			|| car(fn).value.pair != ctx->env.value.pair
+			|| nilp(cdr(cdr(fn))))
+		return x;
+
+	e = opt_find(ctx, cdr(cdr(fn)).value.pair);
+	if (!e || nilp(e->form) || !opt_valid(ctx, e)
+			|| list_length(args) != list_length(e->params)
+			|| has_lambda(args) || captures(o, e->params, e->form)
+			|| !substitutable(o, e, args))
+		return x;
+
+	add_guard(o, b);
+	for (p = e->guards; !nilp(p); p = cdr(p))
+		add_guard(o, car(car(p)));
+	for (p = e->heads; !nilp(p); p = cdr(p))
+		add_head(o, car(p));
+
+	++o->depth;
+	x = optimize(o, substitute(ctx, e->form, e->params, args));
+	--o->depth;
+
+	return x;
+}
+
+static Atom optimize(struct Opt *o, Atom x)
+{
+	Interp *ctx = o->ctx;
+	Atom op, args;
+
+	if (x.type != AtomType_Pair || !listp(x))
+		return x;
+
+	op = car(x);
+	args = cdr(x);
+
+	if (is(op, "QUOTE"))
+		return x;
+
+	if (is(op, "LAMBDA"))
+		return nilp(args) ? x : optimize_lambda(o, x);
+
+	if (is(op, "IF")) {
+		Atom test;
+
+		if (list_length(args) != 3)
+			return x;
+
+		test = optimize(o, car(args));
+		if (constantp(test))
+			return optimize(o, nilp(constant_value(test))
+				? car(cdr(cdr(args))) : car(cdr(args)));
+
+		return cons(ctx, op, cons(ctx, test, optimize_list(o, cdr(args))));
+	}
+
+	if (is(op, "DEFINE") || is(op, "SET!")) {
+		if (nilp(args))
+			return x;
+		return cons(ctx, op, cons(ctx, car(args), optimize_list(o, cdr(args))));
+	}
+
+	if (is(op, "APPLY") || is(op, "CALL/CC") || is(op, "CALL/EC"))
+		return cons(ctx, op, optimize_list(o, args));
+
+	/* (begin form) is ((lambda () form)) */
+	if (op.type == AtomType_Pair && is(car(op), "LAMBDA") && nilp(args)
+			&& cdr(op).type == AtomType_Pair && nilp(car(cdr(op)))
+			&& list_length(cdr(cdr(op))) == 1) {
+		struct Names defines = { NULL, 0, 0 };
+
+		bind_defines(&defines, car(cdr(cdr(op))));
+		free(defines.names);
+		if (defines.count == 0)
+			return optimize(o, car(cdr(cdr(op))));
+	}
+
+	/* As expand left it */
+	if (op.type == AtomType_Symbol && names_find(&o->locals, op.value.symbol) < 0
+			&& nilp(global_binding(ctx, op)))
+		return x;
+
+	return optimize_call(o, optimize_list(o, x));
+}
+
+/* Small enough, and made only of calls, IF and constants */
+static int inlinable(Atom x, Atom self, int *size)
+{
+	if (++*size > OPT_MAX_INLINE)
+		return 0;
+
+	if (x.type == AtomType_Symbol)
+		return x.value.symbol != self.value.symbol;
+
+	if (x.type != AtomType_Pair)
+		return 1;
+
+	if (!listp(x))
+		return 0;
+
+	if (is(car(x), "QUOTE"))
+		return 1;
+
+	if (is(car(x), "IF")) {
+		if (list_length(x) != 4)
+			return 0;
+		x = cdr(x);
+	} else if (car(x).type != AtomType_Symbol || is(car(x), "LAMBDA")
+			|| is(car(x), "DEFINE") || is(car(x), "SET!")
+			|| is(car(x), "DEFMACRO") || is(car(x), "APPLY")
+			|| is(car(x), "CALL/CC") || is(car(x), "CALL/EC")) {
+		return 0;
+	}
+
+	for (; !nilp(x); x = cdr(x))
+		if (!inlinable(car(x), self, size))
+			return 0;
+	return 1;
+}
+
+static void set_inline(struct OptEntry *e, Atom self, Atom params)
+{
+	Atom p;
+	int n = 0, size = 0;
+
+	for (p = params; p.type == AtomType_Pair; p = cdr(p)) {
+		if (car(p).type != AtomType_Symbol || ++n > OPT_MAX_PARAMS
+				|| param_index(cdr(p), car(p)) >= 0)
+			return;
+	}
+
+	if (!nilp(p) || list_length(e->body) != 1
+			|| !inlinable(car(e->body), self, &size))
+		return;
+
+	e->params = params;
+	e->form = car(e->body);
+}
+
+void opt_define(Interp *ctx, Atom symbol, Atom fn)
+{
+	struct Opt o;
+	struct Root roots[3];
+	struct OptEntry *e;
+	Atom body, expanded = nil;
+	Error err;
+	int i;
+
+	if (!ctx->optimize || ctx->parent || fn.type != AtomType_Closure
+			|| car(fn).value.pair != ctx->env.value.pair)
+		return;
+
+	body = cdr(cdr(fn));
+	if (body.type != AtomType_Pair || opt_find(ctx, body.value.pair))
+		return;
+
+	memset(&o, 0, sizeof(o));
+	o.ctx = ctx;
+	o.lambdas = o.guards = o.heads = o.body = nil;
+	gc_protect(ctx, &roots[0], &o.lambdas, 1);
+	gc_protect(ctx, &roots[1], &o.guards, 1);
+	gc_protect(ctx, &roots[2], &o.heads, 1);
+
+	/* The closure is reachable through its binding throughout */
+	bind_body(&o.locals, closure_params(fn), body);
+	err = expand_list(&o, body, &expanded);
+	o.locals.count = 0;
+
+	if (!err) {
+		o.body = expanded;
+		bind_body(&o.locals, closure_params(fn), body);
+		e = opt_insert(ctx, body.value.pair, optimize_list(&o, expanded),
+			body, o.guards);
+		if (e) {
+			e->heads = o.heads;
+			/* Callers would not see this one's unbound names */
+			if (!o.unbound)
+				set_inline(e, symbol, closure_params(fn));
+		}
+		for (i = 0; i < o.ninner; ++i) {
+			o.inner[i]->guards = o.guards;
+			o.inner[i]->heads = o.heads;
+		}
+	}
+
+	ctx->roots = roots[0].next;
+	free(o.locals.names);
+	free(o.inner);
+}
+
+/* The body to run for a closure */
+Atom opt_body(Interp *ctx, Atom fn)
+{
+	Atom body = cdr(cdr(fn));
+	struct OptEntry *e;
+
+	if (body.type != AtomType_Pair)
+		return body;
+
+	e = opt_find(ctx, body.value.pair);
+	if (!e)
+		return body;
+
+	return opt_valid(ctx, e) ? e->body : e->fallback;
+}
+
+/* The keys are weak; see opt_purge */
+void opt_mark(Interp *ctx)
+{
+	struct Optimizer *opt = ctx->opt;
+	long i;
+
+	if (!opt)
+		return;
+
+	for (i = 0; i < opt->size; ++i) {
+		struct OptEntry *e = opt->entries[i];
+		if (!e)
+			continue;
+		if (e->body.value.pair != e->key)
+			gc_mark(ctx, e->body);
+		if (e->fallback.value.pair != e->key)
+			gc_mark(ctx, e->fallback);
+		gc_mark(ctx, e->guards);
+		gc_mark(ctx, e->heads);
+		gc_mark(ctx, e->params);
+	}
+}
+
+/*
+ * Drop the entries of closure bodies the mark phase left white, and
+ * top-level ones whose rewrite is gone, which are no different from
+ * having none. The rest are checked, so that a rewrite nothing runs
+ * any more does not hold on to what it replaced.
+ */
+void opt_purge(Interp *ctx)
+{
+	struct Optimizer *opt = ctx->opt;
+	struct OptEntry **old;
+	long n, i;
+
+	if (!opt || opt->count == 0)
+		return;
+
+	old = opt->entries;
+	n = opt->size;
+	opt->entries = calloc(n, sizeof(struct OptEntry *));
+	opt->count = 0;
+	for (i = 0; i < n; ++i) {
+		struct OptEntry *e = old[i];
+		Atom key;
+
+		if (!e)
+			continue;
+
+		key.type = AtomType_Pair;
+		key.value.pair = e->key;
+		opt_valid(ctx, e);
+		if (gc_marked(key) && (e->valid || e->fallback.value.pair != e->key))
+			opt_place(opt, e);
+		else
+			free(e);
+	}
+	free(old);
+}
+
+void opt_destroy(Interp *ctx)
+{
+	struct Optimizer *opt = ctx->opt;
+	long i;
+
+	if (!opt)
+		return;
+
+	for (i = 0; i < opt->size; ++i)
+		free(opt->entries[i]);
+	free(opt->entries);
+	free(opt);
+	ctx->opt = NULL;
+}
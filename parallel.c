@@ -0,0 +1,263 @@
+#include "lisp.h"
+#include <stdlib.h>
+
+/*
+ * Each worker owns a range [lo, hi) of item indices. It takes work from
+ * the bottom of its own range and, once that is empty, steals the top
+ * half of another worker's range.
+ */
+struct Worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	long lo, hi;
+	Interp ctx;
+	struct Job *job;
+	int id;
+};
+
+struct Job {
+	Atom fn;
+	Atom *items;
+	Atom *results;
+	int nworkers;
+	struct Worker *workers;
+	pthread_mutex_t lock;
+	Error err;
+	long err_index;
+	Interp *err_ctx;
+	int abort;
+};
+
+static int worker_take(struct Worker *w, long *index)
+{
+	int ok = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi) {
+		*index = w->lo++;
+		ok = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return ok;
+}
+
+static int worker_steal(struct Worker *w)
+{
+	struct Job *job = w->job;
+	int i;
+
+	for (i = 1; i < job->nworkers; ++i) {
+		struct Worker *victim = &job->workers[(w->id + i) % job->nworkers];
+		long lo = 0, hi = 0;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->lo < victim->hi) {
+			hi = victim->hi;
+			lo = hi - (hi - victim->lo + 1) / 2;
+			victim->hi = lo;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (lo < hi) {
+			pthread_mutex_lock(&w->lock);
+			w->lo = lo;
+			w->hi = hi;
+			pthread_mutex_unlock(&w->lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *worker_run(void *arg)
+{
+	struct Worker *w = arg;
+	struct Job *job = w->job;
+	long i;
+
+	while (!__atomic_load_n(&job->abort, __ATOMIC_RELAXED)) {
+		Error err;
+
+		if (!worker_take(w, &i)) {
+			if (worker_steal(w))
+				continue;
+			break;
+		}
+
+		err = apply(&w->ctx, job->fn, job->items[i], &job->results[i]);
+		if (err) {
+			pthread_mutex_lock(&job->lock);
+			if (!job->err || i < job->err_index) {
+				job->err = err;
+				job->err_index = i;
+				job->err_ctx = &w->ctx;
+			}
+			__atomic_store_n(&job->abort, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int parallel_apply(Interp *ctx, Atom fn, Atom *items, Atom *results,
+	long n)
+{
+	struct Job job;
+	struct Worker *workers;
+	int i, nworkers;
+
+	nworkers = ctx->threads;
+	if (nworkers > n)
+		nworkers = n;
+
+	if (nworkers <= 1 || ctx->parent) {
+		/* Not worth it, or already inside a parallel region */
+		long k;
+		for (k = 0; k < n; ++k) {
+			Error err = apply(ctx, fn, items[k], &results[k]);
+			if (err)
+				return err;
+		}
+		return Error_OK;
+	}
+
+	/* Workers must not see a collection in progress */
+	if (ctx->gc_phase != GCPhase_Idle)
+		gc_step(ctx, 0);
+
+	workers = malloc(nworkers * sizeof(struct Worker));
+
+	job.fn = fn;
+	job.items = items;
+	job.results = results;
+	job.nworkers = nworkers;
+	job.workers = workers;
+	pthread_mutex_init(&job.lock, NULL);
+	job.err = Error_OK;
+	job.err_index = 0;
+	job.err_ctx = NULL;
+	job.abort = 0;
+
+	for (i = 0; i < nworkers; ++i) {
+		struct Worker *w = &workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->lo = n * i / nworkers;
+		w->hi = n * (i + 1) / nworkers;
+		w->job = &job;
+		w->id = i;
+
+		/* Workers allocate privately and never collect */
+		w->ctx = *ctx;
+		w->ctx.allocations = NULL;
+		w->ctx.gc_count = 0;
+		w->ctx.parent = ctx;
+		w->ctx.tail_args = NULL;
+		w->ctx.tail_count = w->ctx.tail_size = 0;
+	}
+
+	/* The calling thread acts as worker 0 */
+	for (i = 1; i < nworkers; ++i)
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	worker_run(&workers[0]);
+	for (i = 1; i < nworkers; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	/* Hand the workers' allocations over to the parent heap */
+	for (i = 0; i < nworkers; ++i) {
+		gc_merge(ctx, &workers[i].ctx);
+		free(workers[i].ctx.tail_args);
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+
+	/* Pass on an escape to a continuation outside the region */
+	if (job.err == Error_Throw) {
+		ctx->throw_target = job.err_ctx->throw_target;
+		ctx->throw_value = job.err_ctx->throw_value;
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(workers);
+
+	return job.err;
+}
+
+static int parallel_map(Interp *ctx, Atom args, Atom *result, int collect)
+{
+	Atom fn, lists, p;
+	Atom *items, *results;
+	struct Root roots[2];
+	long i, n;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+
+	fn = car(args);
+	lists = copy_list(ctx, cdr(args));
+
+	p = lists;
+	while (!nilp(p)) {
+		if (!listp(car(p)))
+			return Error_Type;
+		p = cdr(p);
+	}
+
+	n = 0;
+	for (p = car(lists); !nilp(p); p = cdr(p))
+		++n;
+
+	items = malloc(n * sizeof(Atom));
+	results = malloc(n * sizeof(Atom));
+	for (i = 0; i < n; ++i)
+		items[i] = results[i] = nil;
+
+	/* Gather the argument list for each call, as MAP does */
+	for (i = 0; i < n; ++i) {
+		Atom q = nil;
+
+		p = lists;
+		while (!nilp(p)) {
+			if (nilp(car(p))) {
+				free(items);
+				free(results);
+				return Error_Args;
+			}
+			q = cons(ctx, car(car(p)), q);
+			set_car(ctx, p, cdr(car(p)));
+			p = cdr(p);
+		}
+		list_reverse(ctx, &q);
+		items[i] = q;
+	}
+
+	gc_protect(ctx, &roots[0], items, n);
+	gc_protect(ctx, &roots[1], results, n);
+	err = parallel_apply(ctx, fn, items, results, n);
+	ctx->roots = roots[0].next;
+
+	*result = nil;
+	if (!err && collect) {
+		for (i = n - 1; i >= 0; --i)
+			*result = cons(ctx, results[i], *result);
+	}
+
+	free(items);
+	free(results);
+
+	return err;
+}
+
+int builtin_parallel_map(Interp *ctx, Atom args, Atom *result)
+{
+	return parallel_map(ctx, args, result, 1);
+}
+
+int builtin_parallel_for_each(Interp *ctx, Atom args, Atom *result)
+{
+	return parallel_map(ctx, args, result, 0);
+}
@@ -1,8 +1,35 @@
 #include "lisp.h"
 #include <stdio.h>
 
+/* #<POINT X=1 Y=2>, or #<RECORD-TYPE:POINT> for the type itself */
+static void print_record(struct Record *r)
+{
+	Atom fields;
+	long i;
+
+	if (nilp(r->type)) {
+		printf("#<RECORD-TYPE:");
+		print_expr(r->slots[0]);
+		putchar('>');
+		return;
+	}
+
+	printf("#<");
+	print_expr(r->type.value.record->slots[0]);
+	fields = r->type.value.record->slots[1];
+	for (i = 0; i < r->count; ++i, fields = cdr(fields)) {
+		putchar(' ');
+		print_expr(car(fields));
+		putchar('=');
+		print_expr(r->slots[i]);
+	}
+	putchar('>');
+}
+
 void print_expr(Atom atom)
 {
+	long i;
+
 	switch (atom.type) {
 	case AtomType_Nil:
 		printf("NIL");
@@ -24,6 +51,44 @@ void print_expr(Atom atom)
 		}
 		putchar(')');
 		break;
+	case AtomType_Vector:
+		printf("#(");
+		for (i = 0; i < atom.value.vector->length; ++i) {
+			if (i > 0)
+				putchar(' ');
+			print_expr(atom.value.vector->items[i]);
+		}
+		putchar(')');
+		break;
+	case AtomType_Array:
+		printf("#<ARRAY:%ld>", atom.value.array->length);
+		break;
+	case AtomType_Table:
+		printf("#<HASH-TABLE:%p>", atom.value.table);
+		break;
+	case AtomType_String:
+		putchar('"');
+		for (i = 0; i < atom.value.string->length; ++i) {
+			char c = atom.value.string->data[i];
+			switch (c) {
+			case '\n': printf("\\n"); break;
+			case '\t': printf("\\t"); break;
+			case '"':  printf("\\\""); break;
+			case '\\': printf("\\\\"); break;
+			default:   putchar(c); break;
+			}
+		}
+		putchar('"');
+		break;
+	case AtomType_Port:
+		printf("#<PORT:%p>", atom.value.port);
+		break;
+	case AtomType_Task:
+		printf("#<TASK:%p>", atom.value.task);
+		break;
+	case AtomType_Channel:
+		printf("#<CHANNEL:%p>", atom.value.channel);
+		break;
 	case AtomType_Symbol:
 		printf("%s", atom.value.symbol);
 		break;
@@ -39,6 +104,56 @@ void print_expr(Atom atom)
 	case AtomType_Macro:
 		printf("#<MACRO:%p>", atom.value.pair);
 		break;
+	case AtomType_Continuation:
+		printf("#<CONTINUATION:%p>", atom.value.pair);
+		break;
+	case AtomType_Compiled:
+		printf("#<COMPILED:%p>", atom.value.compiled);
+		break;
+	case AtomType_Promise:
+		printf("#<PROMISE:%p>", atom.value.promise);
+		break;
+	case AtomType_Record:
+		print_record(atom.value.record);
+		break;
 	}
 }
 
+
+void print_error(Error err)
+{
+	switch (err) {
+	case Error_OK:
+		break;
+	case Error_Syntax:
+		puts("Syntax error");
+		break;
+	case Error_Unbound:
+		puts("Symbol not bound");
+		break;
+	case Error_Args:
+		puts("Wrong number of arguments");
+		break;
+	case Error_Type:
+		puts("Wrong type");
+		break;
+	case Error_Range:
+		puts("Index out of range");
+		break;
+	case Error_Throw:
+		puts("Continuation no longer active");
+		break;
+	case Error_Deadlock:
+		puts("Deadlock");
+		break;
+	case Error_Constant:
+		puts("Constant cannot be modified");
+		break;
+	case Error_Yield:
+		/* Only seen by the scheduler */
+		break;
+	case Error_Tail:
+		/* Only seen by native_call */
+		break;
+	}
+}
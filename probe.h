@@ -0,0 +1,80 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+ * Static tracepoints. Each is a single nop described by an ELF note in
+ * the format of SystemTap's <sys/sdt.h>, which perf, bpftrace and gdb
+ * read, so a running interpreter can be traced with no library and no
+ * rebuild:
+ *
+ *	PROBE0(name) ... PROBE3(name, a, b, c)
+ *		fire lisp:name with integer or pointer arguments
+ *	PROBE_ENABLED(name)
+ *		nonzero while a tracer is attached to lisp:name, for
+ *		arguments that cost something to work out
+ *
+ * Building with -DNO_PROBES, or for another target, leaves nothing.
+ */
+
+#if defined(__GNUC__) && defined(__ELF__) && !defined(NO_PROBES) \
+	&& (defined(__x86_64__) || defined(__aarch64__))
+
+/* The note, then the base and semaphore the first probe defines */
+#define PROBE_ASM(name, args) \
+	"990:	nop\n" \
+	"	.pushsection .note.stapsdt,\"\",\"note\"\n" \
+	"	.balign 4\n" \
+	"	.4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	.8byte 990b\n" \
+	"	.8byte _.stapsdt.base\n" \
+	"	.8byte lisp_" #name "_semaphore\n" \
+	"	.asciz \"lisp\"\n" \
+	"	.asciz \"" #name "\"\n" \
+	"	.asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	"	.popsection\n" \
+	"	.ifndef _.stapsdt.base\n" \
+	"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	"	.weak _.stapsdt.base\n" \
+	"	.hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	"	.popsection\n" \
+	"	.endif\n" \
+	"	.ifndef lisp_" #name "_semaphore\n" \
+	"	.pushsection .probes,\"aw\",\"progbits\"\n" \
+	"	.weak lisp_" #name "_semaphore\n" \
+	"	.hidden lisp_" #name "_semaphore\n" \
+	"	.balign 2\n" \
+	"lisp_" #name "_semaphore: .zero 2\n" \
+	"	.popsection\n" \
+	"	.endif\n"
+
+#define PROBE0(name) \
+	__asm__ __volatile__ (PROBE_ASM(name, ""))
+#define PROBE1(name, a) \
+	__asm__ __volatile__ (PROBE_ASM(name, "-8@%0") \
+		:: "nor" ((long) (a)))
+#define PROBE2(name, a, b) \
+	__asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1") \
+		:: "nor" ((long) (a)), "nor" ((long) (b)))
+#define PROBE3(name, a, b, c) \
+	__asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1 -8@%2") \
+		:: "nor" ((long) (a)), "nor" ((long) (b)), "nor" ((long) (c)))
+
+#define PROBE_ENABLED(name) __extension__ ({ \
+	extern volatile unsigned short lisp_##name##_semaphore; \
+	lisp_##name##_semaphore != 0; })
+
+#else
+
+#define PROBE0(name) ((void) 0)
+#define PROBE1(name, a) ((void) (a))
+#define PROBE2(name, a, b) ((void) (a), (void) (b))
+#define PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#define PROBE_ENABLED(name) 0
+
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#include "lisp.h"
+
+/*
+ * Promises. DELAY in library.lisp wraps its expression in a thunk;
+ * the first FORCE calls it and keeps the value in its place, so the
+ * thunk and everything it captured can be collected. If forcing the
+ * thunk forces the same promise again, whichever finishes first wins.
+ */
+
+int builtin_promisep(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = (car(args).type == AtomType_Promise) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+/* An already forced promise, or the promise itself */
+int builtin_make_promise(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type == AtomType_Promise)
+		*result = car(args);
+	else
+		*result = make_promise(ctx, car(args), 1);
+	return Error_OK;
+}
+
+int builtin_make_lazy_promise(Interp *ctx, Atom args, Atom *result)
+{
+	Atom thunk;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	thunk = car(args);
+	if (thunk.type != AtomType_Builtin && thunk.type != AtomType_Closure
+			&& thunk.type != AtomType_Compiled)
+		return Error_Type;
+
+	*result = make_promise(ctx, thunk, 0);
+	return Error_OK;
+}
+
+int builtin_force(Interp *ctx, Atom args, Atom *result)
+{
+	struct Promise *promise;
+	Atom value;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	/* Anything else is its own value */
+	if (car(args).type != AtomType_Promise) {
+		*result = car(args);
+		return Error_OK;
+	}
+
+	/* ARGS keeps the promise, and so the thunk, alive meanwhile */
+	promise = car(args).value.promise;
+	if (!promise->done) {
+		err = apply(ctx, promise->value, nil, &value);
+		if (err)
+			return err;
+
+		if (!promise->done) {
+			gc_barrier(ctx, promise->value);
+			promise->value = value;
+			promise->done = 1;
+		}
+	}
+
+	*result = promise->value;
+	return Error_OK;
+}
@@ -20,8 +20,22 @@ int lex(const char *str, const char **start, const char **end)
 
 	if (strchr(prefix, str[0]) != NULL)
 		*end = str + 1;
+	else if (str[0] == '#' && str[1] == '(')
+		*end = str + 2;
 	else if (str[0] == ',')
 		*end = str + (str[1] == '@' ? 2 : 1);
+	else if (str[0] == '"') {
+		/* Up to the closing quote, skipping escapes */
+		for (++str; *str != '"'; ++str) {
+			if (*str == '\\' && str[1] != '\0')
+				++str;
+			if (*str == '\0') {
+				*start = *end = NULL;
+				return Error_Syntax;
+			}
+		}
+		*end = str + 1;
+	}
 	else if (str[0] == ';') {
 		str = strchr(str, '\n');
 		if (!str) {
@@ -35,7 +49,7 @@ int lex(const char *str, const char **start, const char **end)
 	return Error_OK;
 }
 
-int parse_simple(const char *start, const char *end, Atom *result)
+int parse_simple(Interp *ctx, const char *start, const char *end, Atom *result)
 {
 	char *buf, *p;
 
@@ -57,67 +71,156 @@ int parse_simple(const char *start, const char *end, Atom *result)
 	if (strcmp(buf, "NIL") == 0)
 		*result = nil;
 	else
-		*result = make_sym(buf);
+		*result = make_sym(ctx, buf);
 
 	free(buf);
 
 	return Error_OK;
 }
 
-int read_list(const char *start, const char **end, Atom *result)
+static int read_datum(Interp *ctx, const char *input, const char **end,
+	Atom *result, int quoted);
+
+int read_string(Interp *ctx, const char *start, const char *end, Atom *result)
 {
-	Atom p;
+	char *buf, *p;
+
+	/* Drop the quotes and decode escapes */
+	buf = malloc(end - start);
+	p = buf;
+	for (++start, --end; start != end; ++start) {
+		if (*start == '\\') {
+			++start;
+			switch (*start) {
+			case 'n': *p++ = '\n'; break;
+			case 't': *p++ = '\t'; break;
+			default:  *p++ = *start; break;
+			}
+		} else {
+			*p++ = *start;
+		}
+	}
+
+	if (ctx->share_constants)
+		*result = constant_string(ctx, buf, p - buf);
+	else
+		*result = make_string(ctx, buf, p - buf);
+	free(buf);
+
+	return Error_OK;
+}
+
+/*
+ * The items are gathered first so that the list can be made in one go,
+ * packed if it is long. Nothing here collects, so they need no root.
+ * Quoted data is made of shared constant pairs instead, from the tail.
+ */
+static int read_items(Interp *ctx, const char *start, const char **end,
+	Atom *result, int quoted)
+{
+	Atom small[16], *items = small, tail = nil, p;
+	long n = 0, size = 16, i;
+	Error err;
 
 	*end = start;
-	p = *result = nil;
+	*result = nil;
 
 	for (;;) {
 		const char *token;
 		Atom item;
-		Error err;
 
 		err = lex(*end, &token, end);
 		if (err)
-			return err;
+			break;
 
 		if (token[0] == ')')
-			return Error_OK;
+			break;
 
 		if (token[0] == '.' && *end - token == 1) {
 			/* Improper list */
-			if (nilp(p))
-				return Error_Syntax;
+			if (n == 0) {
+				err = Error_Syntax;
+				break;
+			}
 
-			err = read_expr(*end, end, &item);
+			err = read_datum(ctx, *end, end, &tail, quoted);
 			if (err)
-				return err;
-
-			cdr(p) = item;
+				break;
 
 			/* Read the closing ')' */
 			err = lex(*end, &token, end);
 			if (!err && token[0] != ')')
 				err = Error_Syntax;
-
-			return err;
+			break;
 		}
 
-		err = read_expr(token, end, &item);
+		err = read_datum(ctx, token, end, &item, quoted);
 		if (err)
-			return err;
+			break;
 
-		if (nilp(p)) {
-			/* First item */
-			*result = cons(item, nil);
-			p = *result;
-		} else {
-			cdr(p) = cons(item, nil);
-			p = cdr(p);
+		/* (QUOTE x) reads x as constant data */
+		if (n == 0 && ctx->share_constants && item.type == AtomType_Symbol
+				&& strcmp(item.value.symbol, "QUOTE") == 0)
+			quoted = 1;
+
+		if (n == size) {
+			size *= 2;
+			if (items == small) {
+				items = malloc(size * sizeof(Atom));
+				memcpy(items, small, n * sizeof(Atom));
+			} else {
+				items = realloc(items, size * sizeof(Atom));
+			}
 		}
+		items[n++] = item;
 	}
+
+	if (!err && quoted) {
+		*result = tail;
+		while (n > 0)
+			*result = constant_cons(ctx, items[--n], *result);
+	} else if (!err) {
+		*result = make_list(ctx, n, tail);
+		for (i = 0, p = *result; i < n; ++i, p = cdr(p))
+			car(p) = items[i];
+	}
+
+	if (items != small)
+		free(items);
+	return err;
+}
+
+int read_list(Interp *ctx, const char *start, const char **end, Atom *result)
+{
+	return read_items(ctx, start, end, result, 0);
+}
+
+/* The two element list of a prefix form such as 'x */
+static int read_prefix(Interp *ctx, const char *name, const char *input,
+	const char **end, Atom *result, int quoted, int inner)
+{
+	Atom datum;
+	Error err;
+
+	err = read_datum(ctx, input, end, &datum, inner);
+	if (err)
+		return err;
+
+	if (quoted)
+		*result = constant_cons(ctx, make_sym(ctx, name),
+			constant_cons(ctx, datum, nil));
+	else
+		*result = cons(ctx, make_sym(ctx, name), cons(ctx, datum, nil));
+	return Error_OK;
 }
 
-int read_expr(const char *input, const char **end, Atom *result)
+/*
+ * With ctx->share_constants set, quoted data and vector literals are
+ * read as constants, so that equal ones are the same object; the items
+ * of a quoted form are read with quoted set.
+ */
+static int read_datum(Interp *ctx, const char *input, const char **end,
+	Atom *result, int quoted)
 {
 	const char *token;
 	Error err;
@@ -127,22 +230,36 @@ int read_expr(const char *input, const char **end, Atom *result)
 		return err;
 
 	if (token[0] == '(') {
-		return read_list(*end, end, result);
+		return read_items(ctx, *end, end, result, quoted);
+	} else if (token[0] == '#' && token[1] == '(') {
+		err = read_items(ctx, *end, end, result, ctx->share_constants);
+		if (!err && !listp(*result))
+			err = Error_Syntax;
+		if (!err)
+			*result = list_to_vector(ctx, *result);
+		if (!err && ctx->share_constants)
+			*result = constant_vector(ctx, *result);
+		return err;
 	} else if (token[0] == ')') {
 		return Error_Syntax;
+	} else if (token[0] == '"') {
+		return read_string(ctx, token, *end, result);
 	} else if (token[0] == '\'') {
-		*result = cons(make_sym("QUOTE"), cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
+		return read_prefix(ctx, "QUOTE", *end, end, result,
+			quoted, quoted || ctx->share_constants);
 	} else if (token[0] == '`') {
-		*result = cons(make_sym("QUASIQUOTE"), cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
+		return read_prefix(ctx, "QUASIQUOTE", *end, end, result,
+			quoted, quoted);
 	} else if (token[0] == ',') {
-		*result = cons(make_sym(
-			token[1] == '@' ? "UNQUOTE-SPLICING" : "UNQUOTE"),
-			cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
+		return read_prefix(ctx,
+			token[1] == '@' ? "UNQUOTE-SPLICING" : "UNQUOTE",
+			*end, end, result, quoted, quoted);
 	} else {
-		return parse_simple(token, *end, result);
+		return parse_simple(ctx, token, *end, result);
 	}
 }
 
+int read_expr(Interp *ctx, const char *input, const char **end, Atom *result)
+{
+	return read_datum(ctx, input, end, result, 0);
+}
@@ -0,0 +1,295 @@
+#include "lisp.h"
+
+/*
+ * Records. MAKE-RECORD-TYPE makes a descriptor naming the fields, and
+ * the procedures over a type are compiled procedures (as lisp -C makes)
+ * whose captured values are the descriptor and a slot index, so that a
+ * field is reached in one step after a pointer comparison on the type.
+ * DEFINE-RECORD-TYPE in library.lisp binds them by name.
+ */
+
+static int record_typep(Atom a)
+{
+	return a.type == AtomType_Record && nilp(a.value.record->type);
+}
+
+/* The slot of a field, or -1 */
+static long record_slot(Atom type, Atom field)
+{
+	Atom p = type.value.record->slots[1];
+	long i;
+
+	for (i = 0; !nilp(p); p = cdr(p), ++i) {
+		if (car(p).value.symbol == field.value.symbol)
+			return i;
+	}
+
+	return -1;
+}
+
+static int record_of(Atom self, Atom a)
+{
+	return a.type == AtomType_Record
+		&& a.value.record->type.value.record
+			== self.value.compiled->vars[0].value.record;
+}
+
+/* vars: type, then the slot of each argument */
+static int record_construct(Interp *ctx, Atom self, Atom *args, int argc,
+	Atom *result)
+{
+	struct Compiled *c = self.value.compiled;
+	Atom type = c->vars[0];
+	int i;
+
+	if (argc != c->count - 1)
+		return Error_Args;
+
+	*result = make_record(ctx, type, type.value.record->slots[2].value.integer);
+	for (i = 0; i < argc; ++i)
+		result->value.record->slots[c->vars[1 + i].value.integer] = args[i];
+
+	return Error_OK;
+}
+
+/* vars: type */
+static int record_test(Interp *ctx, Atom self, Atom *args, int argc,
+	Atom *result)
+{
+	if (argc != 1)
+		return Error_Args;
+
+	*result = record_of(self, args[0]) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+/* vars: type, slot */
+static int record_get(Interp *ctx, Atom self, Atom *args, int argc,
+	Atom *result)
+{
+	if (argc != 1)
+		return Error_Args;
+
+	if (!record_of(self, args[0]))
+		return Error_Type;
+
+	*result = args[0].value.record->slots[
+		self.value.compiled->vars[1].value.integer];
+	return Error_OK;
+}
+
+/* vars: type, slot */
+static int record_set(Interp *ctx, Atom self, Atom *args, int argc,
+	Atom *result)
+{
+	Atom *slot;
+
+	if (argc != 2)
+		return Error_Args;
+
+	if (!record_of(self, args[0]))
+		return Error_Type;
+
+	slot = &args[0].value.record->slots[self.value.compiled->vars[1].value.integer];
+	gc_barrier(ctx, *slot);
+	*slot = args[1];
+	*result = nil;
+	return Error_OK;
+}
+
+static int make_constructor(Interp *ctx, Atom type, Atom fields, Atom *result)
+{
+	Atom p;
+	long n = 0, i, k;
+
+	for (p = fields; !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair || car(p).type != AtomType_Symbol)
+			return Error_Type;
+		++n;
+	}
+
+	*result = make_compiled(ctx, record_construct, 1 + n);
+	result->value.compiled->vars[0] = type;
+	for (i = 0, p = fields; i < n; ++i, p = cdr(p)) {
+		k = record_slot(type, car(p));
+		if (k < 0)
+			return Error_Type;
+		result->value.compiled->vars[1 + i] = make_int(k);
+	}
+
+	return Error_OK;
+}
+
+static int make_field_procedure(Interp *ctx, Native fn, Atom type, Atom field,
+	Atom *result)
+{
+	long k;
+
+	if (field.type != AtomType_Symbol)
+		return Error_Type;
+
+	k = record_slot(type, field);
+	if (k < 0)
+		return Error_Type;
+
+	*result = make_compiled(ctx, fn, 2);
+	result->value.compiled->vars[0] = type;
+	result->value.compiled->vars[1] = make_int(k);
+	return Error_OK;
+}
+
+int builtin_recordp(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = (car(args).type == AtomType_Record && !record_typep(car(args)))
+		? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+/* (make-record-type name fields) */
+int builtin_make_record_type(Interp *ctx, Atom args, Atom *result)
+{
+	Atom fields, p;
+	long n = 0;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Symbol)
+		return Error_Type;
+
+	fields = car(cdr(args));
+	for (p = fields; !nilp(p); p = cdr(p), ++n) {
+		if (p.type != AtomType_Pair || car(p).type != AtomType_Symbol)
+			return Error_Type;
+	}
+
+	*result = make_record(ctx, nil, 3);
+	result->value.record->slots[0] = car(args);
+	result->value.record->slots[1] = copy_list(ctx, fields);
+	result->value.record->slots[2] = make_int(n);
+	return Error_OK;
+}
+
+/* (record-constructor type [fields]); all fields in order by default */
+int builtin_record_constructor(Interp *ctx, Atom args, Atom *result)
+{
+	Atom type;
+
+	if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args)))))
+		return Error_Args;
+
+	type = car(args);
+	if (!record_typep(type))
+		return Error_Type;
+
+	return make_constructor(ctx, type,
+		nilp(cdr(args)) ? type.value.record->slots[1] : car(cdr(args)), result);
+}
+
+int builtin_record_predicate(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (!record_typep(car(args)))
+		return Error_Type;
+
+	*result = make_compiled(ctx, record_test, 1);
+	result->value.compiled->vars[0] = car(args);
+	return Error_OK;
+}
+
+int builtin_record_accessor(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	if (!record_typep(car(args)))
+		return Error_Type;
+
+	return make_field_procedure(ctx, record_get, car(args), car(cdr(args)),
+		result);
+}
+
+int builtin_record_modifier(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	if (!record_typep(car(args)))
+		return Error_Type;
+
+	return make_field_procedure(ctx, record_set, car(args), car(cdr(args)),
+		result);
+}
+
+static int define_global(Interp *ctx, Atom name, Atom value)
+{
+	if (name.type != AtomType_Symbol)
+		return Error_Type;
+
+	return env_define(ctx, ctx->env, name, value);
+}
+
+/*
+ * (define-record-procedures type (ctor field...) pred ((field get [set])...))
+ * binds the procedures globally and returns the type. Nothing collects
+ * here, so the procedures need no roots between being made and bound.
+ */
+int builtin_define_record_procedures(Interp *ctx, Atom args, Atom *result)
+{
+	Atom type, spec, value, p;
+	Error err;
+
+	if (!listp(args) || nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| nilp(cdr(cdr(cdr(args)))) || !nilp(cdr(cdr(cdr(cdr(args))))))
+		return Error_Args;
+
+	type = car(args);
+	if (!record_typep(type))
+		return Error_Type;
+
+	spec = car(cdr(args));
+	if (!nilp(spec)) {
+		if (spec.type != AtomType_Pair)
+			return Error_Syntax;
+		err = make_constructor(ctx, type, cdr(spec), &value);
+		if (!err)
+			err = define_global(ctx, car(spec), value);
+		if (err)
+			return err;
+	}
+
+	spec = car(cdr(cdr(args)));
+	if (!nilp(spec)) {
+		value = make_compiled(ctx, record_test, 1);
+		value.value.compiled->vars[0] = type;
+		err = define_global(ctx, spec, value);
+		if (err)
+			return err;
+	}
+
+	for (p = car(cdr(cdr(cdr(args)))); !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair || car(p).type != AtomType_Pair
+				|| !listp(car(p)) || nilp(cdr(car(p))))
+			return Error_Syntax;
+
+		spec = car(p);
+		err = make_field_procedure(ctx, record_get, type, car(spec), &value);
+		if (!err)
+			err = define_global(ctx, car(cdr(spec)), value);
+		if (!err && !nilp(cdr(cdr(spec)))) {
+			err = make_field_procedure(ctx, record_set, type, car(spec), &value);
+			if (!err)
+				err = define_global(ctx, car(cdr(cdr(spec))), value);
+		}
+		if (err)
+			return err;
+	}
+
+	*result = type;
+	return Error_OK;
+}
@@ -0,0 +1,172 @@
+#include "lisp.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Server mode. The parent loads everything once, then forks workers
+ * which share its heap copy-on-write and take turns accepting
+ * connections on one Unix socket. A request is the text the client
+ * sends before shutting down its side; each expression in it is
+ * evaluated and its printed result sent back as soon as it is ready.
+ */
+
+static char *read_request(int fd)
+{
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+	ssize_t n;
+
+	do {
+		if (len + 1 >= size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if (n > 0)
+			len += n;
+	} while (n > 0);
+
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	buf[len] = '\0';
+	return buf;
+}
+
+static void serve_request(Interp *ctx, const char *input)
+{
+	const char *p = input;
+	struct Root root;
+	Atom env;
+
+	/* Definitions made by a request stay out of the shared environment */
+	env = env_create(ctx, ctx->env);
+	gc_protect(ctx, &root, &env, 1);
+
+	for (;;) {
+		Atom expr, result;
+		Error err;
+
+		/* Skip trailing whitespace and comments */
+		p += strspn(p, " \t\n");
+		if (*p == ';') {
+			p = strchr(p, '\n');
+			if (!p)
+				break;
+			continue;
+		}
+		if (*p == '\0')
+			break;
+
+		err = read_expr(ctx, p, &p, &expr);
+		if (err) {
+			/* The rest of the request cannot be read either */
+			print_error(err);
+			break;
+		}
+
+		err = eval_expr(ctx, expr, env, &result);
+		if (err) {
+			print_error(err);
+		} else {
+			print_expr(result);
+			putchar('\n');
+		}
+		fflush(stdout);
+	}
+
+	ctx->roots = root.next;
+}
+
+static void worker_main(Interp *ctx, int sock)
+{
+	int out = dup(STDOUT_FILENO);
+
+	for (;;) {
+		int conn;
+		char *input;
+
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0)
+			continue;
+
+		input = read_request(conn);
+		if (input) {
+			/* The printer writes to stdout */
+			dup2(conn, STDOUT_FILENO);
+			serve_request(ctx, input);
+			fflush(stdout);
+			dup2(out, STDOUT_FILENO);
+			free(input);
+		}
+
+		close(conn);
+	}
+}
+
+static pid_t spawn_worker(Interp *ctx, int sock)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		worker_main(ctx, sock);
+		exit(0);
+	}
+
+	return pid;
+}
+
+int serve(Interp *ctx, const char *path, int workers)
+{
+	struct sockaddr_un addr;
+	int sock, i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(sock, 128) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	/* A client hanging up must not kill the worker */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Start every worker from a freshly collected heap */
+	gc(ctx);
+	gc_step(ctx, 0);
+	fflush(stdout);
+
+	for (i = 0; i < workers; ++i)
+		spawn_worker(ctx, sock);
+
+	printf("Serving on %s with %d workers\n", path, workers);
+	fflush(stdout);
+
+	/* Replace any worker that dies */
+	for (;;) {
+		if (wait(NULL) < 0)
+			break;
+		spawn_worker(ctx, sock);
+	}
+
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,531 @@
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Strings are immutable, length-prefixed byte sequences. Ports wrap a
+ * stdio stream: files are opened directly, input string ports read
+ * the string's bytes in place, and output string ports collect into
+ * a memory stream. READ takes whole lines into an input port's buffer
+ * until they hold an expression, and keeps the rest of the last line
+ * there for the next READ or READ-LINE.
+ */
+
+static Atom make_bool(Interp *ctx, int b)
+{
+	return b ? ctx->sym_t : nil;
+}
+
+/* Optional port argument, defaulting to a standard stream */
+static int port_arg(Atom args, int input, FILE **file)
+{
+	struct Port *port;
+
+	if (nilp(args)) {
+		*file = input ? stdin : stdout;
+		return Error_OK;
+	}
+
+	if (!nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Port)
+		return Error_Type;
+
+	port = car(args).value.port;
+	if (port->input != input || port->file == NULL)
+		return Error_Type;
+
+	*file = port->file;
+	return Error_OK;
+}
+
+static int string_compare(Atom a, Atom b)
+{
+	long n = a.value.string->length < b.value.string->length
+		? a.value.string->length : b.value.string->length;
+	int c = memcmp(a.value.string->data, b.value.string->data, n);
+
+	if (c != 0)
+		return c;
+	return (a.value.string->length > b.value.string->length)
+		- (a.value.string->length < b.value.string->length);
+}
+
+int builtin_stringp(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = make_bool(ctx, car(args).type == AtomType_String);
+	return Error_OK;
+}
+
+int builtin_string_length(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	*result = make_int(car(args).value.string->length);
+	return Error_OK;
+}
+
+int builtin_string_ref(Interp *ctx, Atom args, Atom *result)
+{
+	Atom s, index;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	s = car(args);
+	index = car(cdr(args));
+	if (s.type != AtomType_String || index.type != AtomType_Integer)
+		return Error_Type;
+
+	if (index.value.integer < 0 || index.value.integer >= s.value.string->length)
+		return Error_Range;
+
+	*result = make_int((unsigned char) s.value.string->data[index.value.integer]);
+	return Error_OK;
+}
+
+int builtin_substring(Interp *ctx, Atom args, Atom *result)
+{
+	Atom s;
+	long start, end;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+
+	s = car(args);
+	if (s.type != AtomType_String || car(cdr(args)).type != AtomType_Integer)
+		return Error_Type;
+
+	start = car(cdr(args)).value.integer;
+	end = s.value.string->length;
+
+	args = cdr(cdr(args));
+	if (!nilp(args)) {
+		if (!nilp(cdr(args)))
+			return Error_Args;
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		end = car(args).value.integer;
+	}
+
+	if (start < 0 || end < start || end > s.value.string->length)
+		return Error_Range;
+
+	*result = make_string(ctx, s.value.string->data + start, end - start);
+	return Error_OK;
+}
+
+int builtin_string_append(Interp *ctx, Atom args, Atom *result)
+{
+	Atom p;
+	long length = 0;
+	char *q;
+
+	for (p = args; !nilp(p); p = cdr(p)) {
+		if (car(p).type != AtomType_String)
+			return Error_Type;
+		length += car(p).value.string->length;
+	}
+
+	/* Copy straight into the new object */
+	*result = make_string(ctx, NULL, length);
+	q = result->value.string->data;
+	for (p = args; !nilp(p); p = cdr(p)) {
+		memcpy(q, car(p).value.string->data, car(p).value.string->length);
+		q += car(p).value.string->length;
+	}
+
+	return Error_OK;
+}
+
+int builtin_string_eq(Interp *ctx, Atom args, Atom *result)
+{
+	Atom a, b;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+	if (a.type != AtomType_String || b.type != AtomType_String)
+		return Error_Type;
+
+	*result = make_bool(ctx, string_compare(a, b) == 0);
+	return Error_OK;
+}
+
+int builtin_string_less(Interp *ctx, Atom args, Atom *result)
+{
+	Atom a, b;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+	if (a.type != AtomType_String || b.type != AtomType_String)
+		return Error_Type;
+
+	*result = make_bool(ctx, string_compare(a, b) < 0);
+	return Error_OK;
+}
+
+int builtin_string_to_symbol(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	*result = make_sym(ctx, car(args).value.string->data);
+	return Error_OK;
+}
+
+int builtin_symbol_to_string(Interp *ctx, Atom args, Atom *result)
+{
+	const char *name;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (nilp(car(args)))
+		name = "NIL";
+	else if (car(args).type == AtomType_Symbol)
+		name = car(args).value.symbol;
+	else
+		return Error_Type;
+
+	*result = make_string(ctx, name, strlen(name));
+	return Error_OK;
+}
+
+int builtin_number_to_string(Interp *ctx, Atom args, Atom *result)
+{
+	char buf[32];
+	int n;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Integer)
+		return Error_Type;
+
+	n = snprintf(buf, sizeof(buf), "%ld", car(args).value.integer);
+	*result = make_string(ctx, buf, n);
+	return Error_OK;
+}
+
+int builtin_string_to_number(Interp *ctx, Atom args, Atom *result)
+{
+	struct String *s;
+	char *end;
+	long val;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	/* NIL unless the whole string is an integer */
+	s = car(args).value.string;
+	val = strtol(s->data, &end, 10);
+	if (s->length > 0 && end == s->data + s->length)
+		*result = make_int(val);
+	else
+		*result = nil;
+
+	return Error_OK;
+}
+
+int builtin_open_input_string(Interp *ctx, Atom args, Atom *result)
+{
+	Atom s;
+	FILE *file;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	s = car(args);
+	if (s.type != AtomType_String)
+		return Error_Type;
+
+	/* The port keeps the string alive while it reads from it */
+	file = fmemopen(s.value.string->data, s.value.string->length, "r");
+	*result = make_port(ctx, file, s, 1);
+	return Error_OK;
+}
+
+int builtin_open_output_string(Interp *ctx, Atom args, Atom *result)
+{
+	struct Port *port;
+
+	if (!nilp(args))
+		return Error_Args;
+
+	*result = make_port(ctx, NULL, nil, 0);
+	port = result->value.port;
+	port->file = open_memstream(&port->buf, &port->size);
+	return Error_OK;
+}
+
+int builtin_get_output_string(Interp *ctx, Atom args, Atom *result)
+{
+	struct Port *port;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Port)
+		return Error_Type;
+
+	port = car(args).value.port;
+	if (port->input || (port->file == NULL && port->buf == NULL))
+		return Error_Type;
+
+	if (port->file)
+		fflush(port->file);
+	*result = make_string(ctx, port->buf, port->size);
+	return Error_OK;
+}
+
+static int open_file(Interp *ctx, Atom args, int input, Atom *result)
+{
+	Atom path;
+	FILE *file;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	path = car(args);
+	if (path.type != AtomType_String)
+		return Error_Type;
+
+	file = fopen(path.value.string->data, input ? "r" : "w");
+	*result = file ? make_port(ctx, file, nil, input) : nil;
+	return Error_OK;
+}
+
+int builtin_open_input_file(Interp *ctx, Atom args, Atom *result)
+{
+	return open_file(ctx, args, 1, result);
+}
+
+int builtin_open_output_file(Interp *ctx, Atom args, Atom *result)
+{
+	return open_file(ctx, args, 0, result);
+}
+
+int builtin_close_port(Interp *ctx, Atom args, Atom *result)
+{
+	struct Port *port;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Port)
+		return Error_Type;
+
+	/* An output string port's contents stay readable */
+	port = car(args).value.port;
+	if (port->file) {
+		fclose(port->file);
+		port->file = NULL;
+	}
+
+	*result = nil;
+	return Error_OK;
+}
+
+int builtin_read_line(Interp *ctx, Atom args, Atom *result)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	Error err;
+
+	err = port_arg(args, 1, &file);
+	if (err)
+		return err;
+
+	/* The rest of a line READ stopped in */
+	if (!nilp(args) && car(args).value.port->buf) {
+		struct Port *port = car(args).value.port;
+
+		n = port->size;
+		if (n > 0 && port->buf[n - 1] == '\n')
+			--n;
+		*result = make_string(ctx, port->buf, n);
+		free(port->buf);
+		port->buf = NULL;
+		port->size = 0;
+		return Error_OK;
+	}
+
+	n = getline(&line, &size, file);
+	if (n < 0) {
+		*result = nil;
+	} else {
+		if (n > 0 && line[n - 1] == '\n')
+			--n;
+		*result = make_string(ctx, line, n);
+	}
+
+	free(line);
+	return Error_OK;
+}
+
+/* How much of READ's buffer has been looked at, and what it holds */
+struct Scan {
+	long depth;
+	int string, escape, comment;
+	int complete;
+};
+
+/*
+ * Follows brackets, strings and comments through new text so that
+ * read_expr only runs once an expression may be complete; parsing the
+ * whole buffer again after every line of a long list is quadratic.
+ */
+static void scan_text(struct Scan *s, const char *p)
+{
+	for (; *p; ++p) {
+		if (s->string) {
+			if (s->escape)
+				s->escape = 0;
+			else if (*p == '\\')
+				s->escape = 1;
+			else if (*p == '"') {
+				s->string = 0;
+				if (s->depth == 0)
+					s->complete = 1;
+			}
+			continue;
+		}
+
+		if (s->comment) {
+			s->comment = (*p != '\n');
+			continue;
+		}
+
+		switch (*p) {
+		case ';':
+			s->comment = 1;
+			break;
+		case '"':
+			s->string = 1;
+			break;
+		case '(':
+			++s->depth;
+			break;
+		case ')':
+			if (--s->depth <= 0)
+				s->complete = 1;
+			break;
+		case ' ': case '\t': case '\n':
+		case '\'': case '`': case ',': case '@': case '#':
+			break;
+		default:
+			if (s->depth == 0)
+				s->complete = 1;
+		}
+	}
+}
+
+/* (read port [eof]) returns EOF, default nil, at the end of input */
+int builtin_read(Interp *ctx, Atom args, Atom *result)
+{
+	struct Port *port;
+	struct Scan scan = { 0 };
+	const char *start, *end;
+	char *line = NULL;
+	size_t size = 0;
+	long scanned = 0;
+	ssize_t n;
+	Error err;
+
+	if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args)))))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Port)
+		return Error_Type;
+
+	port = car(args).value.port;
+	if (!port->input || port->file == NULL)
+		return Error_Type;
+
+	for (;;) {
+		if (port->buf) {
+			scan_text(&scan, port->buf + scanned);
+			scanned = port->size;
+
+			/* More lines cannot mend what is there */
+			if (scan.complete) {
+				err = read_expr(ctx, port->buf, &end, result);
+				break;
+			}
+		}
+
+		n = getline(&line, &size, port->file);
+		if (n < 0) {
+			/* Only blanks and comments left is the end */
+			if (!port->buf || lex(port->buf, &start, &end) != Error_OK) {
+				*result = nilp(cdr(args)) ? nil : car(cdr(args));
+				err = Error_OK;
+			} else {
+				err = Error_Syntax;
+			}
+			end = NULL;
+			break;
+		}
+
+		port->buf = realloc(port->buf, port->size + n + 1);
+		memcpy(port->buf + port->size, line, n + 1);
+		port->size += n;
+	}
+
+	/* Keep what follows for the next read; drop a bad expression */
+	if (port->buf) {
+		if (end && *end != '\0') {
+			port->size -= end - port->buf;
+			memmove(port->buf, end, port->size + 1);
+		} else {
+			free(port->buf);
+			port->buf = NULL;
+			port->size = 0;
+		}
+	}
+
+	free(line);
+	return err;
+}
+
+int builtin_write_string(Interp *ctx, Atom args, Atom *result)
+{
+	FILE *file;
+	Error err;
+
+	if (nilp(args))
+		return Error_Args;
+
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	err = port_arg(cdr(args), 0, &file);
+	if (err)
+		return err;
+
+	fwrite(car(args).value.string->data, 1, car(args).value.string->length, file);
+	*result = nil;
+	return Error_OK;
+}
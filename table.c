@@ -0,0 +1,431 @@
+#include "lisp.h"
+#include <string.h>
+
+/*
+ * Hash tables use open addressing with linear probing. The keys and
+ * values live in a vector (key, value, key, value...) and the hash of
+ * each slot in a parallel integer array, where 0 marks an empty slot
+ * and 1 a deleted one.
+ *
+ * When the table grows, the old storage is kept and drained a few
+ * slots at a time by later operations, so no single call pays for
+ * rehashing the whole table.
+ */
+#define SLOT_EMPTY   0
+#define SLOT_DELETED 1
+#define MIGRATE_STEP 8
+
+static unsigned long hash_mix(unsigned long h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
+static unsigned long hash_atom(Atom a, int equal)
+{
+	unsigned long h;
+	long i;
+
+	if (equal && a.type == AtomType_Pair) {
+		h = 17;
+		while (a.type == AtomType_Pair) {
+			h = h * 31 + hash_atom(car(a), 1);
+			a = cdr(a);
+		}
+		return hash_mix(h * 31 + hash_atom(a, 1));
+	}
+
+	if (equal && a.type == AtomType_Vector) {
+		h = 19;
+		for (i = 0; i < a.value.vector->length; ++i)
+			h = h * 31 + hash_atom(a.value.vector->items[i], 1);
+		return hash_mix(h);
+	}
+
+	if (equal && a.type == AtomType_String) {
+		h = 23;
+		for (i = 0; i < a.value.string->length; ++i)
+			h = h * 31 + (unsigned char) a.value.string->data[i];
+		return hash_mix(h);
+	}
+
+	if (nilp(a))
+		return 0;
+
+	/* Integers by value, everything else by identity */
+	return hash_mix((unsigned long) a.value.integer ^ a.type);
+}
+
+static unsigned long table_hash(struct Table *t, Atom key)
+{
+	/* Keep hashes positive so they fit the slot array */
+	unsigned long h = hash_atom(key, t->equal) >> 1;
+	return h > SLOT_DELETED ? h : h + 2;
+}
+
+static int table_keys_match(struct Table *t, Atom a, Atom b)
+{
+	return t->equal ? atom_equal(a, b) : atom_eq(a, b);
+}
+
+static void store(Interp *ctx, Atom v, long i, Atom value)
+{
+	gc_barrier(ctx, v.value.vector->items[i]);
+	v.value.vector->items[i] = value;
+}
+
+/* Index of the slot holding key, or -1 */
+static long slots_find(struct Table *t, Atom buckets, Atom hashes, Atom key,
+	unsigned long h)
+{
+	long cap, i, n;
+	long *hs;
+
+	if (nilp(buckets))
+		return -1;
+
+	cap = hashes.value.array->length;
+	hs = hashes.value.array->items;
+
+	for (i = h & (cap - 1), n = 0; n < cap; i = (i + 1) & (cap - 1), ++n) {
+		if (hs[i] == SLOT_EMPTY)
+			return -1;
+		if ((unsigned long) hs[i] == h
+				&& table_keys_match(t, buckets.value.vector->items[2 * i], key))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Put a key known not to be present into the current storage */
+static void slots_insert(Interp *ctx, struct Table *t, Atom key, Atom value,
+	unsigned long h)
+{
+	long cap = t->hashes.value.array->length;
+	long *hs = t->hashes.value.array->items;
+	long i;
+
+	i = h & (cap - 1);
+	while (hs[i] > SLOT_DELETED)
+		i = (i + 1) & (cap - 1);
+
+	if (hs[i] == SLOT_EMPTY)
+		++t->used;
+	hs[i] = h;
+	store(ctx, t->buckets, 2 * i, key);
+	store(ctx, t->buckets, 2 * i + 1, value);
+}
+
+static void table_migrate(Interp *ctx, struct Table *t, long steps)
+{
+	long cap, *hs;
+
+	if (nilp(t->old_buckets))
+		return;
+
+	cap = t->old_hashes.value.array->length;
+	hs = t->old_hashes.value.array->items;
+
+	while (t->migrated < cap && (steps < 0 || steps-- > 0)) {
+		long i = t->migrated++;
+		if (hs[i] > SLOT_DELETED) {
+			slots_insert(ctx, t, t->old_buckets.value.vector->items[2 * i],
+				t->old_buckets.value.vector->items[2 * i + 1], hs[i]);
+			hs[i] = SLOT_DELETED;
+		}
+	}
+
+	if (t->migrated == cap) {
+		gc_barrier(ctx, t->old_buckets);
+		gc_barrier(ctx, t->old_hashes);
+		t->old_buckets = t->old_hashes = nil;
+	}
+}
+
+static void table_grow(Interp *ctx, struct Table *t)
+{
+	long cap = t->hashes.value.array->length;
+
+	/* Only one resize can be in flight */
+	table_migrate(ctx, t, -1);
+
+	/* Rehash at the same size if most of the used slots are deleted */
+	if (t->count * 2 >= cap)
+		cap *= 2;
+
+	gc_barrier(ctx, t->old_buckets);
+	gc_barrier(ctx, t->old_hashes);
+	t->old_buckets = t->buckets;
+	t->old_hashes = t->hashes;
+	t->migrated = 0;
+
+	gc_barrier(ctx, t->buckets);
+	gc_barrier(ctx, t->hashes);
+	t->buckets = make_vector(ctx, 2 * cap, nil);
+	t->hashes = make_array(ctx, cap);
+	memset(t->hashes.value.array->items, 0, cap * sizeof(long));
+	t->used = 0;
+}
+
+static int table_get(Interp *ctx, struct Table *t, Atom key, Atom *value)
+{
+	unsigned long h = table_hash(t, key);
+	long i;
+
+	table_migrate(ctx, t, MIGRATE_STEP);
+
+	i = slots_find(t, t->buckets, t->hashes, key, h);
+	if (i >= 0) {
+		*value = t->buckets.value.vector->items[2 * i + 1];
+		return 1;
+	}
+
+	i = slots_find(t, t->old_buckets, t->old_hashes, key, h);
+	if (i >= 0) {
+		*value = t->old_buckets.value.vector->items[2 * i + 1];
+		return 1;
+	}
+
+	return 0;
+}
+
+static void table_put(Interp *ctx, struct Table *t, Atom key, Atom value)
+{
+	unsigned long h = table_hash(t, key);
+	long i;
+
+	table_migrate(ctx, t, MIGRATE_STEP);
+
+	i = slots_find(t, t->buckets, t->hashes, key, h);
+	if (i >= 0) {
+		store(ctx, t->buckets, 2 * i + 1, value);
+		return;
+	}
+
+	i = slots_find(t, t->old_buckets, t->old_hashes, key, h);
+	if (i >= 0) {
+		t->old_hashes.value.array->items[i] = SLOT_DELETED;
+		--t->count;
+	}
+
+	if ((t->used + 1) * 4 > t->hashes.value.array->length * 3)
+		table_grow(ctx, t);
+
+	slots_insert(ctx, t, key, value, h);
+	++t->count;
+}
+
+static int table_remove(Interp *ctx, struct Table *t, Atom key)
+{
+	unsigned long h = table_hash(t, key);
+	long i;
+
+	table_migrate(ctx, t, MIGRATE_STEP);
+
+	i = slots_find(t, t->buckets, t->hashes, key, h);
+	if (i >= 0) {
+		t->hashes.value.array->items[i] = SLOT_DELETED;
+		store(ctx, t->buckets, 2 * i, nil);
+		store(ctx, t->buckets, 2 * i + 1, nil);
+		--t->count;
+		return 1;
+	}
+
+	i = slots_find(t, t->old_buckets, t->old_hashes, key, h);
+	if (i >= 0) {
+		t->old_hashes.value.array->items[i] = SLOT_DELETED;
+		--t->count;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* List of (key . value) for every entry */
+static Atom table_entries(Interp *ctx, struct Table *t)
+{
+	Atom result = nil;
+	Atom storage[2][2];
+	int k;
+	long i;
+
+	storage[0][0] = t->buckets;
+	storage[0][1] = t->hashes;
+	storage[1][0] = t->old_buckets;
+	storage[1][1] = t->old_hashes;
+
+	for (k = 0; k < 2; ++k) {
+		Atom buckets = storage[k][0];
+		Atom hashes = storage[k][1];
+
+		if (nilp(buckets))
+			continue;
+
+		for (i = 0; i < hashes.value.array->length; ++i) {
+			if (hashes.value.array->items[i] > SLOT_DELETED)
+				result = cons(ctx, cons(ctx,
+					buckets.value.vector->items[2 * i],
+					buckets.value.vector->items[2 * i + 1]), result);
+		}
+	}
+
+	return result;
+}
+
+int builtin_hash_tablep(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = (car(args).type == AtomType_Table) ? ctx->sym_t : nil;
+	return Error_OK;
+}
+
+int builtin_make_hash_table(Interp *ctx, Atom args, Atom *result)
+{
+	int equal = 0;
+
+	if (!nilp(args)) {
+		Atom kind = car(args);
+
+		if (!nilp(cdr(args)))
+			return Error_Args;
+		if (kind.type != AtomType_Symbol)
+			return Error_Type;
+
+		if (strcmp(kind.value.symbol, "EQUAL") == 0)
+			equal = 1;
+		else if (strcmp(kind.value.symbol, "EQ") != 0)
+			return Error_Args;
+	}
+
+	*result = make_table(ctx, equal);
+
+	return Error_OK;
+}
+
+int builtin_hash_table_ref(Interp *ctx, Atom args, Atom *result)
+{
+	Atom table, key;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+
+	table = car(args);
+	key = car(cdr(args));
+	args = cdr(cdr(args));
+	if (!nilp(args) && !nilp(cdr(args)))
+		return Error_Args;
+
+	if (table.type != AtomType_Table)
+		return Error_Type;
+
+	if (!table_get(ctx, table.value.table, key, result))
+		*result = nilp(args) ? nil : car(args);
+
+	return Error_OK;
+}
+
+int builtin_hash_table_set(Interp *ctx, Atom args, Atom *result)
+{
+	Atom table;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+
+	table = car(args);
+	if (table.type != AtomType_Table)
+		return Error_Type;
+
+	table_put(ctx, table.value.table, car(cdr(args)), car(cdr(cdr(args))));
+	*result = nil;
+
+	return Error_OK;
+}
+
+int builtin_hash_table_delete(Interp *ctx, Atom args, Atom *result)
+{
+	Atom table;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	table = car(args);
+	if (table.type != AtomType_Table)
+		return Error_Type;
+
+	*result = table_remove(ctx, table.value.table, car(cdr(args)))
+		? ctx->sym_t : nil;
+
+	return Error_OK;
+}
+
+int builtin_hash_table_count(Interp *ctx, Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Table)
+		return Error_Type;
+
+	*result = make_int(car(args).value.table->count);
+
+	return Error_OK;
+}
+
+int builtin_hash_table_keys(Interp *ctx, Atom args, Atom *result)
+{
+	Atom p;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Table)
+		return Error_Type;
+
+	/* Reuse the entry list's spine for the keys */
+	*result = table_entries(ctx, car(args).value.table);
+	for (p = *result; !nilp(p); p = cdr(p))
+		set_car(ctx, p, car(car(p)));
+
+	return Error_OK;
+}
+
+int builtin_hash_table_fold(Interp *ctx, Atom args, Atom *result)
+{
+	Atom table, proc, state[2];
+	struct Root root;
+	Error err = Error_OK;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+			|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+
+	table = car(args);
+	proc = car(cdr(args));
+	if (table.type != AtomType_Table)
+		return Error_Type;
+
+	/* Fold over a snapshot, so PROC may modify the table */
+	state[0] = table_entries(ctx, table.value.table);
+	state[1] = car(cdr(cdr(args)));
+	gc_protect(ctx, &root, state, 2);
+
+	while (!err && !nilp(state[0])) {
+		Atom entry = car(state[0]);
+		err = apply(ctx, proc, list_create(ctx, 3,
+			car(entry), cdr(entry), state[1]), &state[1]);
+		state[0] = cdr(state[0]);
+	}
+
+	ctx->roots = root.next;
+	*result = state[1];
+
+	return err;
+}
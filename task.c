@@ -0,0 +1,224 @@
+#include "lisp.h"
+
+/*
+ * Green threads. Each task runs its own evaluator state for a slice of
+ * task_slice steps, then goes to the back of the run queue. A builtin
+ * that has to wait either suspends the task it was called from, to be
+ * retried when the task next runs, or, when called from outside a task
+ * or from a nested evaluation, runs other tasks until it can continue.
+ */
+
+static void queue_push(Interp *ctx, Atom task)
+{
+	Atom cell = cons(ctx, task, nil);
+
+	if (nilp(ctx->run_queue))
+		ctx->run_queue = cell;
+	else
+		set_cdr(ctx, ctx->run_tail, cell);
+	ctx->run_tail = cell;
+	++ctx->run_count;
+}
+
+static Atom queue_pop(Interp *ctx)
+{
+	Atom task = car(ctx->run_queue);
+
+	ctx->run_queue = cdr(ctx->run_queue);
+	if (nilp(ctx->run_queue))
+		ctx->run_tail = nil;
+	--ctx->run_count;
+
+	return task;
+}
+
+/* Run the next task for one slice; zero if it made no progress */
+static int schedule(Interp *ctx)
+{
+	Atom task, result = nil;
+	struct Task *t, *outer;
+	struct Root root;
+	int outer_depth, progress;
+	Error err;
+
+	if (nilp(ctx->run_queue))
+		return 0;
+
+	/* Off the queue while it runs, so nested waits skip it */
+	task = queue_pop(ctx);
+	gc_protect(ctx, &root, &task, 1);
+	t = task.value.task;
+
+	outer = ctx->task;
+	outer_depth = ctx->task_depth;
+	ctx->task = t;
+	ctx->task_depth = ctx->eval_depth + 1;
+
+	t->steps = ctx->task_slice;
+	err = eval_resume(ctx, t, &result);
+
+	ctx->task = outer;
+	ctx->task_depth = outer_depth;
+
+	/* Blocked on its first step */
+	progress = !(err == Error_Yield && t->steps == ctx->task_slice - 1);
+
+	if (err == Error_Yield) {
+		queue_push(ctx, task);
+	} else {
+		gc_barrier(ctx, t->expr);
+		gc_barrier(ctx, t->env);
+		gc_barrier(ctx, t->stack);
+		gc_barrier(ctx, t->result);
+		t->expr = t->env = t->stack = nil;
+		t->result = result;
+		t->err = err;
+		t->done = 1;
+	}
+
+	ctx->roots = root.next;
+
+	return progress;
+}
+
+/* Called in a loop until the caller's condition holds */
+static int task_wait(Interp *ctx, long *idle)
+{
+	if (ctx->task && ctx->eval_depth == ctx->task_depth)
+		return Error_Yield;
+
+	if (schedule(ctx))
+		*idle = 0;
+	else if (++*idle > ctx->run_count)
+		return Error_Deadlock;
+
+	return Error_OK;
+}
+
+int builtin_spawn(Interp *ctx, Atom args, Atom *result)
+{
+	Atom fn;
+
+	if (nilp(args))
+		return Error_Args;
+
+	/* Tasks belong to the main interpreter */
+	if (ctx->parent)
+		return Error_Type;
+
+	fn = car(args);
+	if (fn.type != AtomType_Builtin && fn.type != AtomType_Closure
+			&& fn.type != AtomType_Compiled)
+		return Error_Type;
+
+	*result = make_task(ctx, make_call(ctx, fn, cdr(args)), ctx->env);
+	queue_push(ctx, *result);
+
+	return Error_OK;
+}
+
+int builtin_yield(Interp *ctx, Atom args, Atom *result)
+{
+	if (!nilp(args))
+		return Error_Args;
+
+	if (ctx->parent)
+		return Error_Type;
+
+	/* End the slice after this step, or let one other task run */
+	if (ctx->task && ctx->eval_depth == ctx->task_depth)
+		ctx->task->steps = 0;
+	else
+		schedule(ctx);
+
+	*result = nil;
+	return Error_OK;
+}
+
+int builtin_join(Interp *ctx, Atom args, Atom *result)
+{
+	struct Task *t;
+	long idle = 0;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Task || ctx->parent)
+		return Error_Type;
+
+	t = car(args).value.task;
+	while (!t->done) {
+		err = task_wait(ctx, &idle);
+		if (err)
+			return err;
+	}
+
+	*result = t->result;
+	return t->err;
+}
+
+int builtin_make_channel(Interp *ctx, Atom args, Atom *result)
+{
+	if (!nilp(args))
+		return Error_Args;
+
+	*result = make_channel(ctx);
+	return Error_OK;
+}
+
+int builtin_channel_send(Interp *ctx, Atom args, Atom *result)
+{
+	struct Channel *c;
+	Atom cell;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Channel || ctx->parent)
+		return Error_Type;
+
+	c = car(args).value.channel;
+	cell = cons(ctx, car(cdr(args)), nil);
+	if (nilp(c->head)) {
+		gc_barrier(ctx, c->head);
+		c->head = cell;
+	} else {
+		set_cdr(ctx, c->tail, cell);
+	}
+	gc_barrier(ctx, c->tail);
+	c->tail = cell;
+
+	*result = nil;
+	return Error_OK;
+}
+
+int builtin_channel_receive(Interp *ctx, Atom args, Atom *result)
+{
+	struct Channel *c;
+	long idle = 0;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type != AtomType_Channel || ctx->parent)
+		return Error_Type;
+
+	c = car(args).value.channel;
+	while (nilp(c->head)) {
+		err = task_wait(ctx, &idle);
+		if (err)
+			return err;
+	}
+
+	*result = car(c->head);
+	gc_barrier(ctx, c->head);
+	c->head = cdr(c->head);
+	if (nilp(c->head)) {
+		gc_barrier(ctx, c->tail);
+		c->tail = nil;
+	}
+
+	return Error_OK;
+}
@@ -0,0 +1,83 @@
+;;
+;; Array kernel benchmark: lisp tools/arrays.lisp
+;;
+;; Runs each bulk ARRAY- operation over 100,000 integers and checks its
+;; result against the same computation as a fold over a list; CHECK
+;; prints a list of T. Then runs all the folds ten times and all the
+;; array operations a hundred times. Run it with just one of the two
+;; REPEAT lines at the end to time each side.
+;;
+
+(define n 100000)
+
+;; Integers in [-500, 500) from a linear congruential generator
+(define (mod x m) (- x (* m (/ x m))))
+
+(define (numbers seed k acc)
+  (if (= k 0)
+      acc
+      (numbers (mod (+ (* seed 1103515245) 12345) 2147483648)
+               (- k 1)
+               (cons (- (mod (/ seed 65536) 1000) 500) acc))))
+
+(define xs (numbers 1 n nil))
+(define ys (numbers 2 n nil))
+(define a (list->array xs))
+(define b (list->array ys))
+
+(define (zip-with f xs ys acc)
+  (if xs
+      (zip-with f (cdr xs) (cdr ys) (cons (f (car xs) (car ys)) acc))
+      (reverse acc)))
+
+(define (list-sum xs) (foldl + 0 xs))
+(define (list-dot xs ys) (foldl + 0 (zip-with * xs ys nil)))
+(define (list-min xs) (foldl (lambda (m x) (if (< x m) x m)) (car xs) (cdr xs)))
+(define (list-max xs) (foldl (lambda (m x) (if (< m x) x m)) (car xs) (cdr xs)))
+(define (list-add xs ys) (zip-with + xs ys nil))
+(define (list-scale xs k) (map (lambda (x) (* x k)) xs))
+
+(define (list-prefix-sum xs)
+  (reverse (foldl (lambda (acc x) (cons (+ x (if acc (car acc) 0)) acc)) nil xs)))
+
+(define (list-filter xs k)
+  (reverse (foldl (lambda (acc x) (if (< k x) (cons x acc) acc)) nil xs)))
+
+(define (check)
+  (list (= (array-sum a) (list-sum xs))
+        (= (array-dot a b) (list-dot xs ys))
+        (= (array-min a) (list-min xs))
+        (= (array-max a) (list-max xs))
+        (equal? (array->list (array-add a b)) (list-add xs ys))
+        (equal? (array->list (array-scale a 3)) (list-scale xs 3))
+        (equal? (array->list (array-prefix-sum a)) (list-prefix-sum xs))
+        (equal? (array->list (array-filter a '> 100)) (list-filter xs 100))))
+
+(define (lists)
+  (list-sum xs)
+  (list-dot xs ys)
+  (list-min xs)
+  (list-max xs)
+  (list-add xs ys)
+  (list-scale xs 3)
+  (list-prefix-sum xs)
+  (list-filter xs 100))
+
+(define (arrays)
+  (array-sum a)
+  (array-dot a b)
+  (array-min a)
+  (array-max a)
+  (array-add a b)
+  (array-scale a 3)
+  (array-prefix-sum a)
+  (array-filter a '> 100))
+
+(define (repeat f k)
+  (if (= k 0)
+      'done
+      (begin (f) (repeat f (- k 1)))))
+
+(check)
+(repeat lists 10)
+(repeat arrays 100)
@@ -0,0 +1,225 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Client for lisp -S. Sends the request read from stdin and copies the
+ * response to stdout, or with -n sends it repeatedly and reports the
+ * request rate and latency. With -e it instead starts the given
+ * program once per request, to compare with per-process invocation.
+ */
+
+static const char *socket_path;
+static const char *program;
+static char *request;
+static size_t request_len;
+static double *latencies;
+static long requests_per_thread;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Copy everything from fd to out, or discard it if out is negative */
+static int drain(int fd, int out)
+{
+	char buf[4096];
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (out >= 0 && write_all(out, buf, n) < 0)
+			return -1;
+	}
+	return n < 0 ? -1 : 0;
+}
+
+static int send_request(int out)
+{
+	struct sockaddr_un addr;
+	int fd, err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror(socket_path);
+		exit(1);
+	}
+
+	err = write_all(fd, request, request_len);
+	shutdown(fd, SHUT_WR);
+	if (!err)
+		err = drain(fd, out);
+	close(fd);
+
+	return err;
+}
+
+static int run_program(int out)
+{
+	int in[2], status;
+	pid_t pid;
+
+	if (pipe(in) < 0)
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		if (out < 0)
+			out = open("/dev/null", O_WRONLY);
+		dup2(out, STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		execl(program, program, (char *) NULL);
+		_exit(127);
+	}
+
+	close(in[0]);
+	write_all(in[1], request, request_len);
+	close(in[1]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+
+	return WEXITSTATUS(status) ? -1 : 0;
+}
+
+static int one_request(int out)
+{
+	return program ? run_program(out) : send_request(out);
+}
+
+static void *bench_thread(void *arg)
+{
+	double *lat = arg;
+	long i;
+
+	for (i = 0; i < requests_per_thread; ++i) {
+		double start = now();
+		if (one_request(-1) < 0) {
+			fprintf(stderr, "request failed\n");
+			exit(1);
+		}
+		lat[i] = now() - start;
+	}
+
+	return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static char *read_stdin(size_t *len)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+		}
+		n = read(STDIN_FILENO, buf + *len, size - *len);
+		if (n > 0)
+			*len += n;
+	} while (n > 0);
+
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	long requests = 0, total;
+	int concurrency = 1, opt, i;
+	double start, elapsed;
+
+	while ((opt = getopt(argc, argv, "n:c:e:")) != -1) {
+		switch (opt) {
+		case 'n':
+			requests = atol(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'e':
+			program = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (!program) {
+		if (optind >= argc)
+			goto usage;
+		socket_path = argv[optind];
+	}
+
+	request = read_stdin(&request_len);
+
+	if (requests <= 0)
+		return one_request(STDOUT_FILENO) < 0;
+
+	if (concurrency < 1)
+		concurrency = 1;
+	requests_per_thread = (requests + concurrency - 1) / concurrency;
+	total = requests_per_thread * concurrency;
+	latencies = malloc(total * sizeof(double));
+	threads = malloc(concurrency * sizeof(pthread_t));
+
+	start = now();
+	for (i = 0; i < concurrency; ++i)
+		pthread_create(&threads[i], NULL, bench_thread,
+			latencies + i * requests_per_thread);
+	for (i = 0; i < concurrency; ++i)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+
+	qsort(latencies, total, sizeof(double), compare_double);
+	printf("%ld requests, %d concurrent, %.3f s\n", total, concurrency, elapsed);
+	printf("%.1f requests/s\n", total / elapsed);
+	printf("p50 %.3f ms, p99 %.3f ms\n",
+		latencies[total / 2] * 1e3, latencies[total * 99 / 100] * 1e3);
+
+	free(threads);
+	free(latencies);
+	free(request);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-n requests [-c concurrency]] "
+		"(socket | -e program) < request\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,29 @@
+;;
+;; Closure call benchmark: lisp -j 0 tools/closures.lisp
+;;
+;; Binds a procedure with many parameters, and creates and calls
+;; inner lambdas inside hot loops. Macros such as let and begin are
+;; left out, since expanding them on every iteration would dominate.
+;;
+
+(define (wide a0 a1 a2 a3 a4 a5 a6 a7 a8 a9 a10 a11 a12 a13 a14 a15 a16 a17 a18 a19 a20 a21 a22 a23 a24 a25 a26 a27 a28 a29 a30 a31)
+  a0)
+
+(define (wide-loop n acc)
+  (if (= n 0)
+      acc
+      (wide-loop (- n 1) (+ acc (wide n 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31)))))
+
+(define (inner-loop n acc)
+  (if (= n 0)
+      acc
+      (inner-loop (- n 1) ((lambda (x y z) (+ x y z)) n acc 1))))
+
+(define (rest-loop n acc)
+  (if (= n 0)
+      acc
+      (rest-loop (- n 1) ((lambda (a . more) (+ acc a)) n 1 2 3))))
+
+(wide-loop 100000 0)
+(inner-loop 300000 0)
+(rest-loop 300000 0)
@@ -0,0 +1,25 @@
+;;
+;; Long list benchmark: lisp tools/lists.lisp
+;;
+;; Keeps four lists of a million elements alive and walks one of them
+;; ten times. Compare the peak RSS with that of the MAKE-VECTOR line
+;; alone to see what the lists cost.
+;;
+
+(define (sum xs acc)
+  (if xs
+      (sum (cdr xs) (+ acc (car xs)))
+      acc))
+
+(define (walk xs k acc)
+  (if (= k 0)
+      acc
+      (walk xs (- k 1) (+ acc (sum xs 0)))))
+
+(define v (make-vector 1000000 1))
+(define a (vector->list v))
+(define b (vector->list v))
+(define c (vector->list v))
+(define d (vector->list v))
+
+(walk a 10 0)
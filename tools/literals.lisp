@@ -0,0 +1,41 @@
+;;
+;; Literal benchmark: lisp [-H] tools/literals.lisp
+;;
+;; Reads two hundred thousand quoted table entries drawn from a hundred
+;; distinct ones, as a generated configuration or test table would be,
+;; and keeps them all. With -H the equal entries are one shared object:
+;; compare the peak RSS and time of the two runs.
+;;
+
+(define n 200000)
+(define batch 1000)
+
+(define (entry i)
+  (define k (number->string (remainder i 100)))
+  (string-append "'(entry-" k " \"label " k "\" (weight 1 2 3) #(on off "
+                 k ") ((red . 1) (green . 2) (blue . 3)))\n"))
+
+(define (batch-text start)
+  (define out (open-output-string))
+  (define (fill i)
+    (if (= i batch)
+        (get-output-string out)
+        (begin
+          (write-string (entry (+ start i)) out)
+          (fill (+ i 1)))))
+  (fill 0))
+
+(define (read-batch port acc)
+  (define x (read port))
+  (if x
+      (read-batch port (cons (car (cdr x)) acc))
+      acc))
+
+(define (load-all start acc)
+  (if (< start n)
+      (load-all (+ start batch)
+                (read-batch (open-input-string (batch-text start)) acc))
+      acc))
+
+(define table (load-all 0 nil))
+(length table)
@@ -0,0 +1,20 @@
+;;
+;; Parallel map benchmark: lisp -p THREADS tools/parallel.lisp
+;;
+;; Maps a comparison-heavy loop over 64 items. Every = and < returns
+;; the symbol T, which workers used to fetch under the parent's lock.
+;; Compare the time for -p 1 with that for as many threads as there
+;; are CPUs.
+;;
+
+(define (work n acc)
+  (if (= n 0)
+      acc
+      (work (- n 1) (if (< (remainder n 7) 3) (+ acc 1) acc))))
+
+(define (iota n acc)
+  (if (= n 0)
+      acc
+      (iota (- n 1) (cons n acc))))
+
+(length (parallel-map (lambda (i) (work 3000 i)) (iota 64 nil)))
@@ -0,0 +1,131 @@
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Collector pause benchmark. Keeps a long list alive, then times many
+ * small requests that each make garbage; the slow ones are those that
+ * ran a collection, so the tail of the latencies is the pause time.
+ * Compare the default with an incremental budget, e.g.
+ *
+ *	tools/pauses
+ *	tools/pauses -i 100
+ *
+ * It also times one full collection of the live list first, which is
+ * mostly marking since the sweep is left to cons: compare -g 1, 2, 4
+ * on a large heap such as -n 50000000.
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static const char *setup =
+	"(define (garbage n) (if (= n 0) nil (drop (cons n n) (- n 1))))\n"
+	"(define (drop x n) (garbage n))\n";
+
+int main(int argc, char **argv)
+{
+	long live = 1000000, requests = 20000, budget = 0, i;
+	int threads = 1;
+	double *latencies, start, elapsed;
+	struct Root root;
+	Interp *ctx;
+	Atom result;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "g:i:n:r:")) != -1) {
+		switch (opt) {
+		case 'g':
+			threads = atoi(optarg);
+			break;
+		case 'i':
+			budget = atol(optarg);
+			break;
+		case 'n':
+			live = atol(optarg);
+			break;
+		case 'r':
+			requests = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-g gc-threads] [-i gc-step-budget] "
+				"[-n live-pairs] [-r requests]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	ctx = interp_create();
+	if (!ctx)
+		return 1;
+	ctx->gc_budget = budget;
+	ctx->gc_threads = threads;
+
+	/*
+	 * Pair by pair with garbage in between, as a Lisp loop would leave
+	 * it, but from C: a loop would mark the growing list every so many
+	 * steps, taking quadratic time. Collecting every million pairs
+	 * instead lets later pairs reuse the space of the garbage.
+	 */
+	result = nil;
+	gc_protect(ctx, &root, &result, 1);
+	for (i = 0; i < live; ++i) {
+		int k;
+		for (k = 0; k < 6; ++k)
+			cons(ctx, nil, nil);
+		result = cons(ctx, make_int(i), result);
+		if (i % 1000000 == 999999) {
+			gc(ctx);
+			gc_step(ctx, 0);
+		}
+	}
+	ctx->roots = root.next;
+	env_define(ctx, ctx->env, make_sym(ctx, "LIVE"), result);
+
+	if (interp_eval_string(ctx, setup, &result)) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+
+	/* Finish any cycle the setup left running, then time a full one */
+	gc_step(ctx, 0);
+	start = now();
+	gc(ctx);
+	printf("%ld live pairs, %d marking threads: collection %.1f ms\n",
+		live, threads, (now() - start) * 1e3);
+	gc_step(ctx, 0);
+
+	latencies = malloc(requests * sizeof(double));
+	start = now();
+	for (i = 0; i < requests; ++i) {
+		double t = now();
+		if (interp_eval_string(ctx, "(garbage 100)", &result)) {
+			fprintf(stderr, "request failed\n");
+			return 1;
+		}
+		latencies[i] = now() - t;
+	}
+	elapsed = now() - start;
+
+	qsort(latencies, requests, sizeof(double), compare_double);
+	printf("budget %ld: %ld requests, %.3f s\n", budget, requests, elapsed);
+	printf("p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+		latencies[requests / 2] * 1e3, latencies[requests * 99 / 100] * 1e3,
+		latencies[requests - 1] * 1e3);
+
+	free(latencies);
+	interp_destroy(ctx);
+	return 0;
+}
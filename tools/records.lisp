@@ -0,0 +1,50 @@
+;;
+;; Record benchmark: lisp tools/records.lisp
+;;
+;; Builds 200,000 objects of four fields, once as alists and once as
+;; records, and sums their last field ten times over. Run it with one
+;; of the two lines at the end commented out to time each and compare
+;; their peak RSS with that of the DEFINE-RECORD-TYPE line alone.
+;;
+
+(define n 200000)
+
+(define (assq key alist)
+  (if alist
+      (if (eq? (car (car alist)) key)
+          (car alist)
+          (assq key (cdr alist)))
+      nil))
+
+(define (make-alist i)
+  (list (cons 'id i) (cons 'name 'item) (cons 'parent nil) (cons 'weight i)))
+
+(define-record-type item (make-item id name parent weight) item?
+  (id item-id) (name item-name) (parent item-parent) (weight item-weight))
+
+(define (build make i acc)
+  (if (= i n)
+      acc
+      (build make (+ i 1) (cons (make i) acc))))
+
+(define (sum get xs acc)
+  (if xs
+      (sum get (cdr xs) (+ acc (get (car xs))))
+      acc))
+
+(define (repeat get xs k acc)
+  (if (= k 0)
+      acc
+      (repeat get xs (- k 1) (+ acc (sum get xs 0)))))
+
+(define (alist-weight a) (cdr (assq 'weight a)))
+
+(define (alists)
+  (repeat alist-weight (build make-alist 0 nil) 10 0))
+
+(define (records)
+  (repeat item-weight
+          (build (lambda (i) (make-item i 'item nil i)) 0 nil) 10 0))
+
+(alists)
+(records)
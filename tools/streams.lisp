@@ -0,0 +1,32 @@
+;;
+;; Pipeline benchmark: lisp tools/streams.lisp
+;;
+;; Keeps the odd numbers in /tmp/numbers.txt, squares them and sums
+;; the squares, once through lists and once through streams. Create
+;; the input with seq 10000000 > /tmp/numbers.txt, and compare the
+;; peak RSS of running just one of the two pipelines.
+;;
+
+(define (odd-number? x) (= (- x (* (/ x 2) 2)) 1))
+(define (square x) (* x x))
+
+(define (read-all port)
+  (define eof (list 'eof))
+  (define (next acc)
+    (let ((x (read port eof)))
+      (if (eq? x eof)
+          (reverse acc)
+          (next (cons x acc)))))
+  (next nil))
+
+(define (filter pred list)
+  (reverse (foldl (lambda (acc x) (if (pred x) (cons x acc) acc)) nil list)))
+
+(define (list-pipeline path)
+  (foldl + 0 (map square (filter odd-number? (read-all (open-input-file path))))))
+
+(define (stream-pipeline path)
+  (stream-fold + 0 (stream-map square (stream-filter odd-number? (stream-from-file path)))))
+
+(list-pipeline "/tmp/numbers.txt")
+(stream-pipeline "/tmp/numbers.txt")
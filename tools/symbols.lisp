@@ -0,0 +1,37 @@
+;;
+;; Symbol soak test: lisp tools/symbols.lisp
+;;
+;; Reads a hundred million distinct identifiers in batches, keeping none
+;; of them, and checks that a symbol the program does hold keeps its
+;; identity throughout. Peak RSS should be no higher than for a run
+;; with N a hundred times smaller.
+;;
+
+(define n 100000000)
+(define batch 10000)
+
+(define (batch-text start)
+  (define out (open-output-string))
+  (define (fill i)
+    (if (= i batch)
+        (get-output-string out)
+        (begin
+          (write-string (string-append "id-" (number->string (+ start i)) "\n") out)
+          (fill (+ i 1)))))
+  (fill 0))
+
+(define (read-batch port)
+  (if (read port)
+      (read-batch port)
+      nil))
+
+(define kept (read (open-input-string "id-42")))
+
+(define (soak start)
+  (if (< start n)
+      (begin
+        (read-batch (open-input-string (batch-text start)))
+        (soak (+ start batch)))
+      (eq? kept (string->symbol "ID-42"))))
+
+(soak 0)
@@ -0,0 +1,57 @@
+;;
+;; Lookup benchmark: lisp tools/tables.lisp
+;;
+;; Looks up keys spread over tables of 10, 1,000 and 1,000,000 integer
+;; keys, once in an alist and once in an EQ hash table, and sums what
+;; it finds; both sides of a pair print the same sum. Run it with all
+;; but one of the lines at the end commented out to time each, which
+;; includes building the table. The alist of a million gets a thousandth
+;; of the lookups, since each one walks half of it.
+;;
+
+(define (assq key alist)
+  (if alist
+      (if (eq? (car (car alist)) key)
+          (car alist)
+          (assq key (cdr alist)))
+      nil))
+
+(define (build-alist i n acc)
+  (if (= i n)
+      acc
+      (build-alist (+ i 1) n (cons (cons i (* 2 i)) acc))))
+
+(define (build-table i n table)
+  (if (= i n)
+      table
+      (build-table (+ i 1) n (fill table i))))
+
+(define (fill table i)
+  (hash-table-set! table i (* 2 i))
+  table)
+
+;; The kth key looked up, stepping through the keys in a scattered order
+(define (key k n) (- (* k 7919) (* n (/ (* k 7919) n))))
+
+(define (sum-alist alist n k acc)
+  (if (= k 0)
+      acc
+      (sum-alist alist n (- k 1) (+ acc (cdr (assq (key k n) alist))))))
+
+(define (sum-table table n k acc)
+  (if (= k 0)
+      acc
+      (sum-table table n (- k 1) (+ acc (hash-table-ref table (key k n))))))
+
+(define (alist n lookups)
+  (sum-alist (build-alist 0 n nil) n lookups 0))
+
+(define (table n lookups)
+  (sum-table (build-table 0 n (make-hash-table 'eq)) n lookups 0))
+
+(alist 10 1000000)
+(table 10 1000000)
+(alist 1000 1000000)
+(table 1000 1000000)
+(alist 1000000 1000)
+(table 1000000 1000000)
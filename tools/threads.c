@@ -0,0 +1,94 @@
+#include "lisp.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Runs independent interpreters on several threads at once, each with
+ * its own arguments, and checks every result. Anything the runtime
+ * still keeps per process rather than per Interp shows up here as a
+ * wrong answer or a crash: make check-threads.
+ */
+
+#define ROUNDS 20
+
+static const char *program =
+	"(define (sum xs acc) (if xs (sum (cdr xs) (+ acc (car xs))) acc))\n"
+	"(define (count n acc) (if (= n 0) acc (count (- n 1) (cons n acc))))\n"
+	"(define (walk k acc) (if (= k 0) acc (walk (- k 1) (+ acc (sum xs 0)))))\n"
+	"(define xs (vector->list (make-vector 20000 seed)))\n"
+	"(+ (walk 20 0) (sum (count 1000 nil) 0))\n";
+
+struct Job {
+	long seed;
+	long failures;
+};
+
+static void *run(void *arg)
+{
+	struct Job *job = arg;
+	char text[64];
+	int round;
+
+	for (round = 0; round < ROUNDS; ++round) {
+		long seed = job->seed + round, expect;
+		Interp *ctx;
+		Atom result;
+		Error err;
+
+		ctx = interp_create();
+		if (!ctx) {
+			++job->failures;
+			continue;
+		}
+
+		snprintf(text, sizeof text, "(define seed %ld)", seed);
+		err = interp_eval_string(ctx, text, &result);
+		if (!err)
+			err = interp_eval_string(ctx, program, &result);
+
+		expect = 20 * 20000 * seed + 1000 * 1001 / 2;
+		if (err || result.type != AtomType_Integer
+				|| result.value.integer != expect) {
+			fprintf(stderr, "seed %ld: error %d, wanted %ld\n",
+				seed, err, expect);
+			++job->failures;
+		}
+
+		interp_destroy(ctx);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : 8, i;
+	pthread_t *threads;
+	struct Job *jobs;
+	long failures = 0;
+
+	if (n < 1) {
+		fprintf(stderr, "usage: %s [threads]\n", argv[0]);
+		return 1;
+	}
+
+	threads = malloc(n * sizeof(pthread_t));
+	jobs = malloc(n * sizeof(struct Job));
+	for (i = 0; i < n; ++i) {
+		jobs[i].seed = 1000 * (i + 1);
+		jobs[i].failures = 0;
+		pthread_create(&threads[i], NULL, run, &jobs[i]);
+	}
+
+	for (i = 0; i < n; ++i) {
+		pthread_join(threads[i], NULL);
+		failures += jobs[i].failures;
+	}
+
+	printf("%d threads, %d interpreters each: %ld failed\n",
+		n, ROUNDS, failures);
+	free(threads);
+	free(jobs);
+	return failures != 0;
+}
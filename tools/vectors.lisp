@@ -0,0 +1,49 @@
+;;
+;; Indexed access benchmark: lisp tools/vectors.lisp
+;;
+;; Reads every element of a 5,000 element table by index, once with
+;; LIST-REF over a list and a thousand times with VECTOR-REF over a
+;; vector, and swaps adjacent elements of the vector a thousand times
+;; over. Run it with all but one of the lines at the end commented out
+;; to time each.
+;;
+
+(define n 5000)
+
+(define xs (vector->list (make-vector n 1)))
+(define v (make-vector n 1))
+
+(define (list-sum i acc)
+  (if (= i n)
+      acc
+      (list-sum (+ i 1) (+ acc (list-ref xs i)))))
+
+(define (vector-sum i acc)
+  (if (= i n)
+      acc
+      (vector-sum (+ i 1) (+ acc (vector-ref v i)))))
+
+;; No BEGIN or LET, whose expansion would dominate the loops
+
+(define (swap i j)
+  (swap-values i j (vector-ref v i) (vector-ref v j)))
+
+(define (swap-values i j a b)
+  (vector-set! v i b)
+  (vector-set! v j a))
+
+(define (vector-swaps i)
+  (if (< i (- n 1))
+      (next-swap i (swap i (+ i 1)))
+      n))
+
+(define (next-swap i ignored) (vector-swaps (+ i 2)))
+
+(define (repeat f k acc)
+  (if (= k 0)
+      acc
+      (repeat f (- k 1) (f))))
+
+(list-sum 0 0)
+(repeat (lambda () (vector-sum 0 0)) 1000 0)
+(repeat (lambda () (vector-swaps 0)) 1000 0)